@@ -0,0 +1,32 @@
+#include "Catch.hpp"
+#include "headers/AtomicPatch.hpp"
+
+TEST_CASE("Test atomic patching", "[AtomicPatch]") {
+	alignas(16) uint8_t code[32];
+	memset(code, 0xCC, sizeof(code));
+
+	SECTION("Patch within one window") {
+		const std::vector<uint8_t> jmp = { 0xE9, 0x11, 0x22, 0x33, 0x44 };
+		REQUIRE(PLH::atomicStore((uint64_t)&code[1], jmp.data(), jmp.size()));
+		REQUIRE(memcmp(&code[1], jmp.data(), jmp.size()) == 0);
+		REQUIRE(code[0] == 0xCC);
+		REQUIRE(code[6] == 0xCC);
+	}
+
+	SECTION("Store refuses a range crossing windows") {
+		const std::vector<uint8_t> bytes(4, 0x90);
+		REQUIRE(PLH::atomicStore((uint64_t)&code[14], bytes.data(), bytes.size()) == false);
+		REQUIRE(code[14] == 0xCC);
+	}
+
+	SECTION("Patch crossing windows goes through the self loop guard") {
+		std::vector<uint8_t> bytes;
+		for (uint8_t i = 0; i < 20; i++)
+			bytes.push_back(i);
+
+		REQUIRE(PLH::atomicPatch((uint64_t)&code[6], bytes));
+		REQUIRE(memcmp(&code[6], bytes.data(), bytes.size()) == 0);
+		REQUIRE(code[5] == 0xCC);
+		REQUIRE(code[26] == 0xCC);
+	}
+}
@@ -41,6 +41,7 @@ TEST_CASE("Minimal Example", "[AsmJit]") {
 }
 
 #include "headers/Detour/X64Detour.hpp"
+#include "headers/Detour/HookChain.hpp"
 #include "headers/CapstoneDisassembler.hpp"
 
 NOINLINE void hookMeInt(int a) {
@@ -254,4 +255,72 @@ TEST_CASE("ILCallback Argument re-writing", "[ILCallback]") {
 		REQUIRE(effectsNTD64.PopEffect().didExecute());
 		REQUIRE(detour.unHook());
 	}
-}
\ No newline at end of file
+}
+NOINLINE int hookMeChain(int a, double b) {
+	volatile int var = a;
+	var += (int)b;
+	return var;
+}
+
+int chainOrder[2] = { 0 };
+int chainCalls = 0;
+
+NOINLINE void chainListener1(int a, double b) {
+	chainOrder[chainCalls++ % 2] = 1;
+	if (a == 1337 && b > 1.0 && b < 2.0)
+		effectsNTD64.PeakEffect().trigger();
+}
+
+NOINLINE void chainListener2(int a, double b) {
+	chainOrder[chainCalls++ % 2] = 2;
+}
+
+TEST_CASE("Hook chain fans out to listeners", "[AsmJit][HookChain]") {
+	PLH::CapstoneDisassembler dis(PLH::Mode::x64);
+	PLH::HookChain chain((char*)&hookMeChain, asmjit::FuncSignatureT<int, int, double>(), dis);
+	REQUIRE(chain.hook() == true);
+	REQUIRE(PLH::HookChain::find((uint64_t)&hookMeChain) == &chain);
+
+	// no listeners, straight through to the original
+	REQUIRE(hookMeChain(1337, 1.5) == 1338);
+
+	chain.addListener((uint64_t)&chainListener1);
+	chain.addListener((uint64_t)&chainListener2);
+
+	chainCalls = 0;
+	effectsNTD64.PushEffect();
+	REQUIRE(hookMeChain(1337, 1.5) == 1338);
+	REQUIRE(effectsNTD64.PopEffect().didExecute());
+	REQUIRE(chainCalls == 2);
+	REQUIRE(chainOrder[0] == 1);
+	REQUIRE(chainOrder[1] == 2);
+
+	// second chain on the same function is refused
+	PLH::HookChain other((char*)&hookMeChain, asmjit::FuncSignatureT<int, int, double>(), dis);
+	REQUIRE(other.hook() == false);
+
+	REQUIRE(chain.removeListener((uint64_t)&chainListener1) == true);
+	REQUIRE(chain.removeListener((uint64_t)&chainListener1) == false);
+	chainCalls = 0;
+	REQUIRE(hookMeChain(1337, 1.5) == 1338);
+	REQUIRE(chainCalls == 1);
+
+	// replaced tables are retired, not kept for the chain's lifetime
+	const size_t pendingBefore = PLH::Reclaimer::singleton().collect();
+	for (int i = 0; i < 100; i++) {
+		chain.addListener((uint64_t)&chainListener1);
+		REQUIRE(chain.removeListener((uint64_t)&chainListener1) == true);
+	}
+	REQUIRE(PLH::Reclaimer::singleton().collect() <= pendingBefore);
+
+	REQUIRE(chain.unHook() == true);
+	REQUIRE(PLH::HookChain::find((uint64_t)&hookMeChain) == nullptr);
+	REQUIRE(hookMeChain(1337, 1.5) == 1338);
+
+	// hooking again builds a new dispatcher, the listeners carry over
+	REQUIRE(chain.hook() == true);
+	chainCalls = 0;
+	REQUIRE(hookMeChain(1337, 1.5) == 1338);
+	REQUIRE(chainCalls == 1);
+	REQUIRE(chain.unHook() == true);
+}
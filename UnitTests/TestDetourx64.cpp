@@ -3,10 +3,22 @@
 //
 #include <Catch.hpp>
 #include "headers/Detour/X64Detour.hpp"
+#include "headers/Detour/MidHook.hpp"
+#include "headers/Detour/ExitHook.hpp"
+#include "headers/Detour/CallSiteHook.hpp"
+#include "headers/Detour/SyscallHook.hpp"
+#include "headers/Detour/DetourPlanner.hpp"
+#include "headers/HookBatch.hpp"
 #include "headers/CapstoneDisassembler.hpp"
 
 #include "headers/tests/TestEffectTracker.hpp"
 
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <intrin.h>
+
 EffectTracker effects;
 
 /**These tests can spontaneously fail if the compiler desides to optimize away
@@ -34,6 +46,23 @@ NOINLINE void h_hookMe1() {
 	return PLH::FnCast(hookMe1Tramp, &hookMe1)();
 }
 
+NOINLINE void hookMeNear() {
+	volatile int var = 1;
+	volatile int var2 = 0;
+	var2 += 3;
+	var2 = var + var2;
+	printf("%d %d\n", var, var2); // 1, 4
+	REQUIRE(var == 1);
+	REQUIRE(var2 == 4);
+}
+uint64_t hookMeNearTramp = NULL;
+
+NOINLINE void h_hookMeNear() {
+	std::cout << "Hook Near Called!" << std::endl;
+	effects.PeakEffect().trigger();
+	return PLH::FnCast(hookMeNearTramp, &hookMeNear)();
+}
+
 NOINLINE void hookMe2() {
 	for (int i = 0; i < 10; i++) {
 		printf("%d\n", i);
@@ -47,6 +76,204 @@ NOINLINE void h_hookMe2() {
 	return PLH::FnCast(hookMe2Tramp, &hookMe2)();
 }
 
+// xor eax, eax; ret. Too short for a 5 byte jmp, the compiler pads it up to the next function
+NOINLINE int hookMeTiny() {
+	return 0;
+}
+uint64_t hookMeTinyTramp = NULL;
+
+NOINLINE int h_hookMeTiny() {
+	effects.PeakEffect().trigger();
+	return PLH::FnCast(hookMeTinyTramp, &hookMeTiny)();
+}
+
+NOINLINE int hookMeQuiesce(int x) {
+	volatile int result = x;
+	for (int i = 0; i < 10; i++)
+		result = result * 3 + i;
+	return result;
+}
+uint64_t hookMeQuiesceTramp = NULL;
+
+// called from several threads, can't touch the effect tracker
+NOINLINE int h_hookMeQuiesce(int x) {
+	return PLH::FnCast(hookMeQuiesceTramp, &hookMeQuiesce)(x);
+}
+
+// spins on cmp/je, both inside what the prologue jmp overwrites, until *rcx is set
+unsigned char hookMeParked[] = {
+	0x80, 0x39, 0x00,	// cmp byte ptr [rcx], 0
+	0x74, 0xFB,			// je 0x0
+	0x31, 0xC0,			// xor eax, eax
+	0xC3				// ret
+};
+uint64_t hookMeParkedTramp = NULL;
+
+NOINLINE int h_hookMeParked(volatile char* release) {
+	return PLH::FnCast(hookMeParkedTramp, &h_hookMeParked)(release);
+}
+
+/**Wait up to a second for the thread's instruction pointer to be in [start, end)**/
+bool waitForThreadIp(HANDLE thread, const uint64_t start, const uint64_t end) {
+	for (int i = 0; i < 1000; i++) {
+		CONTEXT ctx;
+		ctx.ContextFlags = CONTEXT_CONTROL;
+		SuspendThread(thread);
+		const bool gotContext = GetThreadContext(thread, &ctx) != 0;
+		ResumeThread(thread);
+		if (gotContext && ctx.Rip >= start && ctx.Rip < end)
+			return true;
+		Sleep(1);
+	}
+	return false;
+}
+
+NOINLINE int hookMeReclaim(int x) {
+	volatile int result = x;
+	return result + 1;
+}
+uint64_t hookMeReclaimTramp = NULL;
+
+// holds the trampoline address on its stack until released, like a thread preempted just before calling it
+std::atomic<bool> reclaimEntered = false;
+std::atomic<bool> reclaimRelease = false;
+NOINLINE int h_hookMeReclaim(int x) {
+	volatile uint64_t tramp = hookMeReclaimTramp;
+	reclaimEntered = true;
+	while (!reclaimRelease)
+		std::this_thread::yield();
+	return PLH::FnCast((uint64_t)tramp, &hookMeReclaim)(x);
+}
+
+NOINLINE int hookMeOrphan(int x) {
+	volatile int result = x;
+	result *= 3;
+	return result;
+}
+uint64_t hookMeOrphanTramp = NULL;
+
+NOINLINE int h_hookMeOrphan(int x) {
+	effects.PeakEffect().trigger();
+	return PLH::FnCast(hookMeOrphanTramp, &hookMeOrphan)(x);
+}
+
+NOINLINE int hookMeSlot(int x) {
+	volatile int result = x;
+	result += 1;
+	result *= 2;
+	return result;
+}
+uint64_t hookMeSlotTramp = NULL;
+
+NOINLINE int h_hookMeSlot(int x) {
+	effects.PeakEffect().trigger();
+	return PLH::FnCast(hookMeSlotTramp, &hookMeSlot)(x);
+}
+
+NOINLINE int h_hookMeSlot2(int x) {
+	return PLH::FnCast(hookMeSlotTramp, &hookMeSlot)(x) + 100;
+}
+
+unsigned char midHookMe[] = {
+	0x89, 0xC8,             // mov eax, ecx
+	0x83, 0xC0, 0x01,       // add eax, 1 <- hooked
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+	0xC3
+};
+
+NOINLINE void h_midHookMe(PLH::MidHookContext* ctx) {
+	effects.PeakEffect().trigger();
+	if (ctx->rax == 5 && ctx->rcx == 5)
+		ctx->rax = 100;
+}
+
+// the callback blocks until released, like a thread preempted inside it while the hook is removed
+std::atomic<bool> midParkEntered = false;
+std::atomic<bool> midParkRelease = false;
+NOINLINE void h_midHookPark(PLH::MidHookContext* ctx) {
+	midParkEntered = true;
+	while (!midParkRelease)
+		std::this_thread::yield();
+}
+
+// the je from before the hooked instruction lands in the middle of what the jmp overwrites
+unsigned char midHookBranchedInto[] = {
+	0x31, 0xC0,             // xor eax, eax
+	0x85, 0xC9,             // test ecx, ecx
+	0x74, 0x02,             // je 0x8
+	0xFF, 0xC0,             // inc eax <- hooked
+	0xFF, 0xC0,             // inc eax
+	0x90, 0x90, 0x90, 0x90, 0x90,
+	0xC3
+};
+
+NOINLINE int hookMeExit(int depth) {
+	volatile int result = depth;
+	if (depth > 0)
+		result += hookMeExit(depth - 1);
+	return result;
+}
+
+int exitCount = 0;
+uint64_t lastExitValue = 0;
+NOINLINE void h_hookMeExit(PLH::ExitHookContext* ctx) {
+	exitCount++;
+	lastExitValue = ctx->returnValue;
+	REQUIRE(ctx->entryTsc != 0);
+
+	// only the outermost call returns 6
+	if ((int)ctx->returnValue == 6)
+		ctx->returnValue = 106;
+}
+
+NOINLINE int hookMeThrow(int x) {
+	volatile int result = x;
+	if (result < 0)
+		throw std::runtime_error("negative");
+	return result + 1;
+}
+
+NOINLINE int callSiteTarget(int x) {
+	volatile int result = x + 1;
+	return result;
+}
+
+NOINLINE int callSiteCaller(int x) {
+	return callSiteTarget(x) * 2;
+}
+
+// through a pointer, a direct call would be patched too
+int(* volatile callSiteTargetPtr)(int) = &callSiteTarget;
+NOINLINE int h_callSiteTarget(int x) {
+	effects.PeakEffect().trigger();
+	return callSiteTargetPtr(x) + 10;
+}
+
+// the handler sees every syscall the process makes, only NtClose is emulated
+typedef LONG(NTAPI* tNtClose)(HANDLE handle);
+uint32_t ntCloseNumber = 0;
+std::atomic<int> ntCloseEmulated(0);
+bool h_syscall(PLH::SyscallContext* ctx) {
+	if ((uint32_t)ctx->rax != ntCloseNumber)
+		return true;
+
+	ntCloseEmulated++;
+	ctx->rax = 0x1234;
+	return false;
+}
+
+// makes the syscall it's handling itself, which must go to the kernel rather than back here
+tNtClose ntCloseFn = nullptr;
+std::atomic<int> ntCloseNested(0);
+bool h_syscallReentrant(PLH::SyscallContext* ctx) {
+	if ((uint32_t)ctx->rax != ntCloseNumber)
+		return true;
+
+	ntCloseNested++;
+	ctx->rax = (uint64_t)ntCloseFn((HANDLE)ctx->r10);
+	return false;
+}
+
 unsigned char hookMe3[] = {
 0x57, // push rdi 
 0x74,0xf9,
@@ -67,6 +294,49 @@ unsigned char hookMe4[] = {
 	0xc3
 };
 
+unsigned char hookMe5[] = {
+	0x57, // push rdi
+	0x74, 0x10, // je 0x13
+	0x90, 0x90, 0x90, 0x90,
+	0x90, 0x90, 0x90, 0x90,
+	0x90, 0x90, 0x90, 0x90,
+	0x90, 0x90, 0x90, 0x90,
+	0xc3
+};
+
+// too short for a prologue jmp, needs to be cloned
+unsigned char hookMe6[] = {
+	0x31, 0xc0, // xor eax, eax
+	0xff, 0xc0, // inc eax
+	0xc3, // ret
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, // padding
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc
+};
+
+// -fpatchable-function-entry=18,16 style sled
+unsigned char hookMe7[] = {
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+	0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+	0x66, 0x90, // entry: 2 byte nop
+	0xc3
+};
+
+// loop and 25 je leaving the function, then a jmp after the ret back into it so only cloning works. Widening the
+// je pushes the jmp table entry of the loop, which can't be widened, past the reach of its rel8
+unsigned char hookMe8[] = {
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, // branch targets before the function
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,
+	0xe2, 0xee, // loop 0x0, the function starts here
+	0x74, 0xec, 0x74, 0xea, 0x74, 0xe8, 0x74, 0xe6, 0x74, 0xe4,
+	0x74, 0xe2, 0x74, 0xe0, 0x74, 0xde, 0x74, 0xdc, 0x74, 0xda,
+	0x74, 0xd8, 0x74, 0xd6, 0x74, 0xd4, 0x74, 0xd2, 0x74, 0xd0,
+	0x74, 0xce, 0x74, 0xcc, 0x74, 0xca, 0x74, 0xc8, 0x74, 0xc6,
+	0x74, 0xc4, 0x74, 0xc2, 0x74, 0xc0, 0x74, 0xbe, 0x74, 0xbc, // je 0x0
+	0xc3, // ret
+	0xeb, 0xc9, // jmp into the loop
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc
+};
+
 uint64_t nullTramp = NULL;
 NOINLINE void h_nullstub() {
 	volatile int i = 0;
@@ -93,6 +363,18 @@ TEST_CASE("Testing 64 detours", "[x64Detour],[ADetour]") {
 		REQUIRE(effects.PopEffect().didExecute());
 	}
 
+	SECTION("Near trampoline uses rel32 jmp") {
+		PLH::x64Detour detour((char*)&hookMeNear, (char*)&h_hookMeNear, &hookMeNearTramp, dis);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(detour.getJmpEncoding() == PLH::JmpEncoding::Rel32);
+		REQUIRE(PLH::IsWithinRel32((uint64_t)&hookMeNear, hookMeNearTramp));
+
+		effects.PushEffect();
+		hookMeNear();
+		REQUIRE(effects.PopEffect().didExecute());
+		REQUIRE(detour.unHook() == true);
+	}
+
 	SECTION("Loop function") {
 		PLH::x64Detour detour((char*)&hookMe2, (char*)&h_hookMe2, &hookMe2Tramp, dis);
 		REQUIRE(detour.hook() == true);
@@ -112,6 +394,431 @@ TEST_CASE("Testing 64 detours", "[x64Detour],[ADetour]") {
 		REQUIRE(detour.hook() == true);
 	}
 
+	SECTION("Short jcc out of prol is widened") {
+		uint64_t hookMe5Tramp = NULL;
+		PLH::x64Detour detour((char*)&hookMe5, (char*)&h_nullstub, &hookMe5Tramp, dis);
+		REQUIRE(detour.hook() == true);
+
+		// je rel8 -> je rel32 in place, still pointing at the ret
+		unsigned char* tramp = (unsigned char*)hookMe5Tramp;
+		REQUIRE(tramp[1] == 0x0F);
+		REQUIRE(tramp[2] == 0x84);
+		REQUIRE((uint64_t)(hookMe5Tramp + 7 + *(int32_t*)&tramp[3]) == (uint64_t)&hookMe5[19]);
+	}
+
+	SECTION("Patchable entry sled is hooked in place") {
+		uint64_t hookMe7Tramp = NULL;
+		PLH::x64Detour detour((char*)&hookMe7[16], (char*)&h_nullstub, &hookMe7Tramp, dis);
+		detour.setPatchableEntry(true);
+		REQUIRE(detour.hook() == true);
+
+		// long jmp before the entry, short jmp to it at the entry
+		REQUIRE(detour.getCodeCave() < (uint64_t)&hookMe7[16]);
+		REQUIRE(hookMe7[16] == 0xEB);
+		REQUIRE((uint64_t)&hookMe7[18] + (int8_t)hookMe7[17] == detour.getCodeCave());
+		REQUIRE(hookMe7Tramp == (uint64_t)&hookMe7[18]);
+
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(hookMe7[16] == 0x66);
+		REQUIRE(hookMe7[15] == 0x90);
+	}
+
+	SECTION("Hook with other threads suspended") {
+		std::atomic<bool> stop = false;
+		std::thread caller([&stop] {
+			while (!stop)
+				hookMeQuiesce(1);
+		});
+
+		PLH::x64Detour detour((char*)&hookMeQuiesce, (char*)&h_hookMeQuiesce, &hookMeQuiesceTramp, dis);
+		detour.setQuiesceThreads(true);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(PLH::ThreadQuiescer::getLastPauseDuration().count() > 0);
+		REQUIRE(detour.unHook() == true);
+
+		stop = true;
+		caller.join();
+	}
+
+	SECTION("Threads parked inside the prologue are moved to the trampoline and back") {
+		// the test function has to run, copy it somewhere executable
+		unsigned char* fn = (unsigned char*)VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		REQUIRE(fn != nullptr);
+		memcpy(fn, hookMeParked, sizeof(hookMeParked));
+		auto parkedFn = (int(*)(volatile char*))fn;
+
+		volatile char release = 0;
+		int result = -1;
+		std::thread parked([&] {
+			result = parkedFn(&release);
+		});
+		REQUIRE(waitForThreadIp(parked.native_handle(), (uint64_t)fn, (uint64_t)fn + 5));
+
+		// left where it was it would run the middle of the jmp
+		PLH::x64Detour detour((char*)fn, (char*)&h_hookMeParked, &hookMeParkedTramp, dis);
+		detour.setQuiesceThreads(true);
+		REQUIRE(detour.hook() == true);
+		const uint64_t tramp = hookMeParkedTramp;
+		REQUIRE(waitForThreadIp(parked.native_handle(), tramp, tramp + 5));
+
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(waitForThreadIp(parked.native_handle(), (uint64_t)fn, (uint64_t)fn + 5));
+
+		release = 1;
+		parked.join();
+		REQUIRE(result == 0);
+		VirtualFree(fn, 0, MEM_RELEASE);
+	}
+
+	SECTION("Trampoline is only freed once no thread can be inside it") {
+		PLH::x64Detour detour((char*)&hookMeReclaim, (char*)&h_hookMeReclaim, &hookMeReclaimTramp, dis);
+		REQUIRE(detour.hook() == true);
+		const size_t pendingBefore = PLH::Reclaimer::singleton().collect();
+
+		int result = 0;
+		std::thread caller([&result] {
+			result = hookMeReclaim(1);
+		});
+		while (!reclaimEntered)
+			std::this_thread::yield();
+
+		// returns right away, the trampoline is still referenced by the caller
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(PLH::Reclaimer::singleton().getPendingCount() == pendingBefore + 1);
+
+		reclaimRelease = true;
+		caller.join();
+		REQUIRE(result == 2);
+		REQUIRE(PLH::Reclaimer::singleton().collect() <= pendingBefore);
+	}
+
+	SECTION("Trampoline outlives a detour destroyed while hooked") {
+		{
+			PLH::CapstoneDisassembler scopedDis(PLH::Mode::x64);
+			PLH::x64Detour detour((char*)&hookMeOrphan, (char*)&h_hookMeOrphan, &hookMeOrphanTramp, scopedDis);
+			REQUIRE(detour.hook() == true);
+		}
+
+		// left hooked, the trampoline it jumps through must still be there
+		effects.PushEffect();
+		REQUIRE(hookMeOrphan(2) == 6);
+		REQUIRE(effects.PopEffect().didExecute());
+	}
+
+	SECTION("Slot mode enables, disables and retargets without rewriting code") {
+		PLH::x64Detour detour((char*)&hookMeSlot, (char*)&h_hookMeSlot, &hookMeSlotTramp, dis);
+		detour.setSlotMode(true);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(detour.getSlot() % 8 == 0);
+		REQUIRE(detour.isEnabled());
+
+		effects.PushEffect();
+		REQUIRE(hookMeSlot(1) == 4);
+		REQUIRE(effects.PopEffect().didExecute());
+
+		const std::vector<uint8_t> prologue((uint8_t*)&hookMeSlot, (uint8_t*)&hookMeSlot + 16);
+		REQUIRE(detour.setEnabled(false) == true);
+		effects.PushEffect();
+		REQUIRE(hookMeSlot(1) == 4);
+		REQUIRE(!effects.PopEffect().didExecute());
+
+		REQUIRE(detour.setCallback((uint64_t)&h_hookMeSlot2) == true);
+		REQUIRE(detour.setEnabled(true) == true);
+		REQUIRE(hookMeSlot(1) == 104);
+		REQUIRE(std::equal(prologue.begin(), prologue.end(), (uint8_t*)&hookMeSlot));
+
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(hookMeSlot(1) == 4);
+	}
+
+	SECTION("Mid function hook sees and changes registers") {
+		// the test function has to run, copy it somewhere executable
+		unsigned char* fn = (unsigned char*)VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		REQUIRE(fn != nullptr);
+		memcpy(fn, midHookMe, sizeof(midHookMe));
+		auto midHookMeFn = (int(*)(int))fn;
+
+		PLH::MidHook hook((char*)&fn[2], &h_midHookMe, dis);
+		hook.setFunctionStart((uint64_t)fn);
+		REQUIRE(hook.hook() == true);
+
+		effects.PushEffect();
+		REQUIRE(midHookMeFn(5) == 101);
+		REQUIRE(effects.PopEffect().didExecute());
+		REQUIRE(midHookMeFn(6) == 7);
+
+		REQUIRE(hook.unHook() == true);
+		REQUIRE(midHookMeFn(5) == 6);
+		VirtualFree(fn, 0, MEM_RELEASE);
+	}
+
+	SECTION("Mid hook stub keeps working for a thread inside the callback while unhooking") {
+		unsigned char* fn = (unsigned char*)VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		REQUIRE(fn != nullptr);
+		memcpy(fn, midHookMe, sizeof(midHookMe));
+		auto midHookMeFn = (int(*)(int))fn;
+
+		PLH::MidHook hook((char*)&fn[2], &h_midHookPark, dis);
+		hook.setFunctionStart((uint64_t)fn);
+		REQUIRE(hook.hook() == true);
+		const size_t pendingBefore = PLH::Reclaimer::singleton().collect();
+
+		int result = 0;
+		std::thread caller([&result, midHookMeFn] {
+			result = midHookMeFn(6);
+		});
+		while (!midParkEntered)
+			std::this_thread::yield();
+
+		// the caller still has to return into the stub and jmp through its trampoline holder
+		REQUIRE(hook.unHook() == true);
+		REQUIRE(PLH::Reclaimer::singleton().getPendingCount() == pendingBefore + 1);
+
+		midParkRelease = true;
+		caller.join();
+		REQUIRE(result == 7);
+		REQUIRE(PLH::Reclaimer::singleton().collect() <= pendingBefore);
+		VirtualFree(fn, 0, MEM_RELEASE);
+	}
+
+	SECTION("Mid hook refuses instructions branched into from earlier in the function") {
+		unsigned char* fn = (unsigned char*)VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		REQUIRE(fn != nullptr);
+		memcpy(fn, midHookBranchedInto, sizeof(midHookBranchedInto));
+
+		PLH::MidHook hook((char*)&fn[6], &h_midHookMe, dis);
+		hook.setFunctionStart((uint64_t)fn);
+		REQUIRE(hook.hook() == false);
+		REQUIRE(memcmp(fn, midHookBranchedInto, sizeof(midHookBranchedInto)) == 0);
+
+		// without unwind info or a given start the branch can't be ruled out
+		PLH::MidHook unknownStart((char*)&fn[2], &h_midHookMe, dis);
+		REQUIRE(unknownStart.hook() == false);
+		VirtualFree(fn, 0, MEM_RELEASE);
+	}
+
+	SECTION("Exit hook sees every return, recursion included") {
+		PLH::ExitHook hook((char*)&hookMeExit, &h_hookMeExit, dis);
+		REQUIRE(hook.hook() == true);
+
+		exitCount = 0;
+		REQUIRE(hookMeExit(3) == 106);
+		REQUIRE(exitCount == 4);
+		REQUIRE(lastExitValue == 6);
+		REQUIRE(hook.unHook() == true);
+	}
+
+	SECTION("Exceptions unwind through an exit hooked function") {
+		PLH::ExitHook hook((char*)&hookMeThrow, &h_hookMeExit, dis);
+		REQUIRE(hook.hook() == true);
+
+		// the unwinder has to find the real return address, not the return stub
+		exitCount = 0;
+		bool caught = false;
+		try {
+			hookMeThrow(-1);
+		} catch (const std::runtime_error&) {
+			caught = true;
+		}
+		REQUIRE(caught);
+		REQUIRE(exitCount == 0);
+
+		REQUIRE(hookMeThrow(1) == 2);
+		REQUIRE(exitCount == 1);
+		REQUIRE(lastExitValue == 2);
+		REQUIRE(hook.unHook() == true);
+	}
+
+	SECTION("Call site hook rewrites callers, not the callee") {
+		PLH::CallSiteHook hook((char*)&callSiteTarget, (char*)&h_callSiteTarget, dis);
+		hook.addModule((uint64_t)GetModuleHandle(nullptr));
+		REQUIRE(hook.hook() == true);
+		REQUIRE(hook.getCallSites().size() >= 1);
+
+		effects.PushEffect();
+		REQUIRE(callSiteCaller(1) == 24);
+		REQUIRE(effects.PopEffect().didExecute());
+
+		// the function itself is untouched
+		effects.PushEffect();
+		REQUIRE(callSiteTargetPtr(1) == 2);
+		REQUIRE(!effects.PopEffect().didExecute());
+
+		REQUIRE(hook.unHook() == true);
+		REQUIRE(callSiteCaller(1) == 4);
+	}
+
+	SECTION("Batch hooks all or nothing with one protection change per page") {
+		PLH::x64Detour detour1((char*)&hookMe1, (char*)&h_hookMe1, &hookMe1Tramp, dis);
+		PLH::x64Detour detour2((char*)&hookMe2, (char*)&h_hookMe2, &hookMe2Tramp, dis);
+		PLH::HookBatch batch;
+		batch.add(detour1);
+		batch.add(detour2);
+		REQUIRE(batch.hook() == true);
+		// both functions are in .text, a page each at most
+		REQUIRE(batch.getLastProtectCount() <= 2);
+
+		effects.PushEffect();
+		hookMe1();
+		REQUIRE(effects.PopEffect().didExecute());
+		effects.PushEffect();
+		hookMe2();
+		REQUIRE(effects.PopEffect().didExecute());
+		REQUIRE(batch.unHook() == true);
+
+		// too small without a fallback, the first hook is rolled back
+		PLH::x64Detour detour3((char*)&hookMe1, (char*)&h_hookMe1, &hookMe1Tramp, dis);
+		PLH::x64Detour tiny((char*)&hookMeTiny, (char*)&h_hookMeTiny, &hookMeTinyTramp, dis);
+		PLH::HookBatch failing;
+		failing.add(detour3);
+		failing.add(tiny);
+		REQUIRE(failing.hook() == false);
+
+		effects.PushEffect();
+		hookMe1();
+		REQUIRE(!effects.PopEffect().didExecute());
+	}
+
+	SECTION("Syscall hook intercepts syscalls in ntdll") {
+		// mov r10, rcx; mov eax, number
+		const tNtClose ntClose = (tNtClose)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtClose");
+		REQUIRE(memcmp((void*)ntClose, "\x4C\x8B\xD1\xB8", 4) == 0);
+		memcpy(&ntCloseNumber, (uint8_t*)ntClose + 4, 4);
+
+		PLH::SyscallHook hook(&h_syscall, dis);
+		REQUIRE(hook.addModule(L"ntdll.dll") == true);
+		REQUIRE(hook.hook() == true);
+		REQUIRE(hook.getSites().size() > 100);
+
+		ntCloseEmulated = 0;
+		REQUIRE(ntClose((HANDLE)0x1234) == 0x1234);
+		REQUIRE(ntCloseEmulated == 1);
+
+		// everything else still goes to the kernel
+		MEMORY_BASIC_INFORMATION mbi;
+		REQUIRE(VirtualQuery((void*)ntClose, &mbi, sizeof(mbi)) == sizeof(mbi));
+		REQUIRE(hook.unHook() == true);
+		REQUIRE(ntClose((HANDLE)0x1234) != 0x1234);
+		REQUIRE(ntCloseEmulated == 1);
+	}
+
+	SECTION("Syscalls made by a syscall handler are not handed back to it") {
+		ntCloseFn = (tNtClose)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtClose");
+		memcpy(&ntCloseNumber, (uint8_t*)ntCloseFn + 4, 4);
+		const LONG direct = ntCloseFn((HANDLE)0x1234);
+
+		PLH::SyscallHook hook(&h_syscallReentrant, dis);
+		REQUIRE(hook.addModule(L"ntdll.dll") == true);
+		REQUIRE(hook.hook() == true);
+
+		ntCloseNested = 0;
+		REQUIRE(ntCloseFn((HANDLE)0x1234) == direct);
+		REQUIRE(ntCloseNested == 1);
+		REQUIRE(hook.unHook() == true);
+	}
+
+	SECTION("Detours planned in parallel then committed as a batch") {
+		PLH::x64Detour detour1((char*)&hookMe1, (char*)&h_hookMe1, &hookMe1Tramp, dis);
+		PLH::x64Detour detour2((char*)&hookMe2, (char*)&h_hookMe2, &hookMe2Tramp, dis);
+		PLH::DetourPlanner planner(2);
+		planner.add(detour1);
+		planner.add(detour2);
+		REQUIRE(planner.plan() == true);
+		REQUIRE(detour1.isPlanned());
+		REQUIRE(detour2.isPlanned());
+
+		// nothing written yet
+		effects.PushEffect();
+		hookMe1();
+		REQUIRE(!effects.PopEffect().didExecute());
+
+		PLH::HookBatch batch;
+		batch.add(detour1);
+		batch.add(detour2);
+		REQUIRE(batch.hook() == true);
+
+		effects.PushEffect();
+		hookMe1();
+		REQUIRE(effects.PopEffect().didExecute());
+		effects.PushEffect();
+		hookMe2();
+		REQUIRE(effects.PopEffect().didExecute());
+		REQUIRE(batch.unHook() == true);
+	}
+
+	SECTION("Plan cache saved to disk skips analysis on the next run") {
+		const std::wstring cachePath = L"plh_plan_cache_test.bin";
+		DeleteFileW(cachePath.c_str());
+		{
+			PLH::PlanCache cache(cachePath);
+			PLH::x64Detour detour((char*)&hookMe1, (char*)&h_hookMe1, &hookMe1Tramp, dis);
+			detour.setPlanCache(&cache);
+			REQUIRE(detour.hook() == true);
+			REQUIRE(cache.getHitCount() == 0);
+			REQUIRE(detour.unHook() == true);
+			REQUIRE(cache.getEntryCount() > 0);
+			REQUIRE(cache.save() == true);
+		}
+
+		// as if restarted, the same prologue is found without disassembling it
+		PLH::PlanCache cache(cachePath);
+		REQUIRE(cache.getEntryCount() > 0);
+		PLH::x64Detour detour((char*)&hookMe1, (char*)&h_hookMe1, &hookMe1Tramp, dis);
+		detour.setPlanCache(&cache);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(cache.getHitCount() > 0);
+		REQUIRE(cache.getMissCount() == 0);
+
+		effects.PushEffect();
+		hookMe1();
+		REQUIRE(effects.PopEffect().didExecute());
+		REQUIRE(detour.unHook() == true);
+		DeleteFileW(cachePath.c_str());
+	}
+
+	SECTION("Tiny function jmps through code cave") {
+		PLH::x64Detour detour((char*)&hookMeTiny, (char*)&h_hookMeTiny, &hookMeTinyTramp, dis);
+		detour.setCodeCaveFallback(true);
+		REQUIRE(detour.hook() == true);
+		const uint64_t cave = detour.getCodeCave();
+		REQUIRE(cave != NULL);
+
+		effects.PushEffect();
+		volatile auto result = hookMeTiny();
+		REQUIRE(effects.PopEffect().didExecute());
+
+		// claimed while hooked, a hook on a neighbouring function can't be handed it too
+		REQUIRE(PLH::claimCodeCave(cave, 1) == false);
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(PLH::claimCodeCave(cave, 1) == true);
+		PLH::releaseCodeCave(cave);
+	}
+
+	SECTION("Too short function is cloned") {
+		uint64_t hookMe6Tramp = NULL;
+		PLH::x64Detour detour((char*)&hookMe6, (char*)&h_nullstub, &hookMe6Tramp, dis);
+		REQUIRE(detour.hook() == false);
+
+		detour.setCloneFallback(true);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(detour.isCloned());
+
+		// trampoline is the whole function
+		REQUIRE(PLH::FnCast(hookMe6Tramp, (int(*)())nullptr)() == 1);
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(hookMe6[5] == 0xcc);
+	}
+
+	SECTION("Cloned function whose loop can't reach its jmp table entry is refused") {
+		uint64_t hookMe8Tramp = NULL;
+		PLH::x64Detour detour((char*)&hookMe8[16], (char*)&h_nullstub, &hookMe8Tramp, dis);
+		detour.setFollowJmps(false);
+		detour.setCloneFallback(true);
+		const std::vector<uint8_t> original(hookMe8, hookMe8 + sizeof(hookMe8));
+		REQUIRE(detour.hook() == false);
+		REQUIRE(std::equal(original.begin(), original.end(), hookMe8));
+	}
+
 	SECTION("hook malloc") {
 		PLH::x64Detour detour((char*)&malloc, (char*)&h_hookMalloc, &hookMallocTramp, dis);
 		effects.PushEffect(); // catch does some allocations, push effect first so peak works
@@ -124,4 +831,86 @@ TEST_CASE("Testing 64 detours", "[x64Detour],[ADetour]") {
 		detour.unHook(); // unhook so we can popeffect safely w/o catch allocation happening again
 		REQUIRE(effects.PopEffect().didExecute());
 	}
-}
\ No newline at end of file
+}
+
+NOINLINE int benchMeRel32(int x) {
+	volatile int var = x;
+	var += 1;
+	var *= 2;
+	return var;
+}
+uint64_t benchMeRel32Tramp = NULL;
+
+NOINLINE int h_benchMeRel32(int x) {
+	return PLH::FnCast(benchMeRel32Tramp, &benchMeRel32)(x);
+}
+
+NOINLINE int benchMeRip(int x) {
+	volatile int var = x;
+	var += 1;
+	var *= 2;
+	return var;
+}
+uint64_t benchMeRipTramp = NULL;
+
+NOINLINE int h_benchMeRip(int x) {
+	return PLH::FnCast(benchMeRipTramp, &benchMeRip)(x);
+}
+
+NOINLINE int benchMePushRet(int x) {
+	volatile int var = x;
+	var += 1;
+	var *= 2;
+	return var;
+}
+uint64_t benchMePushRetTramp = NULL;
+
+NOINLINE int h_benchMePushRet(int x) {
+	return PLH::FnCast(benchMePushRetTramp, &benchMePushRet)(x);
+}
+
+template<typename Fn>
+double cyclesPerCall(Fn fn) {
+	const int iterations = 1000000;
+	volatile int sink = 0;
+
+	// warm up caches and predictors first
+	for (int i = 0; i < 1000; i++)
+		sink = fn(i);
+
+	const uint64_t start = __rdtsc();
+	for (int i = 0; i < iterations; i++)
+		sink = fn(i);
+	const uint64_t end = __rdtsc();
+	return (double)(end - start) / iterations;
+}
+
+// hidden, run explicitly with [benchmark]
+TEST_CASE("Benchmark x64 prologue jmp encodings", "[.][benchmark][x64Detour]") {
+	PLH::CapstoneDisassembler dis(PLH::Mode::x64);
+
+	const double baseline = cyclesPerCall(&benchMeRel32);
+
+	PLH::x64Detour rel32Detour((char*)&benchMeRel32, (char*)&h_benchMeRel32, &benchMeRel32Tramp, dis);
+	REQUIRE(rel32Detour.hook() == true);
+	REQUIRE(rel32Detour.getJmpEncoding() == PLH::JmpEncoding::Rel32);
+
+	PLH::x64Detour ripDetour((char*)&benchMeRip, (char*)&h_benchMeRip, &benchMeRipTramp, dis);
+	ripDetour.setJmpEncoding(PLH::JmpEncoding::RipIndirect);
+	REQUIRE(ripDetour.hook() == true);
+	REQUIRE(ripDetour.getJmpEncoding() == PLH::JmpEncoding::RipIndirect);
+
+	PLH::x64Detour pushRetDetour((char*)&benchMePushRet, (char*)&h_benchMePushRet, &benchMePushRetTramp, dis);
+	pushRetDetour.setJmpEncoding(PLH::JmpEncoding::PushRet);
+	REQUIRE(pushRetDetour.hook() == true);
+	REQUIRE(pushRetDetour.getJmpEncoding() == PLH::JmpEncoding::PushRet);
+
+	std::cout << "cycles per call, unhooked:      " << baseline << std::endl;
+	std::cout << "cycles per call, rel32:         " << cyclesPerCall(&benchMeRel32) << std::endl;
+	std::cout << "cycles per call, jmp [rip]:     " << cyclesPerCall(&benchMeRip) << std::endl;
+	std::cout << "cycles per call, push/ret:      " << cyclesPerCall(&benchMePushRet) << std::endl;
+
+	REQUIRE(rel32Detour.unHook() == true);
+	REQUIRE(ripDetour.unHook() == true);
+	REQUIRE(pushRetDetour.unHook() == true);
+}
@@ -34,6 +34,23 @@ NOINLINE int __cdecl h_hookMe1() {
 	return PLH::FnCast(hookMe1Tramp, &hookMe1)();
 }
 
+NOINLINE int __cdecl hookMeSlot(int x) {
+	volatile int result = x;
+	result += 1;
+	result *= 2;
+	return result;
+}
+
+uint64_t hookMeSlotTramp = NULL;
+NOINLINE int __cdecl h_hookMeSlot(int x) {
+	effects.PeakEffect().trigger();
+	return PLH::FnCast(hookMeSlotTramp, &hookMeSlot)(x);
+}
+
+NOINLINE int __cdecl h_hookMeSlot2(int x) {
+	return PLH::FnCast(hookMeSlotTramp, &hookMeSlot)(x) + 100;
+}
+
 /*  55                      push   ebp
 1:  8b ec                   mov    ebp,esp
 3:  74 fb                   je     0x0
@@ -64,6 +81,15 @@ b:  7f f4                   jg     0x1
 */
 unsigned char hookMe3[] = {0x55, 0x89, 0xE5, 0x89, 0xE5, 0x89, 0xE5, 0x89, 0xE5, 0x90, 0x90, 0x7F, 0xF4};
 
+// push edi; je 0x13; nop * 16; ret
+unsigned char hookMe4[] = {0x57, 0x74, 0x10, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0xC3};
+
+// xor eax, eax; inc eax; ret; padding. Too short for a prologue jmp, needs to be cloned
+unsigned char hookMe5[] = {0x31, 0xC0, 0x40, 0xC3, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC};
+
+// msvc /hotpatch style: 5 bytes of padding, then mov edi, edi at the entry
+unsigned char hookMe6[] = {0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0x8B, 0xFF, 0x31, 0xC0, 0xC3};
+
 NOINLINE void __declspec(naked) hookMeLoop() {
 	__asm {
 		xor eax, eax
@@ -76,6 +102,20 @@ NOINLINE void __declspec(naked) hookMeLoop() {
 }
 
 uint64_t hookMeLoopTramp = NULL;
+
+// too short for a 5 byte jmp, the compiler pads it up to the next function
+NOINLINE int __declspec(naked) hookMeTiny() {
+	__asm {
+		xor eax, eax
+		ret
+	}
+}
+
+uint64_t hookMeTinyTramp = NULL;
+NOINLINE int __cdecl h_hookMeTiny() {
+	effects.PeakEffect().trigger();
+	return PLH::FnCast(hookMeTinyTramp, &hookMeTiny)();
+}
 NOINLINE void __stdcall h_hookMeLoop() {
 	std::cout << "Hook loop Called!" << std::endl;
 
@@ -138,6 +178,84 @@ TEST_CASE("Testing x86 detours", "[x86Detour],[ADetour]") {
 		REQUIRE(detour.hook() == true);
 	}
 
+	SECTION("Short jcc out of prologue is widened") {
+		uint64_t hookMe4Tramp = NULL;
+		PLH::x86Detour detour((char*)&hookMe4, (char*)&h_nullstub, &hookMe4Tramp, dis);
+		REQUIRE(detour.hook() == true);
+
+		// je rel8 -> je rel32 in place, still pointing at the ret
+		unsigned char* tramp = (unsigned char*)hookMe4Tramp;
+		REQUIRE(tramp[1] == 0x0F);
+		REQUIRE(tramp[2] == 0x84);
+		REQUIRE((uint64_t)(hookMe4Tramp + 7 + *(int32_t*)&tramp[3]) == (uint64_t)&hookMe4[19]);
+	}
+
+	SECTION("Hotpatch entry is hooked in place") {
+		uint64_t hookMe6Tramp = NULL;
+		PLH::x86Detour detour((char*)&hookMe6[5], (char*)&h_nullstub, &hookMe6Tramp, dis);
+		detour.setPatchableEntry(true);
+		REQUIRE(detour.hook() == true);
+
+		// jmp in the padding, short jmp to it at the entry
+		REQUIRE(detour.getCodeCave() == (uint64_t)&hookMe6[0]);
+		REQUIRE(hookMe6[0] == 0xE9);
+		REQUIRE(hookMe6[5] == 0xEB);
+		REQUIRE(hookMe6[6] == 0xF9);
+		REQUIRE(hookMe6Tramp == (uint64_t)&hookMe6[7]);
+
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(hookMe6[0] == 0xCC);
+		REQUIRE(hookMe6[5] == 0x8B);
+	}
+
+	SECTION("Slot mode enables, disables and retargets") {
+		PLH::x86Detour detour((char*)&hookMeSlot, (char*)&h_hookMeSlot, &hookMeSlotTramp, dis);
+		detour.setSlotMode(true);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(detour.getSlot() != NULL);
+
+		effects.PushEffect();
+		REQUIRE(hookMeSlot(1) == 4);
+		REQUIRE(effects.PopEffect().didExecute());
+
+		REQUIRE(detour.setEnabled(false) == true);
+		effects.PushEffect();
+		REQUIRE(hookMeSlot(1) == 4);
+		REQUIRE(!effects.PopEffect().didExecute());
+
+		REQUIRE(detour.setCallback((uint64_t)&h_hookMeSlot2) == true);
+		REQUIRE(detour.setEnabled(true) == true);
+		REQUIRE(hookMeSlot(1) == 104);
+		REQUIRE(detour.unHook() == true);
+	}
+
+	SECTION("Tiny function jmps through code cave") {
+		PLH::x86Detour detour((char*)&hookMeTiny, (char*)&h_hookMeTiny, &hookMeTinyTramp, dis);
+		detour.setCodeCaveFallback(true);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(detour.getCodeCave() != NULL);
+
+		effects.PushEffect();
+		volatile auto result = hookMeTiny();
+		REQUIRE(effects.PopEffect().didExecute());
+		REQUIRE(detour.unHook() == true);
+	}
+
+	SECTION("Too short function is cloned") {
+		uint64_t hookMe5Tramp = NULL;
+		PLH::x86Detour detour((char*)&hookMe5, (char*)&h_nullstub, &hookMe5Tramp, dis);
+		REQUIRE(detour.hook() == false);
+
+		detour.setCloneFallback(true);
+		REQUIRE(detour.hook() == true);
+		REQUIRE(detour.isCloned());
+
+		// trampoline is the whole function
+		REQUIRE(PLH::FnCast(hookMe5Tramp, (int(__cdecl*)())nullptr)() == 1);
+		REQUIRE(detour.unHook() == true);
+		REQUIRE(hookMe5[4] == 0xCC);
+	}
+
 	SECTION("Loop") {
 		PLH::x86Detour detour((char*)&hookMeLoop, (char*)&h_hookMeLoop, &hookMeLoopTramp, dis);
 		REQUIRE(detour.hook() == true);
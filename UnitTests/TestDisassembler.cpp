@@ -3,10 +3,19 @@
 //
 #include "Catch.hpp"
 #include "headers/CapstoneDisassembler.hpp"
+#include "headers/TableDisassembler.hpp"
+#include "headers/CachingDisassembler.hpp"
+
+#include <Windows.h>
 
 #include <iostream>
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <crtdbg.h>
 std::vector<uint8_t> x64ASM = {
 	//start address = 0x1800182B0
 	0x48, 0x89, 0x5C, 0x24, 0x08,           //0) mov QWORD PTR [rsp+0x8],rbx    with child @index 8
@@ -80,6 +89,13 @@ TEST_CASE("Test Capstone Disassembler x64", "[ADisassembler],[CapstoneDisassembl
 		REQUIRE(brMap.find(Instructions[0].getAddress()) != brMap.end());
 	}
 
+	SECTION("Branch map belongs to the disassembler that built it") {
+		PLH::CapstoneDisassembler other(PLH::Mode::x64);
+		other.disassemble((uint64_t)&x64ASM.front(), (uint64_t)&x64ASM.front(), (uint64_t)&x64ASM.front() + 5);
+		REQUIRE(other.getBranchMap().empty());
+		REQUIRE(disasm.getBranchMap().size() == 1);
+	}
+
 	SECTION("Check instruction re-encoding integrity") {
 		Instructions[8].setRelativeDisplacement(0x00);
 		disasm.writeEncoding(Instructions[8]);
@@ -146,6 +162,34 @@ TEST_CASE("Test Capstone Disassembler x64", "[ADisassembler],[CapstoneDisassembl
 										500);
 		std::cout << insts << std::endl;
 	}
+
+	SECTION("Packed instructions match full ones") {
+		const size_t branchCount = disasm.getBranchMap().size();
+		PLH::packed_insts_t packed = disasm.disassemblePacked((uint64_t)&x64ASM.front(), (uint64_t)&x64ASM.front(),
+			(uint64_t)&x64ASM.front() + x64ASM.size());
+		REQUIRE(disasm.getBranchMap().size() == branchCount);
+		REQUIRE(packed.size() == Instructions.size());
+
+		for (size_t i = 0; i < packed.size(); i++) {
+			REQUIRE(packed[i].getAddress() == Instructions[i].getAddress());
+			REQUIRE(packed[i].size() == Instructions[i].size());
+			REQUIRE(memcmp(packed[i].getBytes(), Instructions[i].getBytes().data(), packed[i].size()) == 0);
+			REQUIRE(packed[i].isBranching() == Instructions[i].isBranching());
+			REQUIRE(packed[i].hasDisplacement() == Instructions[i].hasDisplacement());
+			if (packed[i].hasDisplacement())
+				REQUIRE(packed[i].getDestination() == Instructions[i].getDestination());
+
+			PLH::Instruction unpacked = disasm.unpack(packed[i]);
+			REQUIRE(unpacked.getMnemonic() == CorrectMnemonic[i]);
+			REQUIRE(unpacked.getFullName() == Instructions[i].getFullName());
+		}
+
+		REQUIRE(packed[0].getClass() == PLH::InstClass::Other);
+		REQUIRE(packed[8].getClass() == PLH::InstClass::Jcc);
+		REQUIRE(packed[9].getClass() == PLH::InstClass::Call);
+		REQUIRE(packed[10].getClass() == PLH::InstClass::Jmp);
+		REQUIRE(PLH::PackedInstruction(Instructions[8]).getClass() == PLH::InstClass::Jcc);
+	}
 }
 
 // page 590 for jmp types, page 40 for mod/rm table:
@@ -188,6 +232,25 @@ TEST_CASE("Test Capstone Disassembler x86", "[ADisassembler],[CapstoneDisassembl
 		REQUIRE(brMap.find(Instructions[6].getAddress()) != brMap.end());
 	}
 
+	SECTION("Check branch map of a large range") {
+		// 4096 short jmps, each to the next one, the last one leaves the range
+		std::vector<uint8_t> jmps;
+		for (int i = 0; i < 4096; i++)
+			jmps.insert(jmps.end(), { 0xEB, 0x00 });
+
+		PLH::insts_t insts = disasm.disassemble((uint64_t)&jmps.front(), (uint64_t)&jmps.front(),
+			(uint64_t)&jmps.front() + jmps.size());
+		REQUIRE(insts.size() == 4096);
+
+		const PLH::branch_map_t& brMap = disasm.getBranchMap();
+		REQUIRE(brMap.size() == 4095);
+		REQUIRE(brMap.find(insts.front().getAddress()) == brMap.end());
+		for (size_t i = 1; i < insts.size(); i++) {
+			REQUIRE(brMap.at(insts[i].getAddress()).size() == 1);
+			REQUIRE(brMap.at(insts[i].getAddress()).front().getAddress() == insts[i - 1].getAddress());
+		}
+	}
+
 	SECTION("Check instruction re-encoding integrity") {
 		Instructions[3].setRelativeDisplacement(0x00);
 		disasm.writeEncoding(Instructions[3]);
@@ -258,3 +321,385 @@ TEST_CASE("Test Capstone Disassembler x86", "[ADisassembler],[CapstoneDisassembl
 	}
 }
 
+
+std::vector<uint8_t> x64RipASM = {
+	0x48, 0x8D, 0x0D, 0x10, 0x00, 0x00, 0x00,                   //0) lea rcx, [rip + 0x10]
+	0x4C, 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00,                   //1) mov r8, qword ptr [rip + 0x10]
+	0xC7, 0x05, 0x10, 0x00, 0x00, 0x00, 0x78, 0x56, 0x34, 0x12, //2) mov dword ptr [rip + 0x10], 0x12345678
+	0x48, 0x89, 0x1D, 0x10, 0x00, 0x00, 0x00,                   //3) mov qword ptr [rip + 0x10], rbx
+	0x48, 0x89, 0x25, 0x10, 0x00, 0x00, 0x00,                   //4) mov qword ptr [rip + 0x10], rsp
+};
+
+TEST_CASE("Test rip relative data operation rewriting", "[Instruction],[CapstoneDisassembler]") {
+	PLH::CapstoneDisassembler disasm(PLH::Mode::x64);
+	auto insts = disasm.disassemble((uint64_t)&x64RipASM.front(), (uint64_t)&x64RipASM.front(),
+		(uint64_t)&x64RipASM.front() + x64RipASM.size());
+	REQUIRE(insts.size() == 5);
+
+	SECTION("Displacement is re-encoded without touching the immediate") {
+		insts[2].setRelativeDisplacement(0x20);
+		REQUIRE(insts[2].getDispSize() == 4);
+		REQUIRE(*(uint32_t*)&insts[2].getBytes()[6] == 0x12345678);
+	}
+
+	SECTION("Rewritten instructions load the original target") {
+		for (size_t i = 0; i < 4; i++) {
+			const uint64_t target = insts[i].getDestination();
+			REQUIRE(PLH::rewritex64RipRelative(insts[i]));
+			REQUIRE(insts[i].hasDisplacement() == false);
+
+			auto bytes = insts[i].getBytes();
+			auto rewritten = disasm.disassemble((uint64_t)bytes.data(), (uint64_t)0x0, bytes.size());
+			REQUIRE(calcInstsSz(rewritten) == bytes.size());
+
+			// the absolute target is in the first mov, after the red zone skip and push if a scratch was needed
+			auto movAbs = std::find_if(rewritten.begin(), rewritten.end(), [] (const PLH::Instruction& inst) {
+				return inst.size() == 10 && inst.getMnemonic().find("mov") != std::string::npos;
+			});
+			REQUIRE(movAbs != rewritten.end());
+			REQUIRE(*(uint64_t*)&movAbs->getBytes()[2] == target);
+		}
+		REQUIRE(insts[0].size() == 10); // mov rcx, target
+		REQUIRE(insts[1].size() == 13); // mov r8, target; mov r8, [r8]
+	}
+
+	SECTION("Rsp as an operand can't be rewritten") {
+		REQUIRE(PLH::rewritex64RipRelative(insts[4]) == false);
+	}
+
+	SECTION("Evex encodings can't be rewritten") {
+		std::vector<uint8_t> evex = { 0x62, 0xF1, 0xFE, 0x48, 0x6F, 0x05, 0x10, 0x00, 0x00, 0x00 }; // vmovdqu64 zmm0, [rip + 0x10]
+		auto evexInsts = disasm.disassemble((uint64_t)&evex.front(), (uint64_t)&evex.front(),
+			(uint64_t)&evex.front() + evex.size());
+		REQUIRE(evexInsts.size() == 1);
+		REQUIRE(evexInsts[0].hasDisplacement());
+		REQUIRE(PLH::rewritex64RipRelative(evexInsts[0]) == false);
+	}
+}
+
+TEST_CASE("Test Caching Disassembler", "[ADisassembler],[CachingDisassembler]") {
+	PLH::CapstoneDisassembler capstone(PLH::Mode::x64);
+	PLH::CachingDisassembler disasm(PLH::Mode::x64, capstone);
+	PLH::DecodeCache& cache = PLH::DecodeCache::singleton();
+	cache.clear();
+
+	// a copy, the other tests re-encode x64ASM in place
+	std::vector<uint8_t> code = x64ASM;
+	const uint64_t start = (uint64_t)&code.front();
+	const uint64_t end = start + code.size();
+
+	const PLH::insts_t reference = capstone.disassemble(start, start, end);
+	const PLH::insts_t first = disasm.disassemble(start, start, end);
+	REQUIRE(cache.getMissCount() == 1);
+	REQUIRE(cache.getEntryCount() == 1);
+
+	SECTION("Repeated disassembly is served from the cache") {
+		const PLH::insts_t second = disasm.disassemble(start, start, end);
+		REQUIRE(cache.getHitCount() == 1);
+		REQUIRE(second.size() == reference.size());
+		for (size_t i = 0; i < second.size(); i++) {
+			REQUIRE(second[i].getAddress() == reference[i].getAddress());
+			REQUIRE(second[i].getBytes() == reference[i].getBytes());
+			REQUIRE(second[i].getFullName() == reference[i].getFullName());
+			REQUIRE(second[i].isBranching() == reference[i].isBranching());
+			REQUIRE(second[i].getDisplacementOffset() == reference[i].getDisplacementOffset());
+			REQUIRE(second[i].getDispSize() == reference[i].getDispSize());
+			if (reference[i].hasDisplacement())
+				REQUIRE(second[i].getDestination() == reference[i].getDestination());
+			REQUIRE(second[i].getUID() != first[i].getUID());
+		}
+
+		REQUIRE(disasm.getBranchMap().size() == 1);
+		REQUIRE(disasm.getBranchMap().count(start) == 1);
+	}
+
+	SECTION("Shared between disassemblers") {
+		PLH::CapstoneDisassembler capstone2(PLH::Mode::x64);
+		PLH::CachingDisassembler disasm2(PLH::Mode::x64, capstone2);
+		disasm2.disassemble(start, start, end);
+		REQUIRE(cache.getHitCount() == 1);
+
+		// but not between modes
+		PLH::CapstoneDisassembler capstone32(PLH::Mode::x86);
+		PLH::CachingDisassembler disasm32(PLH::Mode::x86, capstone32);
+		disasm32.disassemble(start, start, end);
+		REQUIRE(cache.getHitCount() == 1);
+		REQUIRE(cache.getEntryCount() == 2);
+	}
+
+	SECTION("writeEncoding invalidates what it overwrites") {
+		PLH::Instruction jne = first[8];
+		jne.setRelativeDisplacement(0x00);
+		PLH::ADisassembler::writeEncoding(jne);
+		REQUIRE(cache.getEntryCount() == 0);
+
+		const PLH::insts_t after = disasm.disassemble(start, start, end);
+		REQUIRE(cache.getHitCount() == 0);
+		REQUIRE(after[8].getDestination() == after[9].getAddress());
+	}
+
+	SECTION("Bytes changed by other means are never served") {
+		code[27] = 0x00; // jne displacement
+		const PLH::insts_t after = disasm.disassemble(start, start, end);
+		REQUIRE(cache.getHitCount() == 0);
+		REQUIRE(after[8].getDestination() == after[9].getAddress());
+	}
+}
+
+/**Counts the single instruction decodes a stream asks for**/
+class CountingDisassembler : public PLH::ADisassembler {
+public:
+	CountingDisassembler(PLH::Mode mode, PLH::ADisassembler& inner) : ADisassembler(mode), m_inner(inner) {
+		m_decodes = 0;
+	}
+
+	virtual PLH::insts_t disassemble(uint64_t firstInstruction, uint64_t start, uint64_t end) override {
+		return m_inner.disassemble(firstInstruction, start, end);
+	}
+
+	virtual std::optional<PLH::Instruction> disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) override {
+		m_decodes++;
+		return m_inner.disassembleOne(firstInstruction, start, end);
+	}
+
+	size_t m_decodes;
+private:
+	PLH::ADisassembler& m_inner;
+};
+
+TEST_CASE("Test Instruction Stream", "[ADisassembler],[InstructionStream]") {
+	PLH::CapstoneDisassembler capstone(PLH::Mode::x64);
+	CountingDisassembler disasm(PLH::Mode::x64, capstone);
+
+	std::vector<uint8_t> code = x64ASM;
+	const uint64_t start = (uint64_t)&code.front();
+	const uint64_t end = start + code.size();
+	const PLH::insts_t reference = capstone.disassemble(start, start, end);
+
+	SECTION("Yields what disassemble does") {
+		size_t i = 0;
+		for (const PLH::Instruction& inst : capstone.stream(start, start, end)) {
+			REQUIRE(i < reference.size());
+			REQUIRE(inst.getAddress() == reference[i].getAddress());
+			REQUIRE(inst.getBytes() == reference[i].getBytes());
+			REQUIRE(inst.getFullName() == reference[i].getFullName());
+			REQUIRE(inst.isBranching() == reference[i].isBranching());
+			if (reference[i].hasDisplacement())
+				REQUIRE(inst.getDestination() == reference[i].getDestination());
+			i++;
+		}
+		REQUIRE(i == reference.size());
+
+		// the branch map is still that of the last disassemble
+		REQUIRE(capstone.getBranchMap().size() == 1);
+		REQUIRE(capstone.getBranchMap().count(start) == 1);
+
+		PLH::TableDisassembler table(PLH::Mode::x64, capstone);
+		i = 0;
+		for (const PLH::Instruction& inst : table.stream(start, start, end)) {
+			REQUIRE(inst.size() == reference[i].size());
+			REQUIRE(inst.isBranching() == reference[i].isBranching());
+			i++;
+		}
+		REQUIRE(i == reference.size());
+	}
+
+	SECTION("Only decodes as far as the consumer reads") {
+		// enough for an x64 absolute jmp, as a prologue search would need
+		uint64_t prolSz = 0;
+		for (const PLH::Instruction& inst : disasm.stream(start, start, start + 100)) {
+			prolSz += inst.size();
+			if (prolSz >= 14)
+				break;
+		}
+		REQUIRE(prolSz == 15);
+		REQUIRE(disasm.m_decodes == 4);
+	}
+
+	SECTION("Stops at the end of the range") {
+		// the sub at offset 11 is cut off
+		PLH::InstructionStream insts = disasm.stream(start, start, start + 12);
+		REQUIRE(insts.next().has_value());
+		REQUIRE(insts.next().has_value());
+		REQUIRE(insts.next().has_value());
+		REQUIRE(insts.consumed() == 11);
+		REQUIRE_FALSE(insts.next().has_value());
+		REQUIRE_FALSE(insts.next().has_value());
+		REQUIRE(insts.consumed() == 11);
+		REQUIRE(disasm.m_decodes == 4);
+	}
+}
+
+/**Bounds of the first executable section of a loaded module**/
+static bool firstCodeSection(const uint64_t moduleBase, uint64_t& start, uint64_t& end) {
+	const IMAGE_DOS_HEADER* dos = (IMAGE_DOS_HEADER*)moduleBase;
+	const IMAGE_NT_HEADERS* nt = (IMAGE_NT_HEADERS*)(moduleBase + dos->e_lfanew);
+	const IMAGE_SECTION_HEADER* section = IMAGE_FIRST_SECTION(nt);
+	for (WORD i = 0; i < nt->FileHeader.NumberOfSections; i++, section++) {
+		if (section->Characteristics & IMAGE_SCN_MEM_EXECUTE) {
+			start = moduleBase + section->VirtualAddress;
+			end = start + section->Misc.VirtualSize;
+			return true;
+		}
+	}
+	return false;
+}
+
+// heap allocations while the benchmark's alloc hook is installed, only the debug CRT reports them
+static std::atomic<uint64_t> g_allocations{ 0 };
+
+#ifdef _DEBUG
+static int countAllocations(int allocType, void* userData, size_t size, int blockType, long requestNumber,
+							const unsigned char* filename, int lineNumber) {
+	if (allocType == _HOOK_ALLOC)
+		g_allocations++;
+	return TRUE;
+}
+#endif
+
+// hidden, run explicitly with [benchmark]
+TEST_CASE("Benchmark packed disassembly", "[.][benchmark][CapstoneDisassembler]") {
+	PLH::CapstoneDisassembler disasm(sizeof(void*) == 8 ? PLH::Mode::x64 : PLH::Mode::x86);
+
+	// this binary's own code
+	uint64_t start = 0, end = 0;
+	REQUIRE(firstCodeSection((uint64_t)GetModuleHandleW(nullptr), start, end));
+	end = std::min<uint64_t>(end, start + 0x10000);
+
+	auto measure = [&] (const char* name, auto&& fn) {
+		fn(); // warm up
+		const auto timeBefore = std::chrono::steady_clock::now();
+		size_t count = 0;
+		for (int i = 0; i < 10; i++)
+			count += fn();
+		const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeBefore).count();
+		std::cout << name << (uint64_t)(count / secs) << " insts/sec, ";
+
+		// counted in a separate run, the hook itself would skew the timing
+#ifdef _DEBUG
+		g_allocations = 0;
+		_CRT_ALLOC_HOOK prevHook = _CrtSetAllocHook(&countAllocations);
+		const size_t countedInsts = fn();
+		_CrtSetAllocHook(prevHook);
+		std::cout << (double)g_allocations / countedInsts << " allocations/inst" << std::endl;
+#else
+		std::cout << "allocations are only counted in debug builds" << std::endl;
+#endif
+	};
+
+	measure("disassemble:       ", [&] () { return disasm.disassemble(start, start, end).size(); });
+	measure("disassemblePacked: ", [&] () { return disasm.disassemblePacked(start, start, end).size(); });
+}
+
+/**Entry points of common C runtime and ntdll routines, a corpus of real compiler output**/
+static std::vector<uint64_t> runtimeFunctions() {
+	LoadLibraryW(L"ucrtbase.dll");
+	const char* names[] = { "memcpy", "memmove", "memset", "memcmp", "memchr", "strlen", "strcmp", "strncmp",
+		"strcpy", "strncpy", "strcat", "strchr", "strrchr", "strstr", "strtol", "strtoul", "atoi", "toupper",
+		"tolower", "malloc", "calloc", "realloc", "free", "qsort", "bsearch", "sprintf", "snprintf", "sscanf",
+		"fopen", "fclose", "fread", "fwrite", "fflush", "wcslen", "wcscmp", "_wcsicmp", "_stricmp", "abs", "rand",
+		"RtlAllocateHeap", "RtlFreeHeap", "RtlInitUnicodeString", "RtlEnterCriticalSection",
+		"RtlLeaveCriticalSection", "RtlCompareMemory", "RtlLookupFunctionEntry", "LdrGetProcedureAddress" };
+
+	std::vector<uint64_t> fns;
+	for (const wchar_t* module : { L"ucrtbase.dll", L"ntdll.dll" }) {
+		HMODULE mod = GetModuleHandleW(module);
+		if (mod == NULL)
+			continue;
+
+		for (const char* name : names) {
+			if (FARPROC fn = GetProcAddress(mod, name))
+				fns.push_back((uint64_t)fn);
+		}
+	}
+	return fns;
+}
+
+TEST_CASE("Test Table Disassembler", "[ADisassembler],[TableDisassembler]") {
+	const PLH::Mode mode = sizeof(void*) == 8 ? PLH::Mode::x64 : PLH::Mode::x86;
+	PLH::CapstoneDisassembler capstone(mode);
+	PLH::TableDisassembler table(mode, capstone);
+
+	const std::vector<uint64_t> fns = runtimeFunctions();
+	REQUIRE(fns.size() >= 20);
+
+	SECTION("Lengths and control flow match capstone") {
+		size_t decoded = 0, total = 0;
+		for (const uint64_t fn : fns) {
+			for (const auto& inst : capstone.disassemblePacked(fn, fn, fn + 256)) {
+				total++;
+				PLH::TableDisassembler::Decoded d = {};
+				if (!PLH::TableDisassembler::decode(inst.getBytes(), inst.size(), mode, d))
+					continue;
+
+				decoded++;
+				REQUIRE(d.size == inst.size());
+				REQUIRE(d.branching == inst.isBranching());
+				if (inst.hasDisplacement())
+					REQUIRE(d.needsFull);
+				if (d.instClass != PLH::InstClass::Nop && inst.getClass() != PLH::InstClass::Nop)
+					REQUIRE(d.instClass == inst.getClass());
+			}
+		}
+
+		std::cout << "table decoded " << decoded << " of " << total << " instructions" << std::endl;
+		REQUIRE(decoded * 100 >= total * 99);
+	}
+
+	SECTION("Instructions match capstone's") {
+		for (const uint64_t fn : fns) {
+			const PLH::insts_t reference = capstone.disassemble(fn, fn, fn + 100);
+			const PLH::branch_map_t referenceMap = capstone.getBranchMap();
+			const PLH::insts_t insts = table.disassemble(fn, fn, fn + 100);
+
+			REQUIRE(insts.size() >= reference.size());
+			for (size_t i = 0; i < reference.size(); i++) {
+				REQUIRE(insts[i].getAddress() == reference[i].getAddress());
+				REQUIRE(insts[i].size() == reference[i].size());
+				REQUIRE(insts[i].isBranching() == reference[i].isBranching());
+				REQUIRE(insts[i].hasDisplacement() == reference[i].hasDisplacement());
+				if (reference[i].hasDisplacement())
+					REQUIRE(insts[i].getDestination() == reference[i].getDestination());
+				// what the table names is named the same, give or take prefixes (repz ret, bnd jmp)
+				REQUIRE(reference[i].getMnemonic().find(insts[i].getMnemonic()) != std::string::npos);
+			}
+
+			for (const auto& entry : referenceMap)
+				REQUIRE(table.getBranchMap().count(entry.first) == 1);
+		}
+	}
+
+	SECTION("Text comes from the fallback") {
+		PLH::packed_insts_t packed = table.disassemblePacked((uint64_t)&x64ASM.front(), (uint64_t)&x64ASM.front(),
+			(uint64_t)&x64ASM.front() + x64ASM.size());
+		if (mode == PLH::Mode::x64) {
+			REQUIRE(packed.size() == 11);
+			REQUIRE(table.unpack(packed[3]).getFullName() == capstone.unpack(packed[3]).getFullName());
+			REQUIRE(packed[8].getClass() == PLH::InstClass::Jcc);
+			REQUIRE(packed[8].hasDisplacement());
+		}
+	}
+}
+
+// hidden, run explicitly with [benchmark]
+TEST_CASE("Benchmark table disassembler", "[.][benchmark][TableDisassembler]") {
+	const PLH::Mode mode = sizeof(void*) == 8 ? PLH::Mode::x64 : PLH::Mode::x86;
+	PLH::CapstoneDisassembler capstone(mode);
+	PLH::TableDisassembler table(mode, capstone);
+	const std::vector<uint64_t> fns = runtimeFunctions();
+
+	// the window a Detour disassembles at each function it hooks
+	auto measure = [&fns] (const char* name, PLH::ADisassembler& disasm) {
+		size_t count = 0;
+		const auto timeBefore = std::chrono::steady_clock::now();
+		for (int i = 0; i < 1000; i++) {
+			for (const uint64_t fn : fns)
+				count += disasm.disassemble(fn, fn, fn + 100).size();
+		}
+		const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeBefore).count();
+		std::cout << name << (uint64_t)(count / secs) << " insts/sec" << std::endl;
+	};
+
+	measure("capstone: ", capstone);
+	measure("table:    ", table);
+}
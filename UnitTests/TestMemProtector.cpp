@@ -58,3 +58,31 @@ TEST_CASE("Test setting page protections", "[MemProtector]") {
 	}
 	VirtualFree(page, 4 * 1024, MEM_RELEASE);
 }
+
+TEST_CASE("Test batch restores pages spanning two allocations", "[MemProtector]") {
+	// find room for two neighbouring allocations, then make them separately
+	char* base = (char*)VirtualAlloc(0, 0x20000, MEM_RESERVE, PAGE_NOACCESS);
+	REQUIRE(base != nullptr);
+	VirtualFree(base, 0, MEM_RELEASE);
+	char* first = (char*)VirtualAlloc(base, 0x10000, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	char* second = (char*)VirtualAlloc(base + 0x10000, 0x10000, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	REQUIRE(first == base);
+	REQUIRE(second == base + 0x10000);
+
+	{
+		// last page of the first, first page of the second, restored as one run
+		PLH::ProtectionBatch batch;
+		PLH::MemoryProtector prot((uint64_t)second - 0x1000, 0x2000, PLH::ProtFlag::X | PLH::ProtFlag::R | PLH::ProtFlag::W);
+		REQUIRE(prot.isGood());
+		REQUIRE(batch.getPageCount() == 2);
+	}
+
+	MEMORY_BASIC_INFORMATION mbi;
+	REQUIRE(VirtualQuery(second - 0x1000, &mbi, sizeof(mbi)) == sizeof(mbi));
+	REQUIRE(mbi.Protect == PAGE_READWRITE);
+	REQUIRE(VirtualQuery(second, &mbi, sizeof(mbi)) == sizeof(mbi));
+	REQUIRE(mbi.Protect == PAGE_READWRITE);
+
+	VirtualFree(first, 0, MEM_RELEASE);
+	VirtualFree(second, 0, MEM_RELEASE);
+}
@@ -6,15 +6,102 @@
 #define POLYHOOK_2_0_IDISASSEMBLER_HPP
 
 #include "headers/Instruction.hpp"
+#include "headers/PackedInstruction.hpp"
+#include "headers/DecodeCache.hpp"
 #include "headers/Enums.hpp"
 
 #include <vector>
 #include <unordered_map>
 #include <functional>
+#include <algorithm>
+#include <iterator>
+#include <optional>
 
 namespace PLH {
 typedef std::unordered_map<uint64_t, insts_t> branch_map_t;
 
+class ADisassembler;
+
+/**Instructions of a range decoded one at a time as they are pulled, see ADisassembler::stream. Stops at the end of
+the range or the first bytes that don't decode. Single pass, it can be iterated once.**/
+class InstructionStream {
+public:
+	class iterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef Instruction value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const Instruction* pointer;
+		typedef const Instruction& reference;
+
+		const Instruction& operator*() const {
+			return *m_inst;
+		}
+
+		const Instruction* operator->() const {
+			return &*m_inst;
+		}
+
+		iterator& operator++() {
+			m_inst = m_stream->next();
+			return *this;
+		}
+
+		// only meaningful against end()
+		bool operator==(const iterator& other) const {
+			return m_inst.has_value() == other.m_inst.has_value();
+		}
+
+		bool operator!=(const iterator& other) const {
+			return !(*this == other);
+		}
+	private:
+		friend class InstructionStream;
+
+		iterator(InstructionStream* stream) {
+			m_stream = stream;
+		}
+
+		InstructionStream*			m_stream;
+		std::optional<Instruction>	m_inst;
+	};
+
+	iterator begin() {
+		iterator it(this);
+		it.m_inst = next();
+		return it;
+	}
+
+	iterator end() {
+		return iterator(nullptr);
+	}
+
+	/**Decode the next instruction, empty once the stream is done**/
+	std::optional<Instruction> next();
+
+	/**Bytes decoded so far, the address the next instruction would start at is start + this**/
+	uint64_t consumed() const {
+		return m_address - m_start;
+	}
+private:
+	friend class ADisassembler;
+
+	InstructionStream(ADisassembler& disasm, uint64_t firstInstruction, uint64_t start, uint64_t end) : m_disasm(disasm) {
+		m_code = firstInstruction;
+		m_start = start;
+		m_address = start;
+		m_end = end;
+		m_done = false;
+	}
+
+	ADisassembler&	m_disasm;
+	uint64_t		m_code;
+	uint64_t		m_start;
+	uint64_t		m_address;
+	uint64_t		m_end;
+	bool			m_done; // hit bytes that don't decode
+};
+
 //Abstract Disassembler
 class ADisassembler {
 public:
@@ -22,7 +109,9 @@ public:
 		m_mode = mode;
 	}
 
-	virtual ~ADisassembler() = default;
+	virtual ~ADisassembler() {
+		t_threadStates.erase(this);
+	}
 
 	/**Disassemble a code buffer and return a vector holding the asm instructions info
 	 * @param FirstInstruction: The address of the first instruction
@@ -31,6 +120,61 @@ public:
 	 * **/
 	virtual insts_t disassemble(uint64_t firstInstruction, uint64_t start, uint64_t end) = 0;
 
+	/**Same as disassemble but into PackedInstructions, for scanning large ranges. Doesn't touch the branch map.
+	 * The default packs the output of disassemble, backends override it to skip building the text.**/
+	virtual packed_insts_t disassemblePacked(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+		const insts_t insts = disassembleKeepingBranchMap(firstInstruction, start, end);
+
+		packed_insts_t packed;
+		packed.reserve(insts.size());
+		for (const auto& inst : insts)
+			packed.emplace_back(inst);
+		return packed;
+	}
+
+	/**Decode only the instruction at start, reading from firstInstruction and never past end. Empty if it doesn't
+	 * decode. Doesn't touch the branch map. The default runs disassemble over the longest an instruction can be.**/
+	virtual std::optional<Instruction> disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+		const insts_t insts = disassembleKeepingBranchMap(firstInstruction, start, std::min<uint64_t>(end, start + PackedInstruction::MaxSize));
+		if (insts.empty())
+			return std::nullopt;
+		return insts.front();
+	}
+
+	/**Decode [start, end) lazily, one instruction per step of the returned range, so a consumer that stops early
+	 * only pays for what it looked at. end is just a bound, it can be generous. Arguments are as for disassemble.
+	 * Doesn't touch the branch map, use disassemble where that's needed.**/
+	InstructionStream stream(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+		return InstructionStream(*this, firstInstruction, start, end);
+	}
+
+	/**Produce the text of a packed instruction by decoding its bytes again. False if it doesn't decode.**/
+	virtual bool decodeText(const PackedInstruction& inst, std::string& mnemonic, std::string& opStr) {
+		const insts_t insts = disassembleKeepingBranchMap((uint64_t)inst.getBytes(), inst.getAddress(), inst.getAddress() + inst.size());
+		if (insts.empty())
+			return false;
+
+		mnemonic = insts.front().getMnemonic();
+		opStr = insts.front().getOpStr();
+		return true;
+	}
+
+	/**Expand packed instructions to full ones, for printing them or handing them to the Instruction based API**/
+	Instruction unpack(const PackedInstruction& inst) {
+		std::string mnemonic, opStr;
+		if (!decodeText(inst, mnemonic, opStr))
+			mnemonic = "(bad)";
+		return inst.toInstruction(mnemonic, opStr, m_mode);
+	}
+
+	insts_t unpack(const packed_insts_t& packed) {
+		insts_t insts;
+		insts.reserve(packed.size());
+		for (const auto& inst : packed)
+			insts.push_back(unpack(inst));
+		return insts;
+	}
+
 	static void writeEncoding(const PLH::insts_t& instructions) {
 		for (const auto& inst : instructions)
 			writeEncoding(inst);
@@ -42,9 +186,11 @@ public:
 	* This will not automatically do any code relocation, all relocation logic should
 	* first modify the byte array, and then call write encoding, proper order to relocate
 	* an instruction should be disasm instructions -> set relative/absolute displacement() ->
+	* Cached decodes of the overwritten bytes are dropped.
 	**/
 	static void writeEncoding(const Instruction& instruction) {
 		memcpy((void*)instruction.getAddress(), &instruction.getBytes()[0], instruction.size());
+		DecodeCache::singleton().invalidate(instruction.getAddress(), instruction.size());
 	}
 
 	static bool isConditionalJump(const PLH::Instruction& instruction) {
@@ -85,29 +231,96 @@ public:
 		return instruction.getMnemonic() == "ret";
 	}
 
-	branch_map_t getBranchMap() {
-		return m_branchMap;
+	/**Branches within the range this disassembler last disassembled on this thread, keyed by destination. The
+	 * reference is only valid until its next call to disassemble on the same thread, copy it to keep it longer.**/
+	const branch_map_t& getBranchMap() const {
+		return branchMap();
 	}
 protected:
+	/**This disassembler's branch map on the calling thread, for backends filling it**/
+	branch_map_t& branchMap() const {
+		return t_threadStates[this].branchMap;
+	}
+
+	/**Fill the branch map from instructions laid out back to back, in linear time. Only destinations that start one
+	 * of the instructions are kept. Every start is marked in a table indexed by offset from the first instruction,
+	 * then each branch is resolved with one lookup.**/
+	void buildBranchMap(const insts_t& insts) {
+		ThreadState& state = t_threadStates[this];
+		if (state.keepBranchMap > 0)
+			return;
+
+		state.branchMap.clear();
+		if (insts.empty())
+			return;
+
+		const uint64_t rangeStart = insts.front().getAddress();
+		const uint64_t rangeEnd = insts.back().getAddress() + insts.back().size();
+		std::vector<bool> isInstStart((size_t)(rangeEnd - rangeStart), false);
+		for (const Instruction& inst : insts)
+			isInstStart[(size_t)(inst.getAddress() - rangeStart)] = true;
+
+		for (const Instruction& inst : insts) {
+			if (!inst.isBranching() || !inst.hasDisplacement())
+				continue;
+
+			const uint64_t dest = inst.getDestination();
+			if (dest >= rangeStart && dest < rangeEnd && isInstStart[(size_t)(dest - rangeStart)])
+				updateBranchMap(dest, inst);
+		}
+	}
+
 	typename branch_map_t::mapped_type& updateBranchMap(uint64_t key, const Instruction& new_val) {
-		branch_map_t::iterator it = m_branchMap.find(key);
-		if (it != m_branchMap.end()) {
+		branch_map_t& branches = branchMap();
+		branch_map_t::iterator it = branches.find(key);
+		if (it != branches.end()) {
 			it->second.push_back(new_val);
 		} else {
 			branch_map_t::mapped_type s;
 			s.push_back(new_val);
-			m_branchMap.emplace(key, s);
-			return m_branchMap.at(key);
+			branches.emplace(key, s);
+			return branches.at(key);
 		}
 		return it->second;
 	}
 
 	Mode          m_mode;
+private:
+	/**disassemble with buildBranchMap made a no-op, for the defaults above that mustn't touch the branch map**/
+	insts_t disassembleKeepingBranchMap(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+		struct Keep {
+			ThreadState& state;
+			Keep(ThreadState& s) : state(s) { state.keepBranchMap++; }
+			~Keep() { state.keepBranchMap--; }
+		} keep(t_threadStates[this]);
+		return disassemble(firstInstruction, start, end);
+	}
+
+	struct ThreadState {
+		/* key = address of instruction pointed at (dest of jump). Value = set of unique instruction branching to dest
+		   Must only hold entries from the last segment disassembled. I.E clear every new call to disassemble*/
+		branch_map_t	branchMap;
+		uint32_t		keepBranchMap = 0;
+	};
 
-	/* key = address of instruction pointed at (dest of jump). Value = set of unique instruction branching to dest
-	   Must only hold entries from the last segment disassembled. I.E clear every new call to disassemble
-	*/
-	branch_map_t m_branchMap;
+	/* Per disassembler, per thread, so a disassembler can be used by several threads at once and each sees its own
+	last segment. Node based, references to a state stay valid while other disassemblers add theirs.*/
+	static inline thread_local std::unordered_map<const ADisassembler*, ThreadState> t_threadStates;
 };
+
+inline std::optional<Instruction> InstructionStream::next() {
+	if (m_done || m_address >= m_end)
+		return std::nullopt;
+
+	std::optional<Instruction> inst = m_disasm.disassembleOne(m_code, m_address, m_end);
+	if (!inst) {
+		m_done = true;
+		return std::nullopt;
+	}
+
+	m_code += inst->size();
+	m_address += inst->size();
+	return inst;
+}
 }
 #endif //POLYHOOK_2_0_IDISASSEMBLER_HPP
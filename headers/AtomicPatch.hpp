@@ -0,0 +1,27 @@
+#ifndef POLYHOOK_2_ATOMICPATCH_HPP
+#define POLYHOOK_2_ATOMICPATCH_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <intrin.h>
+
+namespace PLH {
+
+/**Write bytes over code other threads may be running, so that no thread ever executes a mix of old and new
+bytes. A patch within one aligned 8 byte (x64: 16 byte) window is published by a single lock cmpxchg8b/16b.
+A longer one first parks threads entering it on a 2 byte self loop (jmp $), writes everything after the loop,
+then replaces the loop with the real first 2 bytes in a final atomic store. Threads already part way through the
+old bytes aren't covered, patch at an entry. The memory must already be writable. If even the self loop can't be
+stored atomically the bytes are written plainly and false is returned. Nothing is logged or allocated, so it's safe
+to call while a ThreadQuiescer is alive, the caller logs a failure once threads run again.**/
+bool atomicPatch(const uint64_t address, const std::vector<uint8_t>& bytes);
+
+/**Replace [address, address + size) with one locked compare exchange, merging in the surrounding bytes. Returns
+false without writing if the range doesn't fit one aligned 8 byte (x64: 16 byte) window.**/
+bool atomicStore(const uint64_t address, const uint8_t* bytes, const size_t size);
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef POLYHOOK_2_0_CACHINGDISASSEMBLER_HPP
+#define POLYHOOK_2_0_CACHINGDISASSEMBLER_HPP
+
+#include "headers/ADisassembler.hpp"
+#include "headers/DecodeCache.hpp"
+
+#include <typeinfo>
+#include <typeindex>
+
+namespace PLH {
+
+/**Serves disassemble from the process wide DecodeCache, and decodes with the wrapped disassembler on a miss. Hand
+it to hooks in place of the wrapped one. Several of these over disassemblers of the same type share entries, and
+a hit fills the branch map exactly as the wrapped disassembler would have. Single instructions, packed disassembly
+and text are passed straight through.**/
+class CachingDisassembler : public ADisassembler {
+public:
+	CachingDisassembler(PLH::Mode mode, PLH::ADisassembler& inner) : ADisassembler(mode), m_inner(inner) {
+	}
+
+	virtual ~CachingDisassembler() = default;
+
+	virtual insts_t disassemble(uint64_t firstInstruction, uint64_t start, uint64_t end) override {
+		const std::type_index backend(typeid(m_inner));
+		insts_t insts;
+		if (DecodeCache::singleton().find(backend, m_mode, firstInstruction, start, end - start, insts)) {
+			buildBranchMap(insts);
+			return insts;
+		}
+
+		insts = m_inner.disassemble(firstInstruction, start, end);
+		DecodeCache::singleton().add(backend, m_mode, firstInstruction, start, end - start, insts);
+		buildBranchMap(insts);
+		return insts;
+	}
+
+	virtual std::optional<Instruction> disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) override {
+		return m_inner.disassembleOne(firstInstruction, start, end);
+	}
+
+	virtual packed_insts_t disassemblePacked(uint64_t firstInstruction, uint64_t start, uint64_t end) override {
+		return m_inner.disassemblePacked(firstInstruction, start, end);
+	}
+
+	virtual bool decodeText(const PackedInstruction& inst, std::string& mnemonic, std::string& opStr) override {
+		return m_inner.decodeText(inst, mnemonic, opStr);
+	}
+private:
+	ADisassembler& m_inner;
+};
+}
+#endif //POLYHOOK_2_0_CACHINGDISASSEMBLER_HPP
@@ -17,24 +17,25 @@
 
 namespace PLH {
 
+/**Safe to use from several threads at once, see getCapHandle**/
 class CapstoneDisassembler : public ADisassembler {
 public:
 	CapstoneDisassembler(PLH::Mode mode) : ADisassembler(mode) {
-		cs_mode capmode = (mode == PLH::Mode::x64 ? CS_MODE_64 : CS_MODE_32);
-		if (cs_open(CS_ARCH_X86, capmode, &m_capHandle) != CS_ERR_OK)
+		if (getCapHandle() == 0)
 			printf("error opening cap\n");
-
-		cs_option(m_capHandle, CS_OPT_DETAIL, CS_OPT_ON);
 	}
 
-	virtual ~CapstoneDisassembler() {
-		if (m_capHandle)
-			cs_close(&m_capHandle);
-		m_capHandle = NULL;
-	}
+	virtual ~CapstoneDisassembler() = default;
 
 	virtual std::vector<PLH::Instruction>
 		disassemble(uint64_t firstInstruction, uint64_t start, uint64_t end) override;
+
+	/**Builds the packed instructions straight from capstone's output, no strings are made**/
+	virtual packed_insts_t disassemblePacked(uint64_t firstInstruction, uint64_t start, uint64_t end) override;
+
+	virtual bool decodeText(const PackedInstruction& inst, std::string& mnemonic, std::string& opStr) override;
+
+	virtual std::optional<Instruction> disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) override;
 private:
 	x86_reg getIpReg() const {
 		if (m_mode == PLH::Mode::x64)
@@ -53,7 +54,13 @@ private:
 		return false;
 	}
 
-	void setDisplacementFields(Instruction& inst, const cs_insn* capInst) const;
+	InstClass classify(const cs_insn* inst) const;
+
+	Instruction makeInstruction(const cs_insn* capInst) const;
+
+	/* Instruction or PackedInstruction*/
+	template<typename Inst>
+	void setDisplacementFields(Inst& inst, const cs_insn* capInst) const;
 
 	/* For immediate types capstone gives us only the final destination, but *we* care about the base + displacement values.
 	 * Immediates can be encoded either as some value relative to a register, or a straight up hardcoded address, we need
@@ -61,12 +68,18 @@ private:
 	 * by byte out of the instruction, if that value is less than what capstone told us is the destination then we know that it is relative and we have to add the base.
 	 * Otherwise if our retreived displacement is equal to the given destination then it is a true absolute jmp/call (only possible in x64),
 	 * if it's greater then something broke.*/
-	void copyDispSX(PLH::Instruction& inst,
+	template<typename Inst>
+	void copyDispSX(Inst& inst,
 					const uint8_t offset,
 					const uint8_t size,
 					const int64_t immDestination) const;
 
-	csh m_capHandle;
+	/**A capstone handle can't be used by two threads at once, so each thread opens its own per mode the first time
+	it disassembles, shared by every disassembler on that thread and closed when the thread exits. 0 on failure.**/
+	csh getCapHandle() const;
+
+	/**The thread's cs_insn for its handle of this mode, kept alongside it so decoding never allocates one**/
+	cs_insn* getInsnBuffer() const;
 };
 }
 #endif //POLYHOOK_2_0_CAPSTONEDISASSEMBLER_HPP
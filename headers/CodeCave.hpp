@@ -0,0 +1,48 @@
+#ifndef POLYHOOK_2_CODECAVE_HPP
+#define POLYHOOK_2_CODECAVE_HPP
+
+#include "headers/ADisassembler.hpp"
+#include "headers/Misc.hpp"
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <emmintrin.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+
+namespace PLH {
+
+/**Find size bytes of inter-function int3 padding in the executable section of the module holding prolStart that a
+2 byte short jmp placed at prolStart can reach, and that doesn't overlap [prolStart, prolEnd). Nop runs aren't taken,
+they may be alignment padding that a function falls through. Compilers pad up to the next function's 16 byte
+alignment, so the run must end on a 16 byte boundary, and on x64 it must not be inside any function the unwind table
+knows of. That keeps int3 bytes that are really part of an instruction, an immediate for example, from being taken.
+Returns the closest cave or 0 if there is none. The cave is claimed for the caller and never returned again until
+releaseCodeCave, so hooks on neighbouring functions don't share one. Thread safe.**/
+uint64_t findCodeCave(const uint64_t prolStart, const uint64_t prolEnd, const uint8_t size);
+
+/**Claim [cave, cave + size) found by other means, as findCodeCave would. False if any of it is already claimed.**/
+bool claimCodeCave(const uint64_t cave, const uint8_t size);
+
+/**Give back a cave from findCodeCave or claimCodeCave once nothing is written to it any more**/
+void releaseCodeCave(const uint64_t cave);
+
+/**Get the bounds of the executable section of a loaded module that contains address**/
+bool getExecutableSection(const uint64_t address, uint64_t& sectionStart, uint64_t& sectionEnd);
+
+/**Get the bounds of every executable section of the loaded module at moduleBase**/
+bool getExecutableSections(const uint64_t moduleBase, std::vector<std::pair<uint64_t, uint64_t>>& sections);
+
+/**Disassemble [start, end) for some start before address that is known to be an instruction boundary, for code
+found by scanning bytes. On x64 that's the start of the unwind table entry holding address. Without one, decodes
+from several offsets before address (never before sectionStart) must all fall onto the same instructions by
+address, confirmed is set to the first instruction from which they all agree. False if they don't, insts are then
+not to be trusted. The disassembler's branch map is that of the returned instructions.**/
+bool disassembleFromBoundary(ADisassembler& dis, const uint64_t address, const uint64_t end, const uint64_t sectionStart,
+							 insts_t& insts, uint64_t& confirmed);
+}
+#endif
@@ -0,0 +1,73 @@
+#ifndef POLYHOOK_2_DECODECACHE_HPP
+#define POLYHOOK_2_DECODECACHE_HPP
+
+#include "headers/Instruction.hpp"
+#include "headers/Enums.hpp"
+
+#include <cstdint>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <typeindex>
+#include <vector>
+
+namespace PLH {
+
+/**Instructions already decoded, shared by every CachingDisassembler in the process so hooks that share a callback,
+or re-hook a function after unhooking it, don't decode the same bytes again. Entries are keyed by the address and a
+hash of the bytes decoded, and only served if the bytes are still exactly the same, so code changed by any means is
+never returned stale. ADisassembler::writeEncoding also drops the entries it overwrites right away. Results from
+different backends and modes are kept apart. When full, the cache is emptied and starts over. Thread safe.**/
+class DecodeCache {
+public:
+	static const size_t MaxEntries = 4096;
+
+	static DecodeCache& singleton();
+
+	/**Copy of what backend decoded from the size bytes at code, as if they were at start. Each instruction gets a
+	 * new UID, as from a fresh decode. False if they aren't cached.**/
+	bool find(const std::type_index backend, const Mode mode, const uint64_t code, const uint64_t start,
+			  const uint64_t size, insts_t& insts);
+
+	void add(const std::type_index backend, const Mode mode, const uint64_t code, const uint64_t start,
+			 const uint64_t size, const insts_t& insts);
+
+	/**Drop every entry decoded from [address, address + size)**/
+	void invalidate(const uint64_t address, const uint64_t size);
+
+	void clear();
+
+	size_t getHitCount() const {
+		return m_hits;
+	}
+
+	size_t getMissCount() const {
+		return m_misses;
+	}
+
+	size_t getEntryCount();
+
+	DecodeCache(const DecodeCache&) = delete;
+	DecodeCache& operator=(const DecodeCache&) = delete;
+private:
+	DecodeCache();
+
+	struct Entry {
+		std::type_index			backend;
+		Mode					mode;
+		uint64_t				hash;
+		std::vector<uint8_t>	bytes;
+		insts_t					insts;
+	};
+
+	// key = start address, several windows and backends may start at the same one
+	std::map<uint64_t, std::vector<Entry>>	m_entries;
+	size_t									m_entryCount;
+	uint64_t								m_maxSize; // of any window cached, bounds the search in invalidate
+	std::mutex								m_mtx;
+
+	std::atomic<size_t>		m_hits;
+	std::atomic<size_t>		m_misses;
+};
+}
+#endif
@@ -10,9 +10,16 @@
 #include <cassert>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include "headers/ADisassembler.hpp"
 #include "headers/MemProtector.hpp"
+#include "headers/PageAllocator.hpp"
+#include "headers/CodeCave.hpp"
+#include "headers/AtomicPatch.hpp"
+#include "headers/ThreadQuiescer.hpp"
+#include "headers/Reclaimer.hpp"
+#include "headers/Detour/PlanCache.hpp"
 #include "headers/ErrorLog.hpp"
 #include "headers/IHook.hpp"
 #include "headers/Enums.hpp"
@@ -50,6 +57,23 @@ public:
 		m_fnCallback = fnCallback;
 		m_trampoline = NULL;
 		m_trampolineSz = NULL;
+		m_jmpEncoding = JmpEncoding::Rel32;
+		m_cloneFallback = false;
+		m_cloned = false;
+		m_codeCaveFallback = false;
+		m_codeCave = NULL;
+		m_patchableEntry = false;
+		m_quiesceThreads = false;
+		m_slotMode = false;
+		m_slot = NULL;
+		m_slotEnabled = false;
+		m_followJmps = true;
+		m_callbackStub = NULL;
+		m_planCache = nullptr;
+		m_holderStub = NULL;
+		m_holderStubSz = 0;
+		m_roundProlSz = 0;
+		m_planned = false;
 		m_hooked = false;
 		m_userTrampVar = userTrampVar;
 	}
@@ -60,12 +84,62 @@ public:
 		m_fnCallback = (uint64_t)fnCallback;
 		m_trampoline = NULL;
 		m_trampolineSz = NULL;
+		m_jmpEncoding = JmpEncoding::Rel32;
+		m_cloneFallback = false;
+		m_cloned = false;
+		m_codeCaveFallback = false;
+		m_codeCave = NULL;
+		m_patchableEntry = false;
+		m_quiesceThreads = false;
+		m_slotMode = false;
+		m_slot = NULL;
+		m_slotEnabled = false;
+		m_followJmps = true;
+		m_callbackStub = NULL;
+		m_planCache = nullptr;
+		m_holderStub = NULL;
+		m_holderStubSz = 0;
+		m_roundProlSz = 0;
+		m_planned = false;
 		m_hooked = false;
 		m_userTrampVar = userTrampVar;
 	}
 
-	virtual ~Detour() = default;
+	virtual ~Detour() {
+		if (m_planned)
+			discardPlan();
 
+		// a hook left in place keeps its cave
+		if (!m_hooked)
+			releaseCave();
+	}
+
+	/**plan() if not already planned, then commit(). With setPatchableEntry the sled is tried first.**/
+	virtual bool hook() override;
+
+	/**Work out everything hooking needs without touching the function: resolve jmps, pick the prologue, allocate
+	and fill the trampoline and build the jmp to write over the prologue. The slow part of hooking. Plans of
+	different detours may be made on different threads at the same time, CapstoneDisassembler is thread safe.**/
+	virtual bool plan() = 0;
+
+	/**Write the planned jmp over the prologue. Fails, discarding the plan, if the prologue changed since plan().**/
+	bool commit();
+
+	/**Free a plan that won't be committed**/
+	void discardPlan();
+
+	bool isPlanned() const {
+		return m_planned;
+	}
+
+	bool isHooked() const {
+		return m_hooked;
+	}
+
+	/**Restore the prologue and return without waiting. Threads may still be running the trampoline, it is handed
+	to the Reclaimer and freed once none are. Reclaimer::drain waits for that, e.g. before unloading. Retiring only
+	queues it, but once Reclaimer::CollectThreshold bytes are queued the unhook that reaches it collects, briefly
+	suspending every other thread even without setQuiesceThreads.**/
 	virtual bool unHook() override;
 
 	virtual HookType getType() const {
@@ -73,6 +147,113 @@ public:
 	}
 
 	virtual Mode getArchType() const = 0;
+
+	/**The kind of jmp that was written over the prologue by the last call to hook()**/
+	JmpEncoding getJmpEncoding() const {
+		return m_jmpEncoding;
+	}
+
+	/**When the prologue can't be overwritten (function ends too soon, or jmps back into what would be
+	overwritten) relocate the entire function to the trampoline instead. Short leaf functions are the usual
+	case. Must be set before hook().**/
+	void setCloneFallback(const bool enabled) {
+		assert(!m_hooked);
+		m_cloneFallback = enabled;
+	}
+
+	/**When the prologue is too small for the jmp, put the jmp in inter-function padding within reach of a 2 byte
+	short jmp and write that short jmp over the prologue instead. Tried before cloning. Must be set before hook().**/
+	void setCodeCaveFallback(const bool enabled) {
+		assert(!m_hooked);
+		m_codeCaveFallback = enabled;
+	}
+
+	/**For functions built with -fpatchable-function-entry=N,M (or msvc /hotpatch): if the function starts with
+	a nop sled, hook() writes the jmp into the nops before the entry with a 2 byte short jmp to it at the entry,
+	or into the entry sled if that is large enough. No disassembly, relocation or trampoline is needed, the
+	trampoline given back is the function right after its sled. Falls back to a normal hook without a sled.
+	Must be set before hook().**/
+	void setPatchableEntry(const bool enabled) {
+		assert(!m_hooked);
+		m_patchableEntry = enabled;
+	}
+
+	/**Suspend all other threads while the prologue is written and restored. Threads stopped inside the overwritten
+	instructions are moved to the same instruction in the trampoline, and back on unhook. See
+	ThreadQuiescer::getLastPauseDuration for how long they were held. Must be set before hook().**/
+	void setQuiesceThreads(const bool enabled) {
+		assert(!m_hooked);
+		m_quiesceThreads = enabled;
+	}
+
+	/**Send the prologue jmp through a pointer slot in the trampoline block instead of straight to the callback.
+	setEnabled and setCallback then retarget the hook with one atomic pointer store, no code is rewritten and no
+	page protection changed. Costs an extra indirect jmp per call, and the patchable entry fast path is skipped
+	since it has no trampoline block. Must be set before hook().**/
+	void setSlotMode(const bool enabled) {
+		assert(!m_hooked);
+		m_slotMode = enabled;
+	}
+
+	/**Slot mode only. Point the slot at the callback, or at the trampoline so calls run the original function.
+	Safe while other threads are calling the function.**/
+	bool setEnabled(const bool enabled);
+
+	/**Slot mode only. Swap the callback the hook jumps to, takes effect immediately if the hook is enabled.
+	The new callback must have the same signature, and may still be called through the old one by threads
+	already past the slot.**/
+	bool setCallback(const uint64_t callback);
+
+	/**Is the slot pointed at the callback. Always true for hooks not in slot mode**/
+	bool isEnabled() const {
+		return !m_slotMode || m_slotEnabled;
+	}
+
+	/**Address of the pointer slot the prologue jmp goes through in slot mode, else 0**/
+	uint64_t getSlot() const {
+		return m_slot;
+	}
+
+	/**By default a function starting with a branch (an incremental linking thunk, or an existing hook) is hooked
+	at the branch's destination instead. Turn off to hook exactly the given address. Must be set before hook().**/
+	void setFollowJmps(const bool enabled) {
+		assert(!m_hooked);
+		m_followJmps = enabled;
+	}
+
+	/**Look up where the function and callback resolve to and which prologue to relocate in cache, and add them
+	after working them out. Targets found in it are planned without disassembling anything. The cache must outlive
+	planning and may be shared by several detours. Must be set before hook().**/
+	void setPlanCache(PlanCache* cache) {
+		assert(!m_hooked);
+		m_planCache = cache;
+	}
+
+	/**For a callback that is a stub from Reclaimer::getBlock holding the trampoline variable and ending in a jmp
+	through it (MidHook, ExitHook, HookChain). A thread may be anywhere in the stub when unhooking, so unHook leaves
+	the variable set and retires the stub for the caller, and the trampoline only once the stub is freed. Must be set
+	before hook().**/
+	void setHolderStub(const uint64_t stub, const uint64_t stubSz) {
+		assert(!m_hooked);
+		m_holderStub = stub;
+		m_holderStubSz = stubSz;
+	}
+
+	/**Bytes the planned jmp overwrites at the function, valid after plan()**/
+	uint64_t getPlannedProlSz() const {
+		return m_roundProlSz;
+	}
+
+	/**Address of the code cave holding the jmp to the callback if the hook uses one, else 0. It stays claimed, see
+	findCodeCave, until unhooked.**/
+	uint64_t getCodeCave() const {
+		return m_codeCave;
+	}
+
+	/**Was the whole function relocated by the last call to hook(). The trampoline is then a full copy of it**/
+	bool isCloned() const {
+		return m_cloned;
+	}
 protected:
 	uint64_t                m_fnAddress;
 	uint64_t                m_fnCallback;
@@ -80,18 +261,89 @@ protected:
 	uint16_t			    m_trampolineSz;
 	uint64_t*				m_userTrampVar;
 	ADisassembler&			m_disasm;
+	JmpEncoding				m_jmpEncoding;
+	bool					m_cloneFallback;
+	bool					m_cloned;
+	bool					m_codeCaveFallback;
+	uint64_t				m_codeCave;
+	bool					m_patchableEntry;
+	bool					m_quiesceThreads;
+	bool					m_slotMode;
+	uint64_t				m_slot;
+	bool					m_slotEnabled;
+	bool					m_followJmps;
+
+	/* jmp in the trampoline block forwarding to the callback, for rel32 prologue jmps that can't reach it directly.
+	In slot mode it always exists and m_slot is its destination holder.*/
+	uint64_t				m_callbackStub;
+
+	PlanCache*				m_planCache;
+
+	// see setHolderStub
+	uint64_t				m_holderStub;
+	uint64_t				m_holderStubSz;
+
+	// made by plan(), written by commit()
+	PLH::insts_t			m_prolJmp;
+	uint64_t				m_roundProlSz;
+	bool					m_planned;
 
 	PLH::insts_t			m_originalInsts;
+	PLH::insts_t			m_originalCave;
 
 	/**Walks the given vector of instructions and sets roundedSz to the lowest size possible that doesn't split any instructions and is greater than minSz.
 	If end of function is encountered before this condition an empty optional is returned. Returns instructions in the range start to adjusted end**/
 	std::optional<insts_t> calcNearestSz(const insts_t& functionInsts, const uint64_t minSz,
 										 uint64_t& roundedSz);
 
-	/**If function starts with a jump follow it until the first non-jump instruction, recursively. This handles already hooked functions
+	/**Find the prologue a jmp of jmpSz bytes overwrites, rounded up to whole instructions and expanded over any
+	jmps back into it. minProlSz and roundProlSz are set as calcNearestSz does. If the function is too small, falls
+	back to a code cave and then to cloning when enabled. Logs and returns false if nothing works. Taken from the
+	plan cache if there is one, functionInsts is disassembled from m_fnAddress only if it's needed and empty.**/
+	bool calcProlForJmpSz(insts_t& functionInsts, const uint64_t jmpSz, insts_t& prologue,
+						  uint64_t& minProlSz, uint64_t& roundProlSz);
+
+	/**Follow the jmps at the start of the callback, and of the function unless setFollowJmps is off, updating
+	m_fnCallback and m_fnAddress. functionInsts is set to the function's instructions, or left empty when the plan
+	cache already knew where it resolves to.**/
+	bool resolveTargets(insts_t& functionInsts);
+
+	/**calcProlForJmpSz without any fallbacks, returns why it failed or nullptr on success**/
+	const char* calcProlForSz(const insts_t& functionInsts, const uint64_t jmpSz, insts_t& prologue,
+							  uint64_t& minProlSz, uint64_t& roundProlSz);
+
+	/**Write the jmp to the callback over the prologue and nop the rest of it, published atomically so threads
+	running the function never see half of it. If a code cave was chosen prolJmp must be made at the cave's
+	address, it is written there first and a short jmp to it over the prologue.**/
+	void writeProlJmp(const insts_t& prolJmp, const uint64_t roundProlSz);
+
+	/**Install the hook into a patchable function entry nop sled, see setPatchableEntry. Returns false without
+	touching anything if the function doesn't have a large enough sled.**/
+	bool hookPatchableEntry();
+
+	/**Atomically store destination into the slot, see setSlotMode**/
+	bool writeSlot(const uint64_t destination);
+
+	/**Find the whole function for cloning, see setCloneFallback. body is the function up to its last ret/jmp,
+	plus any padding after it the jmp of jmpSz bytes runs into. The clone is then relocated like a prologue.**/
+	bool calcCloneSz(const insts_t& functionInsts, const uint64_t jmpSz, insts_t& body,
+					 uint64_t& minProlSz, uint64_t& roundProlSz);
+
+	/**Allocate m_trampolineSz bytes of executable memory for the trampoline. If nearAddress is non-zero the whole
+	block is placed so that a rel32 from nearAddress can reach any part of it, otherwise it may be anywhere. It comes
+	from the Reclaimer, so it outlives a detour destroyed while still hooked.**/
+	bool allocateTrampoline(const uint64_t nearAddress = 0);
+
+	void freeTrampoline();
+
+	/**Give back the code cave claimed for m_codeCave, if any, and clear it**/
+	void releaseCave();
+
+	/**If the code at address starts with a jump follow it until the first non-jump instruction, recursively, leaving
+	address at that instruction. Only one instruction is decoded per jump. This handles already hooked functions
 	and also compilers that emit jump tables on function call. Returns true if resolution was successful (nothing to resolve, or resolution worked),
 	false if resolution failed.**/
-	bool followJmp(insts_t& functionInsts, const uint8_t curDepth = 0, const uint8_t depth = 3);
+	bool followJmp(uint64_t& address, const uint8_t curDepth = 0, const uint8_t depth = 3);
 
 	/**Expand the prologue up to the address of the last jmp that points back into the prologue. This
 	is necessary because we modify the location of things in the prologue, so re-entrant jmps point
@@ -102,19 +354,40 @@ protected:
 							uint64_t& minProlSz,
 							uint64_t& roundProlSz);
 
+	/**Decide how each prologue instruction is carried over to the trampoline at prolStart + delta. Instructions
+	whose displacement must be re-encoded go in instsNeedingReloc, short jmp/jcc that can't reach their destination
+	from the trampoline are widened to rel32 in place, rip relative data operations that can't reach are rewritten
+	to use an absolute address, and branches that can't reach it even then go in
+	instsNeedingEntry to be routed through the jmp table. Fills m_relocAddrs with the resulting layout.**/
 	bool buildRelocationList(insts_t& prologue, const uint64_t roundProlSz, const int64_t delta, PLH::insts_t &instsNeedingEntry, PLH::insts_t &instsNeedingReloc);
 
+	/**Size of the prologue if every short branch in it were widened and every rip relative data operation rewritten**/
+	static uint16_t calcMaxRelocatedSz(const insts_t& prologue);
+
+	/**Upper bound on the jmp table entries relocating the prologue can need, one per branch leaving it**/
+	static uint16_t calcMaxEntryCount(const insts_t& prologue, const uint64_t roundProlSz);
+
+	/**Can every instruction in instsNeedingEntry, once relocated, reach its jmp table entry. Those are the branches
+	that couldn't be widened (loop, jrcxz), with a cloned function the table can end up past their rel8. Logs and
+	returns false if one can't.**/
+	bool areEntriesInRange(const insts_t& instsNeedingEntry, const uint64_t jmpTblStart, const uint8_t jmpSz);
+
 	template<typename MakeJmpFn>
-	PLH::insts_t relocateTrampoline(insts_t& prologue, uint64_t jmpTblStart, const int64_t delta, const uint8_t jmpSz, MakeJmpFn makeJmp, const PLH::insts_t& instsNeedingReloc, const PLH::insts_t& instsNeedingEntry);
+	PLH::insts_t relocateTrampoline(insts_t& prologue, uint64_t jmpTblStart, const uint8_t jmpSz, MakeJmpFn makeJmp, const PLH::insts_t& instsNeedingReloc, const PLH::insts_t& instsNeedingEntry);
+
+	/* Original address of each prologue instruction -> its address in the trampoline. The end of the original
+	prologue maps to the end of the relocated one, where the jmp back to the function is placed.*/
+	std::map<uint64_t, uint64_t> m_relocAddrs;
 
 	bool                    m_hooked;
 };
 
 template<typename MakeJmpFn>
-PLH::insts_t PLH::Detour::relocateTrampoline(insts_t& prologue, uint64_t jmpTblStart, const int64_t delta, const uint8_t jmpSz, MakeJmpFn makeJmp, const PLH::insts_t& instsNeedingReloc, const PLH::insts_t& instsNeedingEntry) {
+PLH::insts_t PLH::Detour::relocateTrampoline(insts_t& prologue, uint64_t jmpTblStart, const uint8_t jmpSz, MakeJmpFn makeJmp, const PLH::insts_t& instsNeedingReloc, const PLH::insts_t& instsNeedingEntry) {
 	uint64_t jmpTblCurAddr = jmpTblStart;
 	insts_t jmpTblEntries;
 	for (auto& inst : prologue) {
+		const uint64_t newAddr = m_relocAddrs.at(inst.getAddress());
 
 		if (std::find(instsNeedingEntry.begin(), instsNeedingEntry.end(), inst) != instsNeedingEntry.end()) {
 			assert(inst.hasDisplacement());
@@ -122,7 +395,7 @@ PLH::insts_t PLH::Detour::relocateTrampoline(insts_t& prologue, uint64_t jmpTblS
 			auto entry = makeJmp(jmpTblCurAddr, inst.getDestination());
 
 			// move inst to trampoline and point instruction to entry
-			inst.setAddress(inst.getAddress() + delta);
+			inst.setAddress(newAddr);
 			inst.setDestination(jmpTblCurAddr);
 			jmpTblCurAddr += jmpSz;
 
@@ -131,11 +404,16 @@ PLH::insts_t PLH::Detour::relocateTrampoline(insts_t& prologue, uint64_t jmpTblS
 		} else if (std::find(instsNeedingReloc.begin(), instsNeedingReloc.end(), inst) != instsNeedingReloc.end()) {
 			assert(inst.hasDisplacement());
 
-			const uint64_t instsOldDest = inst.getDestination();
-			inst.setAddress(inst.getAddress() + delta);
-			inst.setDestination(instsOldDest);
+			// destinations inside the prologue moved along with it
+			uint64_t instsNewDest = inst.getDestination();
+			auto relocatedDest = m_relocAddrs.find(instsNewDest);
+			if (relocatedDest != m_relocAddrs.end())
+				instsNewDest = relocatedDest->second;
+
+			inst.setAddress(newAddr);
+			inst.setDestination(instsNewDest);
 		} else {
-			inst.setAddress(inst.getAddress() + delta);
+			inst.setAddress(newAddr);
 		}
 
 		m_disasm.writeEncoding(inst);
@@ -0,0 +1,76 @@
+#ifndef POLYHOOK_2_CALLSITEHOOK_HPP
+#define POLYHOOK_2_CALLSITEHOOK_HPP
+
+#include "headers/ADisassembler.hpp"
+#include "headers/Reclaimer.hpp"
+#include "headers/MemProtector.hpp"
+#include "headers/AtomicPatch.hpp"
+#include "headers/CodeCave.hpp"
+#include "headers/Instruction.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/IHook.hpp"
+#include "headers/Misc.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace PLH {
+
+/**Hook a function by rewriting the callers instead of the callee. The executable sections of the chosen modules
+(all loaded modules by default) are scanned for call rel32 instructions to the function, and each displacement is
+redirected to the callback. Each candidate is decoded from a known instruction boundary, or from several offsets
+that must agree (see disassembleFromBoundary), sites that can't be confirmed are skipped. Nothing is relocated and no trampoline is needed, the callback calls the original
+through a pointer (a direct call from a scanned module would be redirected back to the callback). Calls made any
+other way (through a pointer, a jmp, or from modules not scanned) are not hooked. In builds with incremental
+linking callers call the function's jmp thunk, which is also what taking its address gives. On x64 a callback out
+of reach of a call site is reached through a jmp stub allocated near it, freed once no thread is in it after
+unhooking.**/
+class CallSiteHook : public PLH::IHook {
+public:
+	CallSiteHook(const uint64_t fnAddress, const uint64_t fnCallback, PLH::ADisassembler& dis);
+	CallSiteHook(const char* fnAddress, const char* fnCallback, PLH::ADisassembler& dis);
+	virtual ~CallSiteHook();
+
+	/**Fails without patching anything if no call sites are found**/
+	virtual bool hook() override;
+
+	virtual bool unHook() override;
+
+	virtual HookType getType() const override {
+		return HookType::Detour;
+	}
+
+	/**Only patch callers inside these modules. Must be called before hook().**/
+	void addModule(const uint64_t moduleBase);
+	bool addModule(const std::wstring& moduleName);
+
+	/**Addresses of the call instructions patched by the last call to hook()**/
+	const std::vector<uint64_t>& getCallSites() const {
+		return m_callSites;
+	}
+private:
+	/**Find every confirmed call to m_fnAddress in [sectionStart, sectionEnd)**/
+	void scanSection(const uint64_t sectionStart, const uint64_t sectionEnd, std::vector<uint64_t>& sites);
+
+	/**Is there a call to m_fnAddress decoded at exactly site, not a E8 byte inside some other instruction**/
+	bool isCallInstruction(const uint64_t site, const uint64_t sectionStart);
+
+	/**Where the call at site should go, the callback or a stub near the site leading to it. 0 on failure**/
+	uint64_t getCallDestination(const uint64_t site);
+
+	uint64_t				m_fnAddress;
+	uint64_t				m_fnCallback;
+	ADisassembler&			m_disasm;
+	bool					m_hooked;
+
+	std::vector<uint64_t>	m_modules;
+	std::vector<uint64_t>	m_callSites;
+	std::vector<std::vector<uint8_t>> m_originalCalls;
+
+	// x64 only, stubs for call sites too far from the callback, from the Reclaimer and retired on unhook
+	std::vector<uint64_t>	m_stubs;
+};
+}
+#endif
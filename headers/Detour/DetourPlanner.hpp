@@ -0,0 +1,44 @@
+#ifndef POLYHOOK_2_DETOURPLANNER_HPP
+#define POLYHOOK_2_DETOURPLANNER_HPP
+
+#include "headers/Detour/ADetour.hpp"
+#include "headers/ErrorLog.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+namespace PLH {
+
+/**Plan many detours at once on a pool of worker threads, the disassembly and relocation work of hooking. Nothing
+is written to the hooked functions, commit the plans afterwards with hook() on each detour or, better, a HookBatch
+holding them, which then only has the prologue jmps left to write. Detours may share a disassembler if it is thread
+safe (CapstoneDisassembler is). Detours are not owned and must outlive the planner's use of them.**/
+class DetourPlanner {
+public:
+	/**threadCount 0 uses one worker per hardware thread**/
+	DetourPlanner(const uint32_t threadCount = 0);
+
+	void add(Detour& detour);
+
+	/**Plan every added detour that isn't planned or hooked yet. Returns true if all of them were planned, the ones
+	that failed are in getFailed() and left unplanned.**/
+	bool plan();
+
+	const std::vector<Detour*>& getFailed() const {
+		return m_failed;
+	}
+
+	size_t getDetourCount() const {
+		return m_detours.size();
+	}
+private:
+	std::vector<Detour*>	m_detours;
+	std::vector<Detour*>	m_failed;
+	uint32_t				m_threadCount;
+};
+}
+#endif
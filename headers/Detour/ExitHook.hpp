@@ -0,0 +1,83 @@
+#ifndef POLYHOOK_2_EXITHOOK_HPP
+#define POLYHOOK_2_EXITHOOK_HPP
+
+#include "headers/Detour/ADetour.hpp"
+#include "headers/ADisassembler.hpp"
+#include "headers/Reclaimer.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/IHook.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace PLH {
+
+/**What a hooked function returned. The return values may be modified and are what the caller sees.**/
+struct ExitHookContext {
+	uint64_t returnValue;     // rax (x86: eax)
+	uint64_t returnValueHigh; // rdx (x86: edx, the high half of 64 bit returns)
+#ifdef _WIN64
+	union {
+		float    f32;
+		double   f64;
+		uint64_t u64[2];
+	} xmm0;                   // floating point and vector returns
+#endif
+	uint64_t returnAddress;   // read only
+	uint64_t entryTsc;        // __rdtsc() when the function was entered, read only
+};
+
+typedef void(*tExitCallback)(ExitHookContext* ctx);
+
+/**Call a callback every time the hooked function returns, with its return value. The function is detoured to a
+stub that pushes the real return address on a thread local shadow stack and swaps in the address of a return stub,
+which calls the callback and then resumes the caller. Nothing is shared between threads so no locks are taken.
+Recursion pushes a frame per call. On x86 frames skipped by longjmp or exception unwinds are dropped the next time
+the thread enters or leaves a hooked function further up the stack, their callback is not called. x64 unwinding
+walks return addresses instead, so when any exception is raised on a thread the real ones are put back first and
+the calls in flight on it return without reporting. longjmp raises nothing and must not cross a hooked call on x64.
+Calls nested deeper than the shadow stack run normally without a callback. Tail calls from one exit hooked function
+into another report once, to the outer hook. On x86 functions returning float or double in st(0) are not supported.
+Calls in flight when it's unhooked or destroyed still report their exit, the stubs and what they call the callback
+with are kept until they return. Hooks the host architecture.**/
+class ExitHook : public PLH::IHook {
+public:
+	ExitHook(const uint64_t fnAddress, const tExitCallback callback, PLH::ADisassembler& dis);
+	ExitHook(const char* fnAddress, const tExitCallback callback, PLH::ADisassembler& dis);
+	virtual ~ExitHook();
+
+	virtual bool hook() override;
+
+	virtual bool unHook() override;
+
+	virtual HookType getType() const override {
+		return HookType::Detour;
+	}
+
+	// calls deeper than this per thread, across all exit hooks, don't report their exit
+	static const uint32_t MaxShadowDepth = 256;
+private:
+	// at the start of the stub block, what onEnter needs without touching the ExitHook object
+	struct StubData {
+		uintptr_t		returnStub;
+		tExitCallback	callback;
+	};
+
+	/**Emit the stub data, the entry stub and the return stub, sets where each stub and the trampoline holder are**/
+	std::vector<uint8_t> makeStubs(const uint64_t stubAddress, uint64_t& entryOffset, uint64_t& returnStubOffset, uint64_t& trampHolderOffset) const;
+
+	// called by the stubs
+	static void onEnter(const StubData* data, uintptr_t* retSlot);
+	static void onExit(void* frame);
+
+	uint64_t				m_fnAddress;
+	tExitCallback			m_callback;
+	ADisassembler&			m_disasm;
+	std::unique_ptr<Detour>	m_detour;
+
+	uint64_t				m_stub;
+	uint64_t				m_stubSz;
+};
+}
+#endif
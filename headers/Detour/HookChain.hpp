@@ -0,0 +1,97 @@
+#ifndef POLYHOOK_2_HOOKCHAIN_HPP
+#define POLYHOOK_2_HOOKCHAIN_HPP
+
+#pragma warning( push )
+#pragma warning( disable : 4245)
+#include <asmjit/asmjit.h>
+#pragma warning( pop )
+
+#include "headers/Detour/ADetour.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/IHook.hpp"
+#include "headers/Reclaimer.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PLH {
+
+/**One detour on a function shared by any number of listeners, instead of each user stacking their own detour (and
+trampoline) on top of the last. The prologue jmps to a JIT dispatcher built for the function's signature that calls
+every listener in order with the original arguments, then calls the original function and returns its result.
+Listeners are void functions taking the same arguments. They can be added and removed while hooked, the function
+is never repatched for it, and each one costs a single call.**/
+class HookChain : public PLH::IHook {
+public:
+	HookChain(const uint64_t fnAddress, const asmjit::FuncSignature& sig, PLH::ADisassembler& dis);
+	HookChain(const char* fnAddress, const asmjit::FuncSignature& sig, PLH::ADisassembler& dis);
+	virtual ~HookChain();
+
+	/**Fails if another chain is already hooked on the same function, add listeners to that one instead (see find)**/
+	virtual bool hook() override;
+
+	/**Threads already on their way into the dispatcher skip the listeners and only call the original**/
+	virtual bool unHook() override;
+
+	virtual HookType getType() const override {
+		return HookType::Detour;
+	}
+
+	/**Listeners are called in the order they were added. Adding one twice calls it twice**/
+	void addListener(const uint64_t listener);
+
+	/**Removes the first occurrence, returns false if the listener wasn't added. A thread already in the dispatcher
+	may still make one last call to it.**/
+	bool removeListener(const uint64_t listener);
+
+	size_t getListenerCount();
+
+	/**The chain hooked on fnAddress, or nullptr**/
+	static HookChain* find(const uint64_t fnAddress);
+private:
+	/* What the dispatcher reads, at the start of its block so it lives exactly as long as the code does. Threads may
+	still be in the dispatcher after the chain is gone, the detour retires the block (see Detour::setHolderStub).*/
+	struct DispatcherState {
+		// loaded once per call, swapping it is a single aligned pointer store
+		uintptr_t* volatile listeners;
+		uint64_t trampoline;
+	};
+
+	/**Allocate a block and emit the dispatcher for m_sig into it after its DispatcherState, returns the block or 0**/
+	uint64_t makeDispatcher();
+
+	/**Compile the dispatcher reading the DispatcherState at state into code, which must be initialized**/
+	bool compileDispatcher(asmjit::CodeHolder& code, const uint64_t state);
+
+	/**Publish a new zero terminated copy of m_listeners for the dispatcher to walk and retire the one it replaces.
+	m_listenerMtx must be held.**/
+	void publishListeners();
+
+	/**Hand a table to the Reclaimer, threads in the dispatcher may still be walking it**/
+	static void retireListeners(uintptr_t* table, const size_t count);
+
+	uint64_t				m_fnAddress;
+	asmjit::FuncSignature	m_sig;
+	std::vector<uint8_t>	m_sigArgs;
+	ADisassembler&			m_disasm;
+	std::unique_ptr<Detour>	m_detour;
+
+	// block holding the DispatcherState and code while hooked, else 0. Guarded by m_listenerMtx.
+	uint64_t				m_dispatcher;
+	uint64_t				m_dispatcherSz;
+
+	// the latest table, published to the dispatcher while hooked. Replaced ones go to the Reclaimer.
+	uintptr_t*				m_activeListeners;
+	size_t					m_activeCount;
+	std::vector<uint64_t>	m_listeners;
+	std::mutex				m_listenerMtx;
+
+	static std::map<uint64_t, HookChain*> m_chains;
+	static std::mutex		m_chainsMtx;
+};
+}
+#endif
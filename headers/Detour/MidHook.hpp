@@ -0,0 +1,99 @@
+#ifndef POLYHOOK_2_MIDHOOK_HPP
+#define POLYHOOK_2_MIDHOOK_HPP
+
+#include "headers/Detour/ADetour.hpp"
+#include "headers/ADisassembler.hpp"
+#include "headers/Reclaimer.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/IHook.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace PLH {
+
+/**Registers at the hooked instruction, laid out the way the MidHook stub pushes them. Everything but the stack
+pointer may be modified and is written back before the instruction runs.**/
+struct MidHookContext {
+	union XmmReg {
+		uint8_t  u8[16];
+		uint32_t u32[4];
+		uint64_t u64[2];
+		float    f32[4];
+		double   f64[2];
+	};
+
+#ifdef _WIN64
+	XmmReg   xmm[16];
+	uint64_t rax, rcx, rdx, rbx, rbp, rsi, rdi;
+	uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+	uint64_t rflags;
+	uint64_t rsp; // read only
+#else
+	XmmReg   xmm[8];
+	uint32_t eflags;
+	uint32_t edi, esi, ebp;
+	uint32_t esp; // read only
+	uint32_t ebx, edx, ecx, eax;
+#endif
+};
+
+typedef void(*tMidHookCallback)(MidHookContext* ctx);
+
+/* The pieces of the MidHook stub, shared with other hooks that hand a callback the registers (SyscallHook).
+emitSaveContext pushes a MidHookContext, emitCallWithContext calls fn with a pointer to it (its return value is
+left in rax/eax, the context is untouched) and emitRestoreContext pops it back into the registers.*/
+void emitSaveContext(std::vector<uint8_t>& code);
+void emitCallWithContext(std::vector<uint8_t>& code, const uint64_t fn);
+void emitRestoreContext(std::vector<uint8_t>& code);
+
+/**Hook any instruction, not just function entries. A jmp is written over the instructions at the address like a
+Detour's prologue jmp, and leads to a stub that saves all general purpose registers, flags and xmm registers,
+calls the callback with them, restores them and continues with the relocated instructions. Much cheaper than a
+BreakPointHook, there is no exception. The overwritten instructions are relocated exactly as a Detour's prologue
+is, so the same restrictions apply: the address must start an instruction, and there must be room for the jmp
+before the function ends. Nothing may branch into the middle of the overwritten instructions, the function is
+decoded from its start to check, see setFunctionStart. Hooks the host architecture.**/
+class MidHook : public PLH::IHook {
+public:
+	MidHook(const uint64_t address, const tMidHookCallback callback, PLH::ADisassembler& dis);
+	MidHook(const char* address, const tMidHookCallback callback, PLH::ADisassembler& dis);
+	virtual ~MidHook();
+
+	virtual bool hook() override;
+
+	virtual bool unHook() override;
+
+	virtual HookType getType() const override {
+		return HookType::Detour;
+	}
+
+	/**Start of the function holding the address. On x64 it's looked up in the unwind table, this is only needed for
+	code without unwind info and on x86. hook() refuses addresses whose function start isn't known, branches from
+	before the address into the overwritten instructions (loop back-edges) would otherwise go unnoticed. Must be set
+	before hook().**/
+	void setFunctionStart(const uint64_t fnStart) {
+		assert(!m_detour);
+		m_fnStart = fnStart;
+	}
+private:
+	/**Emit the register saving stub into m_stub, it ends in a jmp through the returned holder**/
+	std::vector<uint8_t> makeStub(const uint64_t stubAddress, uint64_t& trampHolderOffset) const;
+
+	/**Does anything in the function, other than the overwritten instructions themselves, branch into the middle of
+	[m_address, m_address + prolSz). Also true if the function's start isn't known.**/
+	bool isBranchedInto(const uint64_t prolSz);
+
+	uint64_t				m_address;
+	tMidHookCallback		m_callback;
+	ADisassembler&			m_disasm;
+	std::unique_ptr<Detour>	m_detour;
+
+	uint64_t				m_fnStart;
+	uint64_t				m_stub;
+	uint64_t				m_stubSz;
+};
+}
+#endif
@@ -0,0 +1,115 @@
+#ifndef POLYHOOK_2_PLANCACHE_HPP
+#define POLYHOOK_2_PLANCACHE_HPP
+
+#include "headers/Instruction.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/Enums.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+
+namespace PLH {
+
+/**Keeps the results of a detour's analysis on disk so the next run of the same binaries skips the disassembler.
+Two kinds of entry are stored, keyed by the module's build id (its pdb GUID and age, or the link timestamp and
+image size without one) and the offset of the address into the module:
+- where a function or callback ends up after following its leading jmps
+- the prologue a jmp of a given size overwrites, as the relocatable instructions the trampoline is built from
+The trampoline itself depends on where it gets allocated and is rebuilt from the stored prologue, which takes no
+disassembly. Each entry also stores a hash of the bytes it was computed from and is only used if they still hash
+the same, so functions patched at runtime or rebased modules with absolute operands are analysed again. Addresses outside any module, and plans that fell back to a code
+cave or a clone, are never cached. The file is memory mapped and entries are read from it in place. Safe to share
+between detours planned on several threads.**/
+class PlanCache {
+public:
+	/**Map the cache file at path if there is a valid one, otherwise start empty**/
+	PlanCache(const std::wstring& path);
+	~PlanCache();
+
+	PlanCache(const PlanCache&) = delete;
+	PlanCache& operator=(const PlanCache&) = delete;
+
+	/**Write every entry, loaded and added, to the file. The old file is replaced in one move.**/
+	bool save();
+
+	bool findResolved(const uint64_t address, uint64_t& resolved);
+	void addResolved(const uint64_t address, const uint64_t resolved);
+
+	bool findPrologue(const uint64_t fnAddress, const uint8_t jmpSz, const Mode mode, insts_t& prologue,
+					  uint64_t& minProlSz, uint64_t& roundProlSz);
+	void addPrologue(const uint64_t fnAddress, const uint8_t jmpSz, const insts_t& prologue,
+					 const uint64_t minProlSz, const uint64_t roundProlSz);
+
+	size_t getHitCount() const {
+		return m_hits;
+	}
+
+	size_t getMissCount() const {
+		return m_misses;
+	}
+
+	size_t getEntryCount();
+
+	/**Bytes from the start of a function a prologue entry depends on, the window detours disassemble**/
+	static const uint64_t WindowSz = 100;
+private:
+#pragma pack(push, 1)
+	struct Key {
+		uint8_t buildId[20];
+		uint32_t rva;
+		uint8_t kind;
+		uint8_t jmpSz;
+	};
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t entryCount;
+	};
+
+	// sorted by key, blob offsets are from the start of the file
+	struct IndexEntry {
+		Key key;
+		uint32_t blobOffset;
+		uint32_t blobSize;
+	};
+#pragma pack(pop)
+
+	enum KeyKind : uint8_t {
+		Resolved = 1,
+		Prologue = 2
+	};
+
+	/**Fill in key for address, false if it isn't inside a module. moduleBase is set to the module's base.**/
+	static bool makeKey(const uint64_t address, const KeyKind kind, const uint8_t jmpSz, Key& key, uint64_t& moduleBase);
+
+	/**The stored blob for key, from the added entries or the mapped file. m_mtx must be held.**/
+	bool findBlob(const Key& key, std::vector<uint8_t>& blob) const;
+
+	void map();
+	void unmap();
+
+	std::wstring			m_path;
+	HANDLE					m_file;
+	HANDLE					m_mapping;
+	const uint8_t*			m_view;
+	uint64_t				m_viewSz;
+	const IndexEntry*		m_index;
+	uint32_t				m_indexCount;
+
+	// added since the file was mapped, key bytes -> blob
+	std::map<std::string, std::vector<uint8_t>> m_added;
+	std::mutex				m_mtx;
+
+	std::atomic<size_t>		m_hits;
+	std::atomic<size_t>		m_misses;
+};
+}
+#endif
@@ -0,0 +1,103 @@
+#ifndef POLYHOOK_2_SYSCALLHOOK_HPP
+#define POLYHOOK_2_SYSCALLHOOK_HPP
+
+#include "headers/Detour/MidHook.hpp"
+#include "headers/ADisassembler.hpp"
+#include "headers/MemProtector.hpp"
+#include "headers/AtomicPatch.hpp"
+#include "headers/CodeCave.hpp"
+#include "headers/ThreadQuiescer.hpp"
+#include "headers/Reclaimer.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/IHook.hpp"
+#include "headers/Misc.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace PLH {
+
+/**Registers at the syscall instruction. rax holds the system service number, r10 rdx r8 r9 the first four
+arguments and the rest are on the stack from rsp + 0x28, as the Nt stubs set them up. Changes are seen by the
+syscall. A handler that skips the syscall puts its result (the NTSTATUS) in rax.**/
+typedef MidHookContext SyscallContext;
+
+/**Return true to make the syscall with the registers in ctx, false to skip it, emulating it in the handler.
+Syscalls the handler makes itself, directly or through the CRT, the heap, ErrorLog and so on, are not handed to
+any handler again on that thread, they're made as they are. So are the ones a new thread makes before its TLS is
+set up.**/
+typedef bool(*tSyscallHandler)(SyscallContext* ctx);
+
+/**Intercept system calls in user space by patching the syscall instructions themselves, without a debugger or
+exception per call. The executable sections of the chosen modules (ntdll.dll and win32u.dll by default) are scanned
+for syscall (0F 05), each candidate is disassembled to confirm it's an instruction (see disassembleFromBoundary,
+ones that can't be confirmed are skipped), and a jmp is written over it and
+the instructions leading up to it. The jmp leads to a stub per site that runs those instructions relocated, calls
+the handler with the registers, then makes the syscall or not and continues after the original one. Only straight
+line code with nothing branching into it is overwritten, sites without enough of it are left alone. All sites are
+written with every other thread suspended, ones stopped in the overwritten code are moved into the stub. Syscalls
+made from anywhere else (other modules, dynamically generated code) aren't seen. 32 bit processes make no syscalls
+of their own, they go through the WoW64 layer, so only x64 is supported.**/
+class SyscallHook : public PLH::IHook {
+public:
+	SyscallHook(const tSyscallHandler handler, PLH::ADisassembler& dis);
+	virtual ~SyscallHook();
+
+	/**Fails without patching anything if no site could be hooked**/
+	virtual bool hook() override;
+
+	virtual bool unHook() override;
+
+	virtual HookType getType() const override {
+		return HookType::Detour;
+	}
+
+	/**Only patch syscalls inside these modules. Must be called before hook().**/
+	void addModule(const uint64_t moduleBase);
+	bool addModule(const std::wstring& moduleName);
+
+	/**Addresses of the syscall instructions hooked by the last call to hook()**/
+	const std::vector<uint64_t>& getSites() const {
+		return m_sites;
+	}
+private:
+	struct Site {
+		uint64_t address;  // of the syscall
+		insts_t  leading;  // instructions before it that the jmp also overwrites
+		uint64_t stub;
+		uint64_t stubSz;
+		std::vector<uint8_t> original;
+
+		// where each leading instruction went in the stub, then where the syscall's dispatch code starts
+		std::vector<uint64_t> stubOffsets;
+	};
+
+	/**Find every confirmed syscall in [sectionStart, sectionEnd) and what overwriting it takes**/
+	void scanSection(const uint64_t sectionStart, const uint64_t sectionEnd, std::vector<Site>& sites);
+
+	/**Decode up to the candidate and pick the instructions before it to overwrite too. False if it isn't a
+	syscall instruction, or the jmp can't be written there safely.**/
+	bool planSite(const uint64_t candidate, const uint64_t sectionStart, Site& site);
+
+	/**Relocate the leading instructions to the stub's address and append the dispatch code after them. Sets the
+	site's stubOffsets.**/
+	bool makeStub(Site& site, const uint64_t stubAddress, std::vector<uint8_t>& code) const;
+
+	/**Write patches[i] over sites[i] with every other thread suspended, moving the ones at a key of ipFixups.
+	Returns how many couldn't be written atomically, nothing is logged while the threads are stopped.**/
+	static size_t patchSites(const std::vector<Site>& sites, const std::vector<std::vector<uint8_t>>& patches,
+							 const std::map<uint64_t, uint64_t>& ipFixups);
+
+	tSyscallHandler			m_handler;
+	ADisassembler&			m_disasm;
+	bool					m_hooked;
+
+	std::vector<uint64_t>	m_modules;
+	std::vector<Site>		m_hookedSites;
+	std::vector<uint64_t>	m_sites;
+};
+}
+#endif
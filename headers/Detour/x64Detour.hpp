@@ -25,15 +25,24 @@ public:
 
 	x64Detour(const char* fnAddress, const char* fnCallback, uint64_t* userTrampVar, PLH::ADisassembler& dis);
 	virtual ~x64Detour() = default;
-	virtual bool hook() override;
+	virtual bool plan() override;
 
 	Mode getArchType() const;
 
 	uint8_t getMinJmpSize() const;
 
 	uint8_t getPrefJmpSize() const;
+
+	uint8_t getNearJmpSize() const;
+
+	/**Choose the jmp written over the prologue. Rel32 (the default) falls back to the absolute
+	jmp [rip+0] form when the trampoline can't be placed within +-2GB, the absolute forms are used as is.**/
+	void setJmpEncoding(const JmpEncoding encoding);
 private:
-	bool makeTrampoline(insts_t& prologue, insts_t& trampolineOut);
+	/**allocFailed is set if it failed because no memory for the trampoline was free where it's needed**/
+	bool makeTrampoline(insts_t& prologue, insts_t& trampolineOut, bool& allocFailed);
+
+	JmpEncoding m_prefJmpEncoding;
 };
 }
 #endif //POLYHOOK_2_X64DETOUR_HPP
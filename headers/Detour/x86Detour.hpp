@@ -25,11 +25,14 @@ public:
 
 	x86Detour(const char* fnAddress, const char* fnCallback, uint64_t* userTrampVar, PLH::ADisassembler& dis);
 	virtual ~x86Detour() = default;
-	virtual bool hook() override;
+	virtual bool plan() override;
 
 	Mode getArchType() const;
 
 	uint8_t getJmpSize() const;
+
+	// jmp [slot] stub used in slot mode
+	uint8_t getSlotJmpSize() const;
 private:
 	bool makeTrampoline(insts_t& prologue, insts_t& trampolineOut);
 };
@@ -43,6 +43,15 @@ enum class JmpType {
 	Indirect
 };
 
+/* Encoding of the jmp a Detour writes over the prologue. Rel32 is the shortest and is used
+ * whenever the callback, or a stub leading to it, is within +-2GB of the function. The
+ * others can reach anywhere in the address space at the cost of a longer prologue.*/
+enum class JmpEncoding {
+	Rel32,       // E9 rel32, 5 bytes
+	RipIndirect, // jmp [rip+0] followed by the 8 byte destination, 14 bytes
+	PushRet      // push rax; mov rax, imm64; xchg [rsp], rax; ret, 16 bytes. Unbalances the return stack buffer
+};
+
 enum class Mode {
 	x86,
 	x64
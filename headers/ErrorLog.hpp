@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <mutex>
 #include "headers/Enums.hpp"
 
 namespace PLH {
@@ -23,6 +24,8 @@ public:
 	}
 
 	void push(const Error& err) {
+		// hooks may be planned on several threads at once
+		std::lock_guard<std::mutex> lock(m_mtx);
 		switch (err.lvl) {
 		case ErrorLevel::INFO:
 			std::cout << "[+] Info: " << err.msg << std::endl;
@@ -41,6 +44,7 @@ public:
 	}
 
 	Error pop() {
+		std::lock_guard<std::mutex> lock(m_mtx);
 		Error err = {};
 		if (!m_log.empty()) {
 			err = m_log.back();
@@ -55,6 +59,7 @@ public:
 	}
 private:
 	std::vector<Error> m_log;
+	std::mutex m_mtx;
 };
 
 
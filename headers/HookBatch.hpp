@@ -0,0 +1,50 @@
+#ifndef POLYHOOK_2_HOOKBATCH_HPP
+#define POLYHOOK_2_HOOKBATCH_HPP
+
+#include "headers/MemProtector.hpp"
+#include "headers/Reclaimer.hpp"
+#include "headers/ErrorLog.hpp"
+#include "headers/IHook.hpp"
+#include <cstdint>
+#include <vector>
+#include <string>
+
+namespace PLH {
+
+/**Install or remove many hooks of any kind (detours, vtable swaps, IAT/EAT hooks...) as one transaction. The
+writes are made under a single ProtectionBatch, so each page's protection is changed once for the whole batch
+instead of around every write, and the instruction cache is flushed once at the end. If any hook fails the ones
+already installed are removed again, either all of them are hooked or none are. Hooks are not owned and must
+outlive the batch.**/
+class HookBatch : public PLH::IHook {
+public:
+	HookBatch();
+	virtual ~HookBatch() = default;
+
+	/**Hooks are installed in the order they're added and removed in reverse. Must be called before hook().**/
+	void add(IHook& hook);
+
+	virtual bool hook() override;
+
+	virtual bool unHook() override;
+
+	virtual HookType getType() const override {
+		return HookType::UNKNOWN;
+	}
+
+	size_t getHookCount() const {
+		return m_hooks.size();
+	}
+
+	/**How many VirtualProtect calls the last hook() or unHook() needed to change protection, not counting
+	the restores at the end of it**/
+	size_t getLastProtectCount() const {
+		return m_lastProtectCount;
+	}
+private:
+	std::vector<IHook*>		m_hooks;
+	size_t					m_lastProtectCount;
+	bool					m_hooked;
+};
+}
+#endif
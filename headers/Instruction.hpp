@@ -52,6 +52,7 @@ public:
 	Instruction& operator=(const Instruction& rhs) {
 		Init(rhs.m_address, rhs.m_displacement, rhs.m_dispOffset, rhs.m_isRelative,
 			 rhs.m_bytes, rhs.m_mnemonic, rhs.m_opStr, rhs.m_hasDisplacement, rhs.m_uid, rhs.m_mode);
+		m_dispSize = rhs.m_dispSize;
 		return *this;
 	}
 
@@ -107,6 +108,12 @@ public:
 		m_isBranching = status;
 	}
 
+	/**Set how many bytes the displacement is encoded in, when it's not the rest of the instruction
+	(ex: mov dword ptr [rip + 0x10], 0x1 has an immediate after it)**/
+	void setDisplacementSize(const uint8_t size) {
+		m_dispSize = size;
+	}
+
 	/**Get the offset into the instruction bytes where displacement is encoded**/
 	uint8_t getDisplacementOffset() const {
 		return m_dispOffset;
@@ -141,12 +148,20 @@ public:
 		return m_mnemonic;
 	}
 
+	/**Get the parameters alone**/
+	std::string getOpStr() const {
+		return m_opStr;
+	}
+
 	/**Get symbol name and parameters**/
 	std::string getFullName() const {
 		return m_mnemonic + " " + m_opStr;
 	}
 
-	size_t getDispSize() {
+	size_t getDispSize() const {
+		if (m_dispSize != 0)
+			return m_dispSize;
+
 		// jmp (e9 eb be ad de) = 5 bytes, 1 disp off, 4 disp sz
 		return size() - getDisplacementOffset();
 	}
@@ -163,7 +178,7 @@ public:
 		m_isRelative = true;
 		m_hasDisplacement = true;
 
-		const uint32_t dispSz = (uint32_t)(size() - getDisplacementOffset());
+		const uint32_t dispSz = (uint32_t)getDispSize();
 		if (getDisplacementOffset() + dispSz > m_bytes.size() || dispSz > sizeof(m_displacement.Relative)) {
 			__debugbreak();
 			return;
@@ -181,7 +196,7 @@ public:
 		m_isRelative = false;
 		m_hasDisplacement = true;
 
-		const uint32_t dispSz = (uint32_t)(size() - getDisplacementOffset());
+		const uint32_t dispSz = (uint32_t)getDispSize();
 		if (getDisplacementOffset() + dispSz > m_bytes.size() || dispSz > sizeof(m_displacement.Absolute)) {
 			__debugbreak();
 			return;
@@ -191,6 +206,42 @@ public:
 		std::memcpy(&m_bytes[getDisplacementOffset()], &m_displacement.Absolute, dispSz);
 	}
 
+	/**Re-encode a short jmp (EB rel8) or jcc (7x rel8) as its rel32 form (E9 / 0F 8x), still pointing at
+	 * the same destination. Returns false if the instruction isn't one of those, jecxz/loop have no rel32 form.**/
+	bool widenShortBranch() {
+		if (m_bytes.size() != 2 || !hasDisplacement() || !isDisplacementRelative())
+			return false;
+
+		const uint64_t dest = getDestination();
+		const uint8_t opcode = m_bytes[0];
+		if (opcode == 0xEB) {
+			m_bytes = { 0xE9, 0x00, 0x00, 0x00, 0x00 };
+			m_dispOffset = 1;
+			m_dispSize = 4;
+		} else if (opcode >= 0x70 && opcode <= 0x7F) {
+			m_bytes = { 0x0F, (uint8_t)(0x80 | (opcode & 0x0F)), 0x00, 0x00, 0x00, 0x00 };
+			m_dispOffset = 2;
+			m_dispSize = 4;
+		} else {
+			return false;
+		}
+
+		setDestination(dest);
+		return true;
+	}
+
+	/**Replace the instruction with an equivalent sequence that has no displacement left to fix up.
+	 * Keeps the UID so it can still be found in relocation lists built before the rewrite.**/
+	void rewrite(const std::vector<uint8_t>& bytes, const std::string& opStr) {
+		m_bytes = bytes;
+		m_opStr = opStr;
+		m_displacement.Absolute = 0;
+		m_dispOffset = 0;
+		m_dispSize = 0;
+		m_isRelative = false;
+		m_hasDisplacement = false;
+	}
+
 	long getUID() const {
 		return m_uid.val;
 	}
@@ -215,6 +266,7 @@ private:
 		m_address = address;
 		m_displacement = displacement;
 		m_dispOffset = displacementOffset;
+		m_dispSize = 0;
 		m_isRelative = isRelative;
 		m_hasDisplacement = hasDisp;
 
@@ -229,6 +281,7 @@ private:
 	uint64_t     m_address;       //Address the instruction is at
 	Displacement m_displacement;  //Where an instruction points too (valid for jmp + call types)
 	uint8_t      m_dispOffset;    //Offset into the byte array where displacement is encoded
+	uint8_t      m_dispSize;      //Size of the encoded displacement, 0 if it runs to the end of the instruction
 	bool         m_isRelative;    //Does the displacement need to be added to the address to retrieve where it points too?
 	bool         m_hasDisplacement; //Does this instruction have the displacement fields filled (only rip/eip relative types are filled)
 	bool		 m_isBranching; //Does this instrunction jmp/call or otherwise change control flow
@@ -271,6 +324,15 @@ inline uint16_t calcInstsSz(const insts_t& insts) {
 	return sz;
 }
 
+/**Concatenate the bytes of instructions laid out back to back**/
+inline std::vector<uint8_t> flattenInsts(const insts_t& insts) {
+	std::vector<uint8_t> bytes;
+	bytes.reserve(calcInstsSz(insts));
+	for (const auto& ins : insts)
+		bytes.insert(bytes.end(), ins.getBytes().begin(), ins.getBytes().end());
+	return bytes;
+}
+
 template<typename T>
 std::string instsToStr(const T& container) {
 	std::stringstream ss;
@@ -293,8 +355,9 @@ inline std::ostream& operator<<(std::ostream& os, const std::vector<Instruction>
 //std::ostream& operator<<(std::ostream& os, const std::multiset<X>& v) { return printInsts(os, v); }
 
 
-/**Write a 25 byte absolute jump. This is preferred since it doesn't require an indirect memory holder.
- * We first sub rsp by 128 bytes to avoid the red-zone stack space. This is specific to unix only afaik.**/
+/**Write a 16 byte absolute jump. This doesn't read an indirect memory holder, but it reaches the destination
+ * with a ret which the cpu mispredicts, and the return stack buffer is left unbalanced for the caller's ret too.
+ * It is also 2 bytes larger than makex64RipIndirectJump, only use it where no memory holder may be read.**/
 inline PLH::insts_t makex64PreferredJump(const uint64_t address, const uint64_t destination) {
 	PLH::Instruction::Displacement zeroDisp = { 0 };
 	uint64_t                       curInstAddress = address;
@@ -360,6 +423,182 @@ inline PLH::insts_t makex64MinimumJump(const uint64_t address, const uint64_t de
 	return { Instruction(address, disp, 2, true, bytes, "jmp", ss.str(), Mode::x64),  specialDest };
 }
 
+/**Write a 5 byte rel32 jump. Destination must be within +-2GB of the end of the jmp.**/
+inline PLH::insts_t makex64NearJump(const uint64_t address, const uint64_t destination) {
+	Instruction::Displacement disp;
+	disp.Relative = Instruction::calculateRelativeDisplacement<int32_t>(address, destination, 5);
+
+	std::vector<uint8_t> bytes(5);
+	bytes[0] = 0xE9;
+	memcpy(&bytes[1], &disp.Relative, 4);
+
+	std::stringstream ss;
+	ss << std::hex << destination;
+
+	return { Instruction(address, disp, 1, true, bytes, "jmp", ss.str(), Mode::x64) };
+}
+
+/**Write a 14 byte absolute jump, jmp [rip+0] with the destination stored directly after it. Unlike the
+ * push/ret style jump this doesn't leave the cpu's return stack buffer unbalanced.**/
+inline PLH::insts_t makex64RipIndirectJump(const uint64_t address, const uint64_t destination) {
+	return makex64MinimumJump(address, destination, address + 6);
+}
+
+/**Rewrite a rip relative data operation (lea rcx, [rip + X] / mov rax, [rip + X] / add dword ptr [rip + X], 1 ...)
+ * into a sequence that loads the absolute target into a register and accesses memory through it, so that it
+ * works from anywhere in the address space. Lea becomes a mov of the target, full width register loads load
+ * the target into their own destination first. Everything else borrows a scratch register:
+ *		lea rsp, [rsp - 0x80]	; step over the red zone
+ *		push scratch
+ *		mov scratch, target
+ *		<inst with [rip + X] replaced by [scratch]>
+ *		pop scratch
+ *		lea rsp, [rsp + 0x80]
+ * Returns false for encodings that can't be rewritten this way (vex, evex, rsp as an operand, push/pop of memory).**/
+inline bool rewritex64RipRelative(PLH::Instruction& inst) {
+	if (!inst.hasDisplacement() || !inst.isDisplacementRelative() || inst.isBranching())
+		return false;
+
+	const std::vector<uint8_t>& bytes = inst.getBytes();
+	const uint8_t dispOff = inst.getDisplacementOffset();
+	if (dispOff < 2 || dispOff + 4 > bytes.size() || inst.getDispSize() != 4)
+		return false;
+
+	// rip relative addressing is always mod = 00 rm = 101 with no SIB, so the ModRM sits right before the disp
+	const uint8_t modRmIdx = dispOff - 1;
+	const uint8_t modRm = bytes[modRmIdx];
+	if ((modRm & 0xC7) != 0x05)
+		return false;
+
+	// legacy prefixes, then optional REX, then the opcode up to the ModRM
+	uint8_t opIdx = 0;
+	bool opSzPrefix = false;
+	while (opIdx < modRmIdx) {
+		const uint8_t b = bytes[opIdx];
+		if (b == 0x66) {
+			opSzPrefix = true;
+		} else if (!(b == 0xF0 || b == 0xF2 || b == 0xF3 || b == 0x2E || b == 0x36 || b == 0x3E ||
+			b == 0x26 || b == 0x64 || b == 0x65 || b == 0x67)) {
+			break;
+		}
+		opIdx++;
+	}
+
+	uint8_t rex = 0;
+	if (opIdx < modRmIdx && (bytes[opIdx] & 0xF0) == 0x40)
+		rex = bytes[opIdx++];
+
+	// vex and evex (0x62 is always evex in 64 bit mode) carry inverted register extension bits we'd have to recompute
+	if (opIdx >= modRmIdx || bytes[opIdx] == 0xC4 || bytes[opIdx] == 0xC5 || bytes[opIdx] == 0x62)
+		return false;
+
+	const std::vector<uint8_t> opcode(bytes.begin() + opIdx, bytes.begin() + modRmIdx);
+	const std::vector<uint8_t> prefixes(bytes.begin(), bytes.begin() + opIdx - (rex ? 1 : 0));
+	const std::vector<uint8_t> immTail(bytes.begin() + dispOff + 4, bytes.end());
+	const uint8_t reg = (uint8_t)(((modRm >> 3) & 7) | ((rex & 0x04) ? 8 : 0));
+	const uint64_t target = inst.getDestination();
+
+	// ModRM.reg is an opcode extension for these rather than a register
+	const bool regIsExt = opcode.size() == 1 && (opcode[0] == 0x80 || opcode[0] == 0x81 || opcode[0] == 0x83 ||
+		opcode[0] == 0x8F || opcode[0] == 0xC0 || opcode[0] == 0xC1 || opcode[0] == 0xC6 || opcode[0] == 0xC7 ||
+		(opcode[0] >= 0xD0 && opcode[0] <= 0xD3) || opcode[0] == 0xF6 || opcode[0] == 0xF7 || opcode[0] == 0xFE ||
+		opcode[0] == 0xFF) || (opcode.size() == 2 && opcode[0] == 0x0F && (opcode[1] == 0xBA || opcode[1] == 0x18 ||
+		opcode[1] == 0x0D || opcode[1] == 0xAE || opcode[1] == 0xC7));
+
+	// push [rip + X] (ff /6) and pop [rip + X] (8f /0) move rsp themselves
+	if (opcode.size() == 1 && opcode[0] == 0xFF && ((modRm >> 3) & 7) == 6)
+		return false;
+	if (opcode.size() == 1 && opcode[0] == 0x8F)
+		return false;
+
+	auto appendMovImm64 = [&target] (std::vector<uint8_t>& out, const uint8_t r) {
+		out.push_back((uint8_t)(0x48 | ((r & 8) ? 0x01 : 0x00)));
+		out.push_back((uint8_t)(0xB8 | (r & 7)));
+		const size_t at = out.size();
+		out.resize(at + 8);
+		memcpy(&out[at], &target, 8);
+	};
+
+	std::stringstream ss;
+	ss << std::hex;
+	std::vector<uint8_t> newBytes;
+	const bool noPrefixes = prefixes.empty();
+
+	// lea r64, [rip + X] -> mov r64, X
+	if (noPrefixes && opcode.size() == 1 && opcode[0] == 0x8D && (rex & 0x08)) {
+		appendMovImm64(newBytes, reg);
+		ss << "r" << (int)reg << ", " << target;
+		inst.rewrite(newBytes, ss.str());
+		return true;
+	}
+
+	/* mov r64/r32, [rip + X] (and the zero/sign extending loads) write the whole register, so it can hold the
+	address first: mov r, X; mov r, [r]*/
+	const bool fullWidthLoad = noPrefixes && !opSzPrefix && ((opcode.size() == 1 && (opcode[0] == 0x8B || (opcode[0] == 0x63 && (rex & 0x08)))) ||
+		(opcode.size() == 2 && opcode[0] == 0x0F && (opcode[1] == 0xB6 || opcode[1] == 0xB7 || opcode[1] == 0xBE || opcode[1] == 0xBF)));
+	if (fullWidthLoad && (reg & 7) != 4 && (reg & 7) != 5) {
+		appendMovImm64(newBytes, reg);
+		if (reg & 8)
+			rex |= 0x05; // REX.R and REX.B both select r8-r15
+		else
+			rex &= ~0x05;
+
+		if (rex != 0 && rex != 0x40)
+			newBytes.push_back(rex);
+		newBytes.insert(newBytes.end(), opcode.begin(), opcode.end());
+		newBytes.push_back((uint8_t)(((reg & 7) << 3) | (reg & 7)));
+		ss << "r" << (int)reg << ", [" << target << "]";
+		inst.rewrite(newBytes, ss.str());
+		return true;
+	}
+
+	// our push moves rsp, so an instruction that has rsp as its register operand would see the wrong value
+	if (!regIsExt && reg == 4)
+		return false;
+
+	// scratch must not be the register operand, rbx/rsi/rdi also need no SIB or REX.B as a base
+	uint8_t scratch = 3;
+	if ((!regIsExt && reg == scratch) || (opcode.size() == 2 && opcode[0] == 0x0F && opcode[1] == 0xC7))
+		scratch = 6; // cmpxchg8b/16b use rbx implicitly
+
+	const std::vector<uint8_t> redZoneSub = { 0x48, 0x8D, 0x64, 0x24, 0x80 };
+	const std::vector<uint8_t> redZoneAdd = { 0x48, 0x8D, 0xA4, 0x24, 0x80, 0x00, 0x00, 0x00 };
+
+	newBytes.insert(newBytes.end(), redZoneSub.begin(), redZoneSub.end());
+	newBytes.push_back((uint8_t)(0x50 | scratch));
+	appendMovImm64(newBytes, scratch);
+
+	newBytes.insert(newBytes.end(), prefixes.begin(), prefixes.end());
+	if (rex != 0)
+		newBytes.push_back((uint8_t)(rex & ~0x03)); // REX.X and REX.B are meaningless for [rip + X] and wrong for [scratch]
+	newBytes.insert(newBytes.end(), opcode.begin(), opcode.end());
+	newBytes.push_back((uint8_t)((modRm & 0x38) | scratch));
+	newBytes.insert(newBytes.end(), immTail.begin(), immTail.end());
+
+	newBytes.push_back((uint8_t)(0x58 | scratch));
+	newBytes.insert(newBytes.end(), redZoneAdd.begin(), redZoneAdd.end());
+
+	ss << "[" << target << "] via r" << (int)scratch;
+	inst.rewrite(newBytes, ss.str());
+	return true;
+}
+
+/**Write a 2 byte short jump. Destination must be within -128/+127 of the end of the jmp.**/
+inline PLH::insts_t makeRel8Jmp(const uint64_t address, const uint64_t destination, const Mode mode) {
+	Instruction::Displacement disp;
+	disp.Relative = Instruction::calculateRelativeDisplacement<int8_t>(address, destination, 2);
+	assert(disp.Relative >= -128 && disp.Relative <= 127);
+
+	std::vector<uint8_t> bytes(2);
+	bytes[0] = 0xEB;
+	bytes[1] = (uint8_t)disp.Relative;
+
+	std::stringstream ss;
+	ss << std::hex << destination;
+
+	return { Instruction(address, disp, 1, true, bytes, "jmp", ss.str(), mode) };
+}
+
 inline PLH::insts_t makex86Jmp(const uint64_t address, const uint64_t destination) {
 	Instruction::Displacement disp;
 	disp.Relative = Instruction::calculateRelativeDisplacement<int32_t>(address, destination, 5);
@@ -374,12 +613,34 @@ inline PLH::insts_t makex86Jmp(const uint64_t address, const uint64_t destinatio
 	return { Instruction(address, disp, 1, true, bytes, "jmp", ss.str(), Mode::x86) };
 }
 
+/**Write a 6 byte jmp [destHolder]. The absolute address of destHolder is encoded in the jmp, destination is
+ * the 4 byte pointer written into destHolder.**/
+inline PLH::insts_t makex86IndirectJmp(const uint64_t address, const uint64_t destination, const uint64_t destHolder) {
+	Instruction::Displacement disp;
+	disp.Absolute = destHolder;
+
+	std::vector<uint8_t> destBytes(4);
+	memcpy(destBytes.data(), &destination, 4);
+	Instruction::Displacement zeroDisp = { 0 };
+	Instruction specialDest(destHolder, zeroDisp, 0, false, destBytes, "dest holder", "", Mode::x86);
+
+	std::vector<uint8_t> bytes(6);
+	bytes[0] = 0xFF;
+	bytes[1] = 0x25;
+	memcpy(&bytes[2], &destHolder, 4);
+
+	std::stringstream ss;
+	ss << std::hex << "[" << destHolder << "] ->" << destination;
+
+	return { Instruction(address, disp, 2, false, bytes, "jmp", ss.str(), Mode::x86), specialDest };
+}
+
 
 inline PLH::insts_t makeAgnosticJmp(const uint64_t address, const uint64_t destination) {
 	if constexpr (sizeof(char*) == 4)
 		return makex86Jmp(address, destination);
 	else
-		return makex64PreferredJump(address, destination);
+		return makex64RipIndirectJump(address, destination);
 }
 
 }
@@ -10,6 +10,8 @@
 #define NOMINMAX
 #include <Windows.h>
 #include <iostream>
+#include <cstdint>
+#include <map>
 
 PLH::ProtFlag operator|(PLH::ProtFlag lhs, PLH::ProtFlag rhs);
 bool operator&(PLH::ProtFlag lhs, PLH::ProtFlag rhs);
@@ -19,6 +21,45 @@ namespace PLH {
 int	TranslateProtection(const PLH::ProtFlag flags);
 ProtFlag TranslateProtection(const int prot);
 
+/**While one is alive, every MemoryProtector created on the same thread changes protection through it instead.
+Each page is changed once, the first time it's asked for, and left that way until the batch is destroyed, which
+restores every page to its original protection and flushes the instruction cache once. Instruction cache flushes
+done by atomicPatch on this thread are deferred to that point too. Batches nest, the innermost is used.**/
+class ProtectionBatch {
+public:
+	ProtectionBatch();
+	~ProtectionBatch();
+
+	ProtectionBatch(const ProtectionBatch&) = delete;
+	ProtectionBatch& operator=(const ProtectionBatch&) = delete;
+
+	/**Give [address, address + length) at least prot, returns the original protection of its first page**/
+	PLH::ProtFlag protect(const uint64_t address, const uint64_t length, const PLH::ProtFlag prot, bool& status);
+
+	/**Note code was written to [address, address + length), the flush happens when the batch ends**/
+	void deferFlush(const uint64_t address, const uint64_t length);
+
+	/**How many pages had their protection changed so far, and how many VirtualProtect calls that took**/
+	size_t getPageCount() const;
+	size_t getProtectCount() const;
+
+	/**The batch of the calling thread, or nullptr**/
+	static ProtectionBatch* active();
+private:
+	struct Page {
+		DWORD origProt; // native, so protections ProtFlag can't express are restored as they were
+		PLH::ProtFlag prot;
+	};
+
+	// page address -> protections
+	std::map<uint64_t, Page> m_pages;
+	size_t m_protectCount;
+	bool m_needsFlush;
+
+	ProtectionBatch* m_outer;
+	static thread_local ProtectionBatch* m_active;
+};
+
 class MemoryProtector {
 public:
 	MemoryProtector(const uint64_t address, const uint64_t length, const PLH::ProtFlag prot, bool unsetOnDestroy = true) {
@@ -27,6 +68,12 @@ public:
 		unsetLater = unsetOnDestroy;
 
 		m_origProtection = PLH::ProtFlag::UNSET;
+		if (ProtectionBatch* batch = ProtectionBatch::active()) {
+			// the batch restores it
+			m_origProtection = batch->protect(address, length, prot, status);
+			unsetLater = false;
+			return;
+		}
 		m_origProtection = protect(address, length, TranslateProtection(prot));
 	}
 
@@ -8,6 +8,11 @@
 #include <stdexcept>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <cstring>
+#include <initializer_list>
 
 namespace PLH {
 
@@ -59,6 +64,33 @@ static inline char* AlignDownwards(const char* stack, size_t align) {
 	return reinterpret_cast<char*>(addr);
 }
 
+/**Can an instruction whose next instruction starts at 'from' reach 'to' with a signed 32bit displacement**/
+static inline bool IsWithinRel32(const uint64_t from, const uint64_t to) {
+	const int64_t disp = (int64_t)(to - from);
+	return disp >= std::numeric_limits<int32_t>::min() && disp <= std::numeric_limits<int32_t>::max();
+}
+
+/**Append raw machine code, for the small hand assembled stubs (MidHook, ExitHook)**/
+static inline void emitBytes(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes) {
+	code.insert(code.end(), bytes);
+}
+
+template<typename T>
+static inline void emitImm(std::vector<uint8_t>& code, const T imm) {
+	uint8_t bytes[sizeof(T)];
+	memcpy(bytes, &imm, sizeof(T));
+	code.insert(code.end(), bytes, bytes + sizeof(T));
+}
+
+/**movdqu [xsp + disp32], xmmN when store, else movdqu xmmN, [xsp + disp32]**/
+static inline void emitMovdquSp(std::vector<uint8_t>& code, const uint8_t xmm, const int32_t disp, const bool store) {
+	code.push_back(0xF3);
+	if (xmm >= 8)
+		code.push_back(0x44); // REX.R
+	emitBytes(code, { 0x0F, (uint8_t)(store ? 0x7F : 0x6F), (uint8_t)(0x84 | ((xmm & 7) << 3)), 0x24 });
+	emitImm<int32_t>(code, disp);
+}
+
 template<typename Func>
 class FinalAction {
 public:
@@ -0,0 +1,191 @@
+#ifndef POLYHOOK_2_PACKEDINSTRUCTION_HPP
+#define POLYHOOK_2_PACKEDINSTRUCTION_HPP
+
+#include "headers/Instruction.hpp"
+#include "headers/Enums.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <type_traits>
+
+namespace PLH {
+
+/**What an instruction does to control flow, all that most analysis needs instead of the mnemonic**/
+enum class InstClass : uint8_t {
+	Other,
+	Jmp,
+	Jcc,	// also loop and jecxz
+	Call,
+	Ret,
+	Int3,
+	Nop
+};
+
+/**Fixed size counterpart of Instruction for bulk disassembly. The bytes are stored inline, there is no UID, and
+no text: the mnemonic and operands are only produced when the instruction is printed or converted, by decoding its
+bytes again (see ADisassembler::unpack). Copying one is a memcpy, a vector of them is the only allocation.
+Displacements work as in Instruction. Convert with ADisassembler::unpack where the full API is needed.**/
+class PackedInstruction {
+public:
+	static constexpr uint8_t MaxSize = 15;
+
+	PackedInstruction() = default;
+
+	PackedInstruction(const uint64_t address, const uint8_t* bytes, const uint8_t size, const InstClass instClass) {
+		assert(size <= MaxSize);
+		m_address = address;
+		memcpy(m_bytes, bytes, size);
+		m_size = size;
+		m_class = instClass;
+	}
+
+	/**Pack an existing instruction, its class is worked out from the mnemonic**/
+	explicit PackedInstruction(const Instruction& inst) : PackedInstruction(inst.getAddress(), inst.getBytes().data(),
+																			 (uint8_t)inst.size(), classify(inst)) {
+		m_flags = (uint8_t)((inst.isBranching() ? Branching : 0) | (inst.isDisplacementRelative() ? Relative : 0) |
+							(inst.hasDisplacement() ? HasDisplacement : 0));
+		m_dispOffset = inst.getDisplacementOffset();
+		m_dispSize = inst.hasDisplacement() ? (uint8_t)inst.getDispSize() : 0;
+		m_displacement = inst.getDisplacement();
+	}
+
+	/**Back to a full Instruction, given the text the bytes decode to**/
+	Instruction toInstruction(const std::string& mnemonic, const std::string& opStr, const Mode mode) const {
+		Instruction inst(m_address, m_displacement, m_dispOffset, isDisplacementRelative(),
+						 std::vector<uint8_t>(m_bytes, m_bytes + m_size), mnemonic, opStr, mode);
+		if (hasDisplacement()) {
+			inst.setDisplacementSize(m_dispSize);
+			if (isDisplacementRelative())
+				inst.setRelativeDisplacement(m_displacement.Relative);
+			else
+				inst.setAbsoluteDisplacement(m_displacement.Absolute);
+		}
+		inst.setBranching(isBranching());
+		return inst;
+	}
+
+	uint64_t getAddress() const {
+		return m_address;
+	}
+
+	void setAddress(const uint64_t address) {
+		m_address = address;
+	}
+
+	/**Where the instruction points, see Instruction::getDestination**/
+	uint64_t getDestination() const {
+		if (isDisplacementRelative())
+			return m_address + m_displacement.Relative + m_size;
+		return m_displacement.Absolute;
+	}
+
+	Instruction::Displacement getDisplacement() const {
+		return m_displacement;
+	}
+
+	const uint8_t* getBytes() const {
+		return m_bytes;
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	InstClass getClass() const {
+		return m_class;
+	}
+
+	bool isBranching() const {
+		return (m_flags & Branching) != 0;
+	}
+
+	bool hasDisplacement() const {
+		return (m_flags & HasDisplacement) != 0;
+	}
+
+	bool isDisplacementRelative() const {
+		return (m_flags & Relative) != 0;
+	}
+
+	uint8_t getDisplacementOffset() const {
+		return m_dispOffset;
+	}
+
+	size_t getDispSize() const {
+		if (m_dispSize != 0)
+			return m_dispSize;
+		return m_size - m_dispOffset;
+	}
+
+	/* Setters the disassembler fills the displacement fields with, they behave as Instruction's do*/
+	void setBranching(const bool status) {
+		m_flags = (uint8_t)(status ? m_flags | Branching : m_flags & ~Branching);
+	}
+
+	void setDisplacementOffset(const uint8_t offset) {
+		m_dispOffset = offset;
+	}
+
+	void setDisplacementSize(const uint8_t size) {
+		m_dispSize = size;
+	}
+
+	void setRelativeDisplacement(const int64_t displacement) {
+		m_displacement.Relative = displacement;
+		m_flags |= Relative | HasDisplacement;
+		writeDisplacement();
+	}
+
+	void setAbsoluteDisplacement(const uint64_t displacement) {
+		m_displacement.Absolute = displacement;
+		m_flags = (uint8_t)((m_flags & ~Relative) | HasDisplacement);
+		writeDisplacement();
+	}
+
+	/**Class of an instruction that has only its mnemonic and bytes to go by**/
+	static InstClass classify(const Instruction& inst) {
+		const std::string mnemonic = inst.getMnemonic();
+		if (mnemonic == "jmp")
+			return InstClass::Jmp;
+		if (mnemonic == "call")
+			return InstClass::Call;
+		if (mnemonic == "ret")
+			return InstClass::Ret;
+		if (mnemonic == "int3")
+			return InstClass::Int3;
+		if (mnemonic == "nop")
+			return InstClass::Nop;
+		if (inst.isBranching())
+			return InstClass::Jcc;
+		return InstClass::Other;
+	}
+private:
+	enum Flags : uint8_t {
+		Branching = 1,
+		HasDisplacement = 2,
+		Relative = 4
+	};
+
+	void writeDisplacement() {
+		const size_t dispSz = getDispSize();
+		assert(m_dispOffset + dispSz <= m_size && dispSz <= sizeof(m_displacement));
+		if (m_dispOffset + dispSz <= m_size && dispSz <= sizeof(m_displacement))
+			memcpy(&m_bytes[m_dispOffset], &m_displacement, dispSz);
+	}
+
+	uint64_t					m_address = 0;
+	Instruction::Displacement	m_displacement = { 0 };
+	uint8_t						m_bytes[MaxSize] = {};
+	uint8_t						m_size = 0;
+	uint8_t						m_dispOffset = 0;
+	uint8_t						m_dispSize = 0;  // 0 if the displacement runs to the end of the instruction
+	uint8_t						m_flags = 0;
+	InstClass					m_class = InstClass::Other;
+};
+
+static_assert(std::is_trivially_copyable<PackedInstruction>::value, "PackedInstruction must copy as plain bytes");
+
+typedef std::vector<PackedInstruction> packed_insts_t;
+}
+#endif
@@ -7,6 +7,7 @@
 #include <atomic>
 #include <cassert>
 #include <limits>
+#include <algorithm>
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <Windows.h>
@@ -17,9 +18,10 @@ namespace PLH {
 	pages within that section in linearly increasing order, with each new block being contiguously
 	allocated from the next free spot. Blocks are requested by variable size, and pages are allocated
 	within the allowed range to back these if needed. A page will be split if blocks smaller than page size
-	are requested. Blocks however will never be split across a page. Blocks cannot be freed once requested, 
-	you must destroy the entire allocator which will free all backing pages, and thus all blocks, 
-	this is cuz im lazy, i accept pr's :)**/
+	are requested. Blocks however will never be split across a page. Freeing a block only returns its space
+	once every block on that page has been freed, the page is then reused from the start. Backing pages are
+	released when the last allocator is destroyed, this is cuz im lazy, i accept pr's :) Once the Reclaimer exists
+	that never happens, it holds an allocator for the life of the process.**/
 	struct SplitPage {
 		// start address of page
 		uint64_t address;
@@ -27,6 +29,9 @@ namespace PLH {
 		// offset into page pointing at first unused byte
 		uint64_t unusedOffset;
 
+		// number of blocks handed out from this page that are not yet freed
+		uint64_t blockCount;
+
 		uint64_t getUnusedAddr() const {
 			return address + unusedOffset;
 		}
@@ -34,13 +39,24 @@ namespace PLH {
 
 	class PageAllocator {
 	public:
-		/** Construct an allocator to return pages within [address, address + size).
+		/** Construct an allocator to return pages within [address, address + size). New pages are
+		searched for outward from the middle of the range, so blocks land as close to it as possible.
 		If size is zero, then it will try to allocate anywhere**/
 		PageAllocator(const uint64_t address, const uint64_t size);
 		~PageAllocator();
 
 		uint64_t getBlock(const uint64_t size);
+
+		/** Same as getBlock but from [regionStart, regionStart + regionSize) instead of this allocator's own range,
+		anywhere if regionSize is zero**/
+		uint64_t getBlock(const uint64_t size, const uint64_t regionStart, const uint64_t regionSize);
+
+		/** Give back a block returned by getBlock. The memory is reused once its whole page is free**/
+		void freeBlock(const uint64_t address);
 	private:
+		// carve a block out of the page if it fits and lies within the range, 0 otherwise
+		uint64_t getBlockFromPage(SplitPage& page, const uint64_t size, const uint64_t regionStart, const uint64_t regionSize) const;
+
 		const uint64_t WIN_PAGE_SZ = 0x1000;
 
 		uint64_t m_regionStart;
@@ -49,7 +65,7 @@ namespace PLH {
 		// vector of pages + unused cursor
 		static std::vector<SplitPage> m_pages;
 		static std::recursive_mutex m_pageMtx;
-		static std::atomic<uint8_t> m_refCount;
+		static std::atomic<uint32_t> m_refCount;
 	};
 
 	inline uint64_t AllocateWithinRange(uint64_t pStart, int64_t Delta);
@@ -78,6 +94,11 @@ inline uint64_t PLH::AllocateWithinRange(const uint64_t pStart, const int64_t De
 	memset(&si, 0, sizeof(si));
 	GetSystemInfo(&si);
 
+	// the allocation must lie entirely within [Low, High), regions found may extend past either end
+	const uint64_t Low = Delta > 0 ? pStart : pStart + Delta;
+	const uint64_t High = Delta > 0 ? pStart + Delta : pStart;
+	const uint64_t Granularity = si.dwAllocationGranularity;
+
 	//Start at pStart, search around it (up/down depending on Delta)
 	MEMORY_BASIC_INFORMATION mbi;
 	for (uint64_t Addr = (uint64_t)pStart; Comparator(Delta, Addr, (uint64_t)pStart + Delta); Addr = Incrementor(Delta, mbi))
@@ -90,21 +111,25 @@ inline uint64_t PLH::AllocateWithinRange(const uint64_t pStart, const int64_t De
 		// TODO: Fails on PAGE_NO_ACCESS type for now
 		if (mbi.State != MEM_FREE)
 			continue;
-		
-		// address online alignment boundary, split it (upwards)
-		if ((uint64_t)mbi.BaseAddress & (si.dwAllocationGranularity - 1)) {
-			uint64_t nextPage = (uint64_t)PLH::AlignUpwards((char*)mbi.BaseAddress, si.dwAllocationGranularity);
-			uint64_t unusableSize = nextPage - (uint64_t)mbi.BaseAddress;
-			Addr = nextPage;
-
-			if (uint64_t Allocated = (uint64_t)VirtualAlloc((char*)nextPage, (SIZE_T)(mbi.RegionSize - unusableSize), MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE))
-				return Allocated;
+
+		const uint64_t RegionStart = std::max<uint64_t>((uint64_t)mbi.BaseAddress, Low);
+		const uint64_t RegionEnd = std::min<uint64_t>((uint64_t)mbi.BaseAddress + mbi.RegionSize, High);
+
+		//VirtualAlloc requires 64k aligned addresses, take the aligned page closest to where we started
+		uint64_t Candidate = 0;
+		if (Delta > 0) {
+			Candidate = (RegionStart + Granularity - 1) & ~(Granularity - 1);
 		} else {
-			//VirtualAlloc requires 64k aligned addresses
-			assert((uint64_t)mbi.BaseAddress % si.dwAllocationGranularity == 0);
-			if (uint64_t Allocated = (uint64_t)VirtualAlloc((char*)mbi.BaseAddress, (SIZE_T)si.dwPageSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE))
-				return Allocated;
+			if (RegionEnd < si.dwPageSize)
+				continue;
+			Candidate = (RegionEnd - si.dwPageSize) & ~(Granularity - 1);
 		}
+
+		if (Candidate < RegionStart || Candidate + si.dwPageSize > RegionEnd)
+			continue;
+
+		if (uint64_t Allocated = (uint64_t)VirtualAlloc((char*)Candidate, (SIZE_T)si.dwPageSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE))
+			return Allocated;
 	}
 	return 0;
 }
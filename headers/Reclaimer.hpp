@@ -0,0 +1,76 @@
+#ifndef POLYHOOK_2_RECLAIMER_HPP
+#define POLYHOOK_2_RECLAIMER_HPP
+
+#include "headers/PageAllocator.hpp"
+#include "headers/ThreadQuiescer.hpp"
+#include "headers/MemProtector.hpp"
+#include "headers/ErrorLog.hpp"
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <functional>
+
+namespace PLH {
+
+/**Defers freeing code that threads may still be running, trampolines and stubs of hooks that were just removed.
+Retired memory is freed by a later collect() that finds no thread referencing it. Every other thread is briefly
+suspended and counts as inside a block if its instruction pointer, any general purpose register, or any word on
+its stack points into it. That covers threads executing the block, threads that are about to jmp to it, and
+threads that will return into it from a call made there. Each collect is a grace period, a block that survives
+one is simply retried by the next. The thread retiring memory must not itself be inside it, and pointers to it
+kept only in the heap or globals aren't seen, which is why hooks clear the trampoline variable first.**/
+class Reclaimer {
+public:
+	static Reclaimer& singleton();
+
+	/* Retiring only queues the memory, a collect suspends every thread in the process so it isn't done per retire.
+	Collects happen when asked for (collect, drain), at the end of a HookBatch, and when retiring brings the queued
+	size to CollectThreshold outside of a ProtectionBatch. Only that last one pauses a thread that merely unhooked.*/
+	static const uint64_t CollectThreshold = 0x10000;
+
+	/**Free a PageAllocator block once no thread can be inside [address, address + size)**/
+	void retireBlock(const uint64_t address, const uint64_t size);
+
+	/**Executable memory for hook code, from the allocator retireBlock frees into. The Reclaimer is never destroyed
+	so its pages live as long as the process, a hook destroyed while still installed can't free code that threads
+	are running. If regionSize is non-zero the block lies within [regionStart, regionStart + regionSize).**/
+	uint64_t getBlock(const uint64_t size, const uint64_t regionStart = 0, const uint64_t regionSize = 0);
+
+	/**Free a block from getBlock right away, only for memory no thread was ever sent to**/
+	void freeBlock(const uint64_t address);
+
+	/**Call release once no thread can be inside [address, address + size), for memory not from a PageAllocator**/
+	void retire(const uint64_t address, const uint64_t size, const std::function<void()>& release);
+
+	/**Free all retired memory no thread is referencing, doesn't wait. Returns how much is still pending.**/
+	size_t collect();
+
+	/**collect() until nothing is pending or timeout passes. Returns true if everything was freed.**/
+	bool drain(const std::chrono::milliseconds timeout);
+
+	size_t getPendingCount();
+
+	Reclaimer(const Reclaimer&) = delete;
+	Reclaimer& operator=(const Reclaimer&) = delete;
+private:
+	Reclaimer();
+
+	struct Retired {
+		uint64_t address;
+		uint64_t size;
+		std::function<void()> release;
+	};
+
+	// mark every retired block the thread with this context references
+	void markReferenced(const CONTEXT& ctx, std::vector<uint8_t>& referenced) const;
+
+	std::vector<Retired>	m_retired;
+	uint64_t				m_pendingBytes;
+	std::mutex				m_mtx;
+
+	// hands out hook code and frees it once retired, and keeps every allocator's pages alive
+	PageAllocator			m_mem;
+};
+}
+#endif
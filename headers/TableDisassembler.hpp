@@ -0,0 +1,49 @@
+#ifndef POLYHOOK_2_0_TABLEDISASSEMBLER_HPP
+#define POLYHOOK_2_0_TABLEDISASSEMBLER_HPP
+
+#include "headers/ADisassembler.hpp"
+#include "headers/PackedInstruction.hpp"
+
+#include <cstdint>
+#include <string>
+
+namespace PLH {
+
+/**Disassembler that finds instruction lengths and control flow from opcode tables instead of fully decoding.
+Prologue sizing only needs to know how long each instruction is and whether it branches, returns or is position
+dependent, so most instructions never reach the full disassembler. Those that have a displacement to relocate
+(relative branches, rip relative operands, x86 jmp [abs]) and anything the tables don't cover are handed to the
+fallback, so the fields used for relocation are exactly the fallback's. The others are returned without operand
+text, and a mnemonic only for those the library looks at by name (ret, int3, nop, jmp, call, syscall). Print them
+through the fallback, e.g. unpack(PackedInstruction(inst)). Branch map and thread safety are as for the fallback.**/
+class TableDisassembler : public ADisassembler {
+public:
+	/**What the tables know about one instruction**/
+	struct Decoded {
+		uint8_t		size;
+		InstClass	instClass;
+		bool		branching;
+		bool		needsFull;	// has a displacement, must go through the full disassembler
+		const char*	mnemonic;	// "" unless it's one of those named above
+	};
+
+	TableDisassembler(PLH::Mode mode, PLH::ADisassembler& fallback);
+	virtual ~TableDisassembler() = default;
+
+	virtual insts_t disassemble(uint64_t firstInstruction, uint64_t start, uint64_t end) override;
+
+	virtual std::optional<Instruction> disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) override;
+
+	virtual packed_insts_t disassemblePacked(uint64_t firstInstruction, uint64_t start, uint64_t end) override;
+
+	/**Text always comes from the fallback**/
+	virtual bool decodeText(const PackedInstruction& inst, std::string& mnemonic, std::string& opStr) override;
+
+	/**Decode the instruction at code, reading at most avail bytes. False if the tables don't cover it (xop,
+	 * undefined opcodes) or it's cut off.**/
+	static bool decode(const uint8_t* code, const size_t avail, const Mode mode, Decoded& out);
+private:
+	ADisassembler& m_fallback;
+};
+}
+#endif //POLYHOOK_2_0_TABLEDISASSEMBLER_HPP
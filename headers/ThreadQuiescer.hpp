@@ -0,0 +1,57 @@
+#ifndef POLYHOOK_2_THREADQUIESCER_HPP
+#define POLYHOOK_2_THREADQUIESCER_HPP
+
+#include "headers/ErrorLog.hpp"
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <atomic>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <TlHelp32.h>
+
+namespace PLH {
+
+/**Suspends every other thread of the process for as long as it lives, so code can be patched with nobody
+running it. Threads started after construction aren't caught. Don't allocate or log while one is alive, a
+suspended thread may hold the heap lock.**/
+class ThreadQuiescer {
+public:
+	ThreadQuiescer();
+	~ThreadQuiescer();
+
+	ThreadQuiescer(const ThreadQuiescer&) = delete;
+	ThreadQuiescer& operator=(const ThreadQuiescer&) = delete;
+
+	/**Move every suspended thread whose instruction pointer is a key of relocations to the mapped address.
+	Used to carry threads stopped inside an overwritten prologue over to the same instruction in the trampoline,
+	and back again on unhook.**/
+	void fixupInstructionPointers(const std::map<uint64_t, uint64_t>& relocations);
+
+	/**Call fn with the full integer and control register context of each suspended thread. fn must not allocate
+	or log, see above.**/
+	template<typename Fn>
+	void forEachThreadContext(Fn fn) const {
+		for (HANDLE thread : m_threads) {
+			CONTEXT ctx;
+			ctx.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+			if (GetThreadContext(thread, &ctx))
+				fn(ctx);
+		}
+	}
+
+	/**How many threads are suspended**/
+	size_t getThreadCount() const;
+
+	/**How long the threads were held by the last ThreadQuiescer to be destroyed**/
+	static std::chrono::nanoseconds getLastPauseDuration();
+private:
+	std::vector<HANDLE> m_threads;
+	std::chrono::steady_clock::time_point m_pauseStart;
+
+	static std::atomic<int64_t> m_lastPauseNs;
+};
+}
+#endif
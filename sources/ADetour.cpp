@@ -25,26 +25,231 @@ std::optional<PLH::insts_t> PLH::Detour::calcNearestSz(const PLH::insts_t& funct
 	return std::nullopt;
 }
 
-bool PLH::Detour::followJmp(PLH::insts_t& functionInsts, const uint8_t curDepth, const uint8_t depth) {
-	if (functionInsts.size() <= 0 || curDepth >= depth) {
+bool PLH::Detour::calcProlForJmpSz(insts_t& functionInsts, const uint64_t jmpSz, insts_t& prologue,
+									 uint64_t& minProlSz, uint64_t& roundProlSz) {
+	m_cloned = false;
+	releaseCave();
+
+	if (m_planCache != nullptr && m_planCache->findPrologue(m_fnAddress, (uint8_t)jmpSz, getArchType(), prologue, minProlSz, roundProlSz))
+		return true;
+
+	if (functionInsts.empty()) {
+		functionInsts = m_disasm.disassemble(m_fnAddress, m_fnAddress, m_fnAddress + 100);
+		if (functionInsts.empty()) {
+			ErrorLog::singleton().push("Disassembler unable to decode any valid instructions", ErrorLevel::SEV);
+			return false;
+		}
+	}
+
+	// only plain prologues are cached, caves and clones depend on more than the function's own bytes
+	const char* failure = calcProlForSz(functionInsts, jmpSz, prologue, minProlSz, roundProlSz);
+	if (failure == nullptr) {
+		if (m_planCache != nullptr)
+			m_planCache->addPrologue(m_fnAddress, (uint8_t)jmpSz, prologue, minProlSz, roundProlSz);
+		return true;
+	}
+
+	// a 2 byte short jmp to a nearby cave holding the real jmp fits where the real jmp doesn't
+	if (m_codeCaveFallback && jmpSz > 2 && calcProlForSz(functionInsts, 2, prologue, minProlSz, roundProlSz) == nullptr) {
+		const uint64_t prolStart = prologue.front().getAddress();
+		m_codeCave = findCodeCave(prolStart, prolStart + roundProlSz, (uint8_t)jmpSz);
+		if (m_codeCave != NULL) {
+			ErrorLog::singleton().push("Jmp placed in code cave", ErrorLevel::INFO);
+			return true;
+		}
+	}
+
+	if (m_cloneFallback)
+		return calcCloneSz(functionInsts, jmpSz, prologue, minProlSz, roundProlSz);
+
+	ErrorLog::singleton().push(failure, ErrorLevel::SEV);
+	return false;
+}
+
+const char* PLH::Detour::calcProlForSz(const insts_t& functionInsts, const uint64_t jmpSz, insts_t& prologue,
+									   uint64_t& minProlSz, uint64_t& roundProlSz) {
+	minProlSz = jmpSz; // min size of patches that may split instructions
+	roundProlSz = minProlSz; // nearest size to min that doesn't split any instructions
+
+	// find the prologue section we will overwrite with jmp + zero or more nops
+	auto prologueOpt = calcNearestSz(functionInsts, minProlSz, roundProlSz);
+	if (!prologueOpt)
+		return "Function too small to hook safely!";
+
+	assert(roundProlSz >= minProlSz);
+	prologue = *prologueOpt;
+
+	if (!expandProlSelfJmps(prologue, functionInsts, minProlSz, roundProlSz))
+		return "Function needs a prologue jmp table but it's too small to insert one";
+	return nullptr;
+}
+
+bool PLH::Detour::calcCloneSz(const insts_t& functionInsts, const uint64_t jmpSz, insts_t& body,
+							  uint64_t& minProlSz, uint64_t& roundProlSz) {
+	assert(functionInsts.size() > 0);
+	const uint64_t fnStart = functionInsts.front().getAddress();
+	const uint64_t fnWindowEnd = functionInsts.back().getAddress() + functionInsts.back().size();
+
+	/* The function ends at the first ret or unconditional jmp that no branch before it jumps past. Forward
+	jcc/jmp targets inside the decoded window are taken to be part of the function, anything else is external.*/
+	body.clear();
+	uint64_t furthestTarget = fnStart;
+	size_t i = 0;
+	bool foundEnd = false;
+	for (; i < functionInsts.size(); i++) {
+		const auto& inst = functionInsts[i];
+		body.push_back(inst);
+
+		const uint64_t instEnd = inst.getAddress() + inst.size();
+		const bool isJmp = inst.getMnemonic() == "jmp";
+		if (inst.isBranching() && inst.hasDisplacement() && inst.isDisplacementRelative() &&
+			(isJmp || m_disasm.isConditionalJump(inst))) {
+			const uint64_t dest = inst.getDestination();
+			if (dest > furthestTarget && dest < fnWindowEnd && (!isJmp || instEnd <= furthestTarget))
+				furthestTarget = dest;
+		}
+
+		if ((m_disasm.isFuncEnd(inst) || isJmp) && instEnd > furthestTarget) {
+			foundEnd = true;
+			i++;
+			break;
+		}
+	}
+
+	if (!foundEnd) {
+		ErrorLog::singleton().push("Function too large to clone", ErrorLevel::SEV);
+		return false;
+	}
+
+	/* A jmp longer than the function itself runs into the alignment padding after it. Take the padding along
+	so it's restored on unhook, but only if it's really padding.*/
+	uint64_t bodySz = calcInstsSz(body);
+	for (; bodySz < jmpSz && i < functionInsts.size(); i++) {
+		const auto& inst = functionInsts[i];
+		if (inst.getMnemonic() != "int3" && inst.getMnemonic() != "nop")
+			break;
+
+		body.push_back(inst);
+		bodySz += inst.size();
+	}
+
+	if (bodySz < jmpSz) {
+		ErrorLog::singleton().push("Function too small to clone, not enough padding after it for the jmp", ErrorLevel::SEV);
+		return false;
+	}
+
+	ErrorLog::singleton().push("Cloning whole function", ErrorLevel::INFO);
+	minProlSz = jmpSz;
+	roundProlSz = bodySz;
+	m_cloned = true;
+	return true;
+}
+
+bool PLH::Detour::allocateTrampoline(const uint64_t nearAddress) {
+	assert(m_trampoline == NULL);
+	assert(m_trampolineSz > 0);
+
+	if (nearAddress != 0) {
+		// keep the end of the block inside the window too, with some slack for the rel32 instruction itself
+		const uint64_t maxDist = 0x7FF00000 - m_trampolineSz;
+		const uint64_t regionStart = nearAddress > maxDist ? nearAddress - maxDist : 0;
+		const uint64_t regionEnd = nearAddress + maxDist < nearAddress ? std::numeric_limits<uint64_t>::max() : nearAddress + maxDist;
+		m_trampoline = Reclaimer::singleton().getBlock(m_trampolineSz, regionStart, regionEnd - regionStart);
+	} else {
+		m_trampoline = Reclaimer::singleton().getBlock(m_trampolineSz);
+	}
+	return m_trampoline != NULL;
+}
+
+void PLH::Detour::freeTrampoline() {
+	if (m_trampoline == NULL)
+		return;
+
+	Reclaimer::singleton().freeBlock(m_trampoline);
+	m_trampoline = NULL;
+}
+
+void PLH::Detour::releaseCave() {
+	if (m_codeCave == NULL)
+		return;
+
+	releaseCodeCave(m_codeCave);
+	m_codeCave = NULL;
+}
+
+bool PLH::Detour::resolveTargets(insts_t& functionInsts) {
+	/* Only the first instruction at each address in a jmp chain matters, so the chains are followed one decoded
+	instruction at a time. The function itself is then decoded as a whole window, its branch map is needed to find
+	jmps back into the prologue.*/
+	uint64_t resolved = 0;
+	if (m_planCache != nullptr && m_planCache->findResolved(m_fnCallback, resolved)) {
+		m_fnCallback = resolved;
+	} else {
+		uint64_t callback = m_fnCallback;
+		if (!followJmp(callback)) {
+			ErrorLog::singleton().push("Callback jmp resolution failed", ErrorLevel::SEV);
+			return false;
+		}
+
+		// update given fn callback address to resolved one
+		if (m_planCache != nullptr)
+			m_planCache->addResolved(m_fnCallback, callback);
+		m_fnCallback = callback;
+	}
+
+	functionInsts.clear();
+	if (m_followJmps) {
+		if (m_planCache != nullptr && m_planCache->findResolved(m_fnAddress, resolved)) {
+			m_fnAddress = resolved;
+		} else {
+			uint64_t fnAddress = m_fnAddress;
+			if (!followJmp(fnAddress)) {
+				ErrorLog::singleton().push("Prologue jmp resolution failed", ErrorLevel::SEV);
+				return false;
+			}
+
+			// update given fn address to resolved one
+			if (m_planCache != nullptr)
+				m_planCache->addResolved(m_fnAddress, fnAddress);
+			m_fnAddress = fnAddress;
+		}
+	}
+
+	// with a cache the function is disassembled later, and only if its prologue isn't in it
+	if (m_planCache != nullptr)
+		return true;
+
+	functionInsts = m_disasm.disassemble(m_fnAddress, m_fnAddress, m_fnAddress + 100);
+	if (functionInsts.size() <= 0) {
+		ErrorLog::singleton().push("Disassembler unable to decode any valid instructions", ErrorLevel::SEV);
+		return false;
+	}
+	return true;
+}
+
+bool PLH::Detour::followJmp(uint64_t& address, const uint8_t curDepth, const uint8_t depth) {
+	std::optional<Instruction> first;
+	if (curDepth < depth)
+		first = m_disasm.disassembleOne(address, address, address + PackedInstruction::MaxSize);
+
+	if (!first) {
 		ErrorLog::singleton().push("Couldn't decompile instructions at followed jmp", ErrorLevel::WARN);
 		return false;
 	}
 
 	// not a branching instruction, no resolution needed
-	if (!functionInsts.front().isBranching()) {
+	if (!first->isBranching()) {
 		return true;
 	}
 
 	// might be a mem type like jmp rax, not supported
-	if (!functionInsts.front().hasDisplacement()) {
+	if (!first->hasDisplacement()) {
 		ErrorLog::singleton().push("Branching instruction without displacement encountered", ErrorLevel::WARN);
 		return false;
 	}
 
-	uint64_t dest = functionInsts.front().getDestination();
-	functionInsts = m_disasm.disassemble(dest, dest, dest + 100);
-	return followJmp(functionInsts, curDepth + 1); // recurse
+	address = first->getDestination();
+	return followJmp(address, curDepth + 1); // recurse
 }
 
 bool PLH::Detour::expandProlSelfJmps(insts_t& prol,
@@ -52,7 +257,7 @@ bool PLH::Detour::expandProlSelfJmps(insts_t& prol,
 									 uint64_t& minProlSz,
 									 uint64_t& roundProlSz) {
 	const uint64_t prolStart = prol.front().getAddress();
-	branch_map_t branchMap = m_disasm.getBranchMap();
+	const branch_map_t& branchMap = m_disasm.getBranchMap();
 
 	for (size_t i = 0; i < prol.size(); i++) {
 		auto inst = prol.at(i);
@@ -61,7 +266,7 @@ bool PLH::Detour::expandProlSelfJmps(insts_t& prol,
 		if (branchMap.find(inst.getAddress()) == branchMap.end())
 			continue;
 
-		insts_t srcs = branchMap.at(inst.getAddress());
+		const insts_t& srcs = branchMap.at(inst.getAddress());
 		uint64_t maxAddr = 0;
 		for (const auto& src : srcs) {
 			const uint64_t srcEndAddr = src.getAddress() + src.size();
@@ -81,65 +286,407 @@ bool PLH::Detour::expandProlSelfJmps(insts_t& prol,
 	return true;
 }
 
+/**Can inst, once moved to newAddr, still encode a displacement to dest in its displacement field**/
+static bool isDispInRange(const PLH::Instruction& inst, const uint64_t newAddr, const uint64_t dest) {
+	const int64_t newDisp = (int64_t)(dest - (newAddr + inst.size()));
+	const size_t dispSz = inst.getDispSize();
+	if (dispSz >= sizeof(int64_t))
+		return true;
+
+	const int64_t maxDisp = (int64_t)(1ULL << (dispSz * 8 - 1)) - 1;
+	const int64_t minDisp = -maxDisp - 1;
+	return newDisp >= minDisp && newDisp <= maxDisp;
+}
+
+uint16_t PLH::Detour::calcMaxRelocatedSz(const insts_t& prologue) {
+	uint16_t sz = 0;
+	for (auto inst : prologue) {
+		if (!inst.widenShortBranch())
+			rewritex64RipRelative(inst);
+		sz += (uint16_t)inst.size();
+	}
+	return sz;
+}
+
+uint16_t PLH::Detour::calcMaxEntryCount(const insts_t& prologue, const uint64_t roundProlSz) {
+	assert(prologue.size() > 0);
+	const uint64_t prolStart = prologue.front().getAddress();
+
+	uint16_t count = 0;
+	for (const auto& inst : prologue) {
+		if (!inst.isBranching() || !inst.hasDisplacement() || !inst.isDisplacementRelative())
+			continue;
+
+		if (inst.getDestination() < prolStart || inst.getDestination() > prolStart + roundProlSz)
+			count++;
+	}
+	return count;
+}
+
 bool PLH::Detour::buildRelocationList(insts_t& prologue, const uint64_t roundProlSz, const int64_t delta, PLH::insts_t& instsNeedingEntry, PLH::insts_t& instsNeedingReloc) {
-	assert(instsNeedingEntry.size() == 0);
-	assert(instsNeedingReloc.size() == 0);
 	assert(prologue.size() > 0);
 
 	const uint64_t prolStart = prologue.front().getAddress();
+	const uint64_t prolEnd = prolStart + roundProlSz;
+
+	/* Widening a branch or rewriting a data operation pushes everything after it down, which changes what
+	every other instruction needs. Start over after each, instructions only ever grow so this settles after
+	at most one pass per instruction.*/
+	bool resized = true;
+	while (resized) {
+		resized = false;
+		instsNeedingEntry.clear();
+		instsNeedingReloc.clear();
+
+		// lay instructions out back to back from the start of the trampoline
+		m_relocAddrs.clear();
+		uint64_t relocAddr = prolStart + delta;
+		for (const auto& inst : prologue) {
+			m_relocAddrs[inst.getAddress()] = relocAddr;
+			relocAddr += inst.size();
+		}
+		m_relocAddrs[prolEnd] = relocAddr;
+
+		for (auto& inst : prologue) {
+			if (!inst.hasDisplacement() || !inst.isDisplacementRelative())
+				continue;
 
-	for (auto& inst : prologue) {
-		// types that change control flow
-		if (inst.isBranching() && inst.hasDisplacement() &&
-			(inst.getDestination() < prolStart ||
-			inst.getDestination() > prolStart + roundProlSz)) {
-
-			// can inst just be re-encoded or do we need a tbl entry
-			const uint8_t dispSzBits = (uint8_t)inst.getDispSize() * 8;
-			const uint64_t maxInstDisp = (uint64_t)(std::pow(2, dispSzBits) / 2.0 - 1.0); // 2^bitSz give max val, /2 and -1 because signed ex (int8_t [-128, 127] = [2^8 / 2, 2^8 / 2 - 1]
-			if ((uint64_t)std::llabs(delta) > maxInstDisp) {
-				instsNeedingEntry.push_back(inst);
-			} else {
+			const uint64_t newAddr = m_relocAddrs.at(inst.getAddress());
+			const uint64_t dest = inst.getDestination();
+
+			// destinations inside the prologue move with it, if the distance didn't change nothing to do
+			uint64_t newDest = dest;
+			if (dest >= prolStart && dest <= prolEnd) {
+				auto relocatedDest = m_relocAddrs.find(dest);
+				if (relocatedDest != m_relocAddrs.end())
+					newDest = relocatedDest->second;
+			}
+
+			if (newDest - newAddr == dest - inst.getAddress())
+				continue;
+
+			if (isDispInRange(inst, newAddr, newDest)) {
 				instsNeedingReloc.push_back(inst);
+				continue;
 			}
-		}
 
-		// data operations (duplicated because clearer)
-		if (!inst.isBranching() && inst.hasDisplacement()) {
-			const uint8_t dispSzBits = (uint8_t)inst.getDispSize() * 8;
-			const uint64_t maxInstDisp = (uint64_t)(std::pow(2, dispSzBits) / 2.0 - 1.0); 
-			if ((uint64_t)std::llabs(delta) > maxInstDisp) {
+			// data operations (separate because clearer)
+			if (!inst.isBranching()) {
 				/*EX: 48 8d 0d 96 79 07 00    lea rcx, [rip + 0x77996]
 				If instruction is moved beyond displacement field width
-				we can't fix the load. TODO: generate equivalent load
-				with asmjit and insert it at position
+				the load can't be re-encoded, rewrite it to go through an absolute address instead.
 				*/
+				if (rewritex64RipRelative(inst)) {
+					resized = true;
+					break;
+				}
+
 				ErrorLog::singleton().push("Cannot fixup IP relative data operation, relocation beyond displacement size", ErrorLevel::SEV);
 				return false;
-			}else {
-				instsNeedingReloc.push_back(inst);
 			}
+
+			// a short jmp/jcc can be re-encoded with a rel32 right in the trampoline, cheaper than a jmp table entry
+			Instruction wideInst = inst;
+			if (wideInst.widenShortBranch() && isDispInRange(wideInst, newAddr, newDest)) {
+				inst.widenShortBranch();
+				resized = true;
+				break;
+			}
+
+			if (newDest != dest) {
+				ErrorLog::singleton().push("Cannot relocate branch inside prologue, destination out of range", ErrorLevel::SEV);
+				return false;
+			}
+			instsNeedingEntry.push_back(inst);
+		}
+	}
+	return true;
+}
+
+bool PLH::Detour::areEntriesInRange(const insts_t& instsNeedingEntry, const uint64_t jmpTblStart, const uint8_t jmpSz) {
+	// entries are handed out in prologue order, as relocateTrampoline does
+	uint64_t entryAddr = jmpTblStart;
+	for (const auto& inst : instsNeedingEntry) {
+		if (!isDispInRange(inst, m_relocAddrs.at(inst.getAddress()), entryAddr)) {
+			ErrorLog::singleton().push("Cannot relocate branch, its jmp table entry is out of range", ErrorLevel::SEV);
+			return false;
+		}
+		entryAddr += jmpSz;
+	}
+	return true;
+}
+
+/**Bytes of nop at the start of a function, as -fpatchable-function-entry or msvc /hotpatch leave them**/
+static uint8_t calcEntrySledSz(const uint64_t fnAddress, const PLH::Mode mode) {
+	const uint8_t* fn = (uint8_t*)fnAddress;
+
+	// 2 byte nops at entry, mov edi, edi is only one on x86 (it zero extends rdi on x64)
+	if ((fn[0] == 0x66 && fn[1] == 0x90) || (mode == PLH::Mode::x86 && fn[0] == 0x8B && fn[1] == 0xFF))
+		return 2;
+
+	uint8_t sz = 0;
+	while (sz < 64 && fn[sz] == 0x90)
+		sz++;
+	return sz;
+}
+
+/**Bytes of nop or int3 padding directly before a function**/
+static uint8_t calcPreSledSz(const uint64_t fnAddress) {
+	const uint8_t* fn = (uint8_t*)fnAddress;
+
+	uint8_t sz = 0;
+	while (sz < 64 && (fn[-1 - sz] == 0x90 || fn[-1 - sz] == 0xCC))
+		sz++;
+	return sz;
+}
+
+bool PLH::Detour::hookPatchableEntry() {
+	assert(!m_hooked);
+	// the slot lives in a trampoline block, which this path doesn't have
+	if (m_slotMode)
+		return false;
+
+	const Mode mode = getArchType();
+	const uint8_t entrySledSz = calcEntrySledSz(m_fnAddress, mode);
+	if (entrySledSz < 2)
+		return false;
+
+	// prefer the short rel32 jmp, x64 only if the callback is in reach from where the jmp would be
+	auto calcJmpSz = [=] (const uint64_t jmpEnd) -> uint8_t {
+		return (mode == Mode::x86 || IsWithinRel32(jmpEnd, m_fnCallback)) ? 5 : 14;
+	};
+
+	/* With enough padding before the function the jmp goes there and the entry only gets a 2 byte short jmp to
+	it, enabled by a single aligned store. Otherwise the jmp goes in the entry sled itself.*/
+	uint8_t jmpSz = calcJmpSz(m_fnAddress);
+	uint64_t roundProlSz = 0;
+	releaseCave();
+	if (calcPreSledSz(m_fnAddress) >= jmpSz && claimCodeCave(m_fnAddress - jmpSz, jmpSz)) {
+		m_codeCave = m_fnAddress - jmpSz;
+		roundProlSz = 2;
+	} else if (entrySledSz >= calcJmpSz(m_fnAddress + 5)) {
+		jmpSz = calcJmpSz(m_fnAddress + 5);
+		roundProlSz = jmpSz;
+	} else {
+		return false;
+	}
+	m_jmpEncoding = jmpSz == 5 ? JmpEncoding::Rel32 : JmpEncoding::RipIndirect;
+
+	m_relocAddrs.clear();
+	m_callbackStub = NULL;
+	const uint64_t jmpAddr = m_codeCave ? m_codeCave : m_fnAddress;
+	insts_t prolJmp;
+	if (mode == Mode::x86)
+		prolJmp = makex86Jmp(jmpAddr, m_fnCallback);
+	else if (m_jmpEncoding == JmpEncoding::Rel32)
+		prolJmp = makex64NearJump(jmpAddr, m_fnCallback);
+	else
+		prolJmp = makex64RipIndirectJump(jmpAddr, m_fnCallback);
+
+	Instruction::Displacement zeroDisp = { 0 };
+	std::vector<uint8_t> entryBytes((uint8_t*)m_fnAddress, (uint8_t*)m_fnAddress + roundProlSz);
+	m_originalInsts = { Instruction(m_fnAddress, zeroDisp, 0, false, entryBytes, "sled", "", mode) };
+	m_cloned = false;
+
+	ErrorLog::singleton().push("Hooking patchable entry, jmp:\n" + instsToStr(prolJmp) + "\n", ErrorLevel::INFO);
+	writeProlJmp(prolJmp, roundProlSz);
+
+	// the sled is all nops, so the original function is just the rest of it
+	*m_userTrampVar = m_fnAddress + entrySledSz;
+	m_hooked = true;
+	return true;
+}
+
+void PLH::Detour::writeProlJmp(const insts_t& prolJmp, const uint64_t roundProlSz) {
+	insts_t jmp = prolJmp;
+	m_originalCave.clear();
+	if (m_codeCave != NULL) {
+		// the jmp goes in the cave, the prologue only gets a short jmp to it
+		const uint16_t caveSz = calcInstsSz(prolJmp);
+		assert(prolJmp.front().getAddress() == m_codeCave);
+
+		Instruction::Displacement zeroDisp = { 0 };
+		std::vector<uint8_t> caveBytes((uint8_t*)m_codeCave, (uint8_t*)m_codeCave + caveSz);
+		m_originalCave.push_back(Instruction(m_codeCave, zeroDisp, 0, false, caveBytes, "padding", "", getArchType()));
+
+		MemoryProtector caveProt(m_codeCave, caveSz, ProtFlag::R | ProtFlag::W | ProtFlag::X);
+		m_disasm.writeEncoding(prolJmp);
+		jmp = makeRel8Jmp(m_fnAddress, m_codeCave, getArchType());
+		ErrorLog::singleton().push("Jmp to code cave:\n" + instsToStr(jmp) + "\n", ErrorLevel::INFO);
+	}
+
+	// stage jmp + nops for the space between jmp and end of prologue, then publish it all at once
+	std::vector<uint8_t> patch = flattenInsts(jmp);
+	assert(roundProlSz >= patch.size());
+	patch.resize((size_t)roundProlSz, 0x90);
+
+	/* Threads stopped in the middle of what's overwritten continue at the same instruction in the trampoline.
+	One at the very start is left alone, it will take the jmp.*/
+	std::map<uint64_t, uint64_t> ipFixups;
+	if (m_quiesceThreads) {
+		for (const auto& reloc : m_relocAddrs) {
+			if (reloc.first > m_fnAddress && reloc.first < m_fnAddress + roundProlSz)
+				ipFixups.insert(reloc);
+		}
+	}
+
+	bool atomic = true;
+	{
+		MemoryProtector prot(m_fnAddress, roundProlSz, ProtFlag::R | ProtFlag::W | ProtFlag::X);
+		std::unique_ptr<ThreadQuiescer> quiescer;
+		if (m_quiesceThreads) {
+			quiescer.reset(new ThreadQuiescer());
+			quiescer->fixupInstructionPointers(ipFixups);
 		}
+		atomic = atomicPatch(m_fnAddress, patch);
 	}
+
+	// only once the other threads run again, one of them may hold the heap lock
+	if (!atomic)
+		ErrorLog::singleton().push("Patch can't be written atomically, unaligned start", ErrorLevel::WARN);
+}
+
+bool PLH::Detour::hook() {
+	// fast path, nothing to disassemble or relocate
+	if (!m_planned && m_patchableEntry && hookPatchableEntry())
+		return true;
+
+	if (!m_planned && !plan())
+		return false;
+	return commit();
+}
+
+bool PLH::Detour::commit() {
+	assert(m_planned && !m_hooked);
+
+	// anything could have patched the function since it was planned, the relocated copy would be wrong
+	const std::vector<uint8_t> original = flattenInsts(m_originalInsts);
+	if (memcmp((char*)m_fnAddress, original.data(), original.size()) != 0) {
+		ErrorLog::singleton().push("Prologue changed since the hook was planned", ErrorLevel::SEV);
+		discardPlan();
+		return false;
+	}
+
+	*m_userTrampVar = m_trampoline;
+	writeProlJmp(m_prolJmp, m_roundProlSz);
+
+	m_prolJmp.clear();
+	m_planned = false;
+	m_slotEnabled = m_slotMode;
+	m_hooked = true;
 	return true;
 }
 
+void PLH::Detour::discardPlan() {
+	assert(m_planned);
+	// never reachable by any thread, no need to go through the reclaimer
+	freeTrampoline();
+	m_callbackStub = NULL;
+	m_slot = NULL;
+	releaseCave();
+	m_cloned = false;
+	m_prolJmp.clear();
+	m_originalInsts.clear();
+	m_relocAddrs.clear();
+	m_planned = false;
+}
+
 bool PLH::Detour::unHook() {
 	assert(m_hooked);
 
-	MemoryProtector prot(m_fnAddress, PLH::calcInstsSz(m_originalInsts), ProtFlag::R | ProtFlag::W | ProtFlag::X);
-	m_disasm.writeEncoding(m_originalInsts);
-	
-	if (m_trampoline != NULL) {
-		delete[](char*)m_trampoline;
-		m_trampoline = NULL;
+	/* Threads stopped in the trampoline's copy of the prologue go back to the original, which is about to be
+	restored. The trampoline and cave are going away, so ones sitting on a jmp to the callback are sent there.*/
+	std::map<uint64_t, uint64_t> ipFixups;
+	if (m_quiesceThreads) {
+		for (const auto& reloc : m_relocAddrs)
+			ipFixups[reloc.second] = reloc.first;
+
+		if (m_codeCave != NULL)
+			ipFixups[m_codeCave] = m_fnCallback;
+		if (m_callbackStub != NULL)
+			ipFixups[m_callbackStub] = isEnabled() ? m_fnCallback : m_fnAddress;
+	}
+	const std::vector<uint8_t> original = flattenInsts(m_originalInsts);
+
+	bool atomic = true;
+	{
+		MemoryProtector prot(m_fnAddress, original.size(), ProtFlag::R | ProtFlag::W | ProtFlag::X);
+		std::unique_ptr<ThreadQuiescer> quiescer;
+		if (m_quiesceThreads) {
+			quiescer.reset(new ThreadQuiescer());
+			quiescer->fixupInstructionPointers(ipFixups);
+		}
+		atomic = atomicPatch(m_fnAddress, original);
 	}
 
-	if (m_userTrampVar != NULL) {
+	if (!atomic)
+		ErrorLog::singleton().push("Patch can't be written atomically, unaligned start", ErrorLevel::WARN);
+
+	if (m_originalCave.size() > 0) {
+		MemoryProtector caveProt(m_codeCave, PLH::calcInstsSz(m_originalCave), ProtFlag::R | ProtFlag::W | ProtFlag::X);
+		m_disasm.writeEncoding(m_originalCave);
+		m_originalCave.clear();
+	}
+	releaseCave();
+	
+	m_callbackStub = NULL;
+	m_slot = NULL;
+	m_slotEnabled = false;
+
+	if (m_holderStub != NULL) {
+		/* The variable lives in the stub and threads still in it jmp through it, it stays set until the stub is
+		freed. Only then can no thread be headed for the trampoline without referencing it.*/
+		const uint64_t stub = m_holderStub;
+		const uint64_t trampoline = m_trampoline;
+		const uint64_t trampolineSz = m_trampolineSz;
+		Reclaimer::singleton().retire(m_holderStub, m_holderStubSz, [stub, trampoline, trampolineSz] () {
+			Reclaimer::singleton().freeBlock(stub);
+			if (trampoline != NULL)
+				Reclaimer::singleton().retireBlock(trampoline, trampolineSz);
+		});
+		m_holderStub = NULL;
+		m_userTrampVar = NULL;
+		m_trampoline = NULL;
+	} else if (m_userTrampVar != NULL) {
 		*m_userTrampVar = NULL;
 		m_userTrampVar = NULL;
 	}
+
+	// nothing jumps to the trampoline any more, but threads already in or headed for it may still run it
+	if (m_trampoline != NULL) {
+		Reclaimer::singleton().retireBlock(m_trampoline, m_trampolineSz);
+		m_trampoline = NULL;
+	}
 	
 	m_hooked = false;
 	return true;
 }
+
+bool PLH::Detour::setEnabled(const bool enabled) {
+	if (!writeSlot(enabled ? m_fnCallback : m_trampoline))
+		return false;
+
+	m_slotEnabled = enabled;
+	return true;
+}
+
+bool PLH::Detour::setCallback(const uint64_t callback) {
+	assert(callback != 0);
+	// a disabled slot keeps pointing at the trampoline, the new callback is picked up by setEnabled
+	if (m_hooked && !writeSlot(m_slotEnabled ? callback : m_trampoline))
+		return false;
+
+	m_fnCallback = callback;
+	return true;
+}
+
+bool PLH::Detour::writeSlot(const uint64_t destination) {
+	if (!m_hooked || m_slot == NULL) {
+		ErrorLog::singleton().push("Detour is not hooked in slot mode", ErrorLevel::SEV);
+		return false;
+	}
+
+	// the trampoline block is always writable, and the slot is aligned so this is one locked store
+	const size_t ptrSz = getArchType() == Mode::x64 ? 8 : 4;
+	return atomicStore(m_slot, (const uint8_t*)&destination, ptrSz);
+}
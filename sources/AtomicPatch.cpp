@@ -0,0 +1,72 @@
+#include "headers/AtomicPatch.hpp"
+#include "headers/MemProtector.hpp"
+
+namespace {
+// the last flush of a patch, a protection batch does it once for every patch when it ends
+void flushPatched(const uint64_t address, const size_t size) {
+	if (PLH::ProtectionBatch* batch = PLH::ProtectionBatch::active())
+		batch->deferFlush(address, size);
+	else
+		FlushInstructionCache(GetCurrentProcess(), (char*)address, size);
+}
+}
+
+bool PLH::atomicStore(const uint64_t address, const uint8_t* bytes, const size_t size) {
+	const uint64_t qword = address & ~7ULL;
+	if (address + size <= qword + 8) {
+		volatile LONG64* target = (volatile LONG64*)qword;
+		LONG64 expected = *target;
+		while (true) {
+			LONG64 desired = expected;
+			memcpy((uint8_t*)&desired + (address - qword), bytes, size);
+
+			const LONG64 prev = InterlockedCompareExchange64(target, desired, expected);
+			if (prev == expected)
+				return true;
+			expected = prev;
+		}
+	}
+
+#ifdef _WIN64
+	const uint64_t dqword = address & ~15ULL;
+	if (address + size <= dqword + 16) {
+		volatile LONG64* target = (volatile LONG64*)dqword;
+		alignas(16) LONG64 expected[2] = { target[0], target[1] };
+		while (true) {
+			LONG64 desired[2] = { expected[0], expected[1] };
+			memcpy((uint8_t*)desired + (address - dqword), bytes, size);
+
+			// on failure expected is refreshed with the current contents
+			if (_InterlockedCompareExchange128(target, desired[1], desired[0], expected))
+				return true;
+		}
+	}
+#endif
+	return false;
+}
+
+bool PLH::atomicPatch(const uint64_t address, const std::vector<uint8_t>& bytes) {
+	if (bytes.empty())
+		return true;
+
+	if (atomicStore(address, bytes.data(), bytes.size())) {
+		flushPatched(address, bytes.size());
+		return true;
+	}
+
+	// park threads entering the patch on jmp $ while the rest of it is written
+	const uint8_t selfLoop[] = { 0xEB, 0xFE };
+	if (bytes.size() < sizeof(selfLoop) || !atomicStore(address, selfLoop, sizeof(selfLoop))) {
+		memcpy((char*)address, bytes.data(), bytes.size());
+		FlushInstructionCache(GetCurrentProcess(), (char*)address, bytes.size());
+		return false;
+	}
+	FlushInstructionCache(GetCurrentProcess(), (char*)address, sizeof(selfLoop));
+
+	memcpy((char*)address + sizeof(selfLoop), bytes.data() + sizeof(selfLoop), bytes.size() - sizeof(selfLoop));
+	FlushInstructionCache(GetCurrentProcess(), (char*)address, bytes.size());
+
+	atomicStore(address, bytes.data(), sizeof(selfLoop));
+	flushPatched(address, bytes.size());
+	return true;
+}
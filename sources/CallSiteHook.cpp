@@ -0,0 +1,190 @@
+#include "headers/Detour/CallSiteHook.hpp"
+#include <TlHelp32.h>
+
+namespace {
+// jmp [rip + 0] and its holder, see makex64RipIndirectJump
+const uint64_t CallSiteStubSz = 14;
+}
+
+PLH::CallSiteHook::CallSiteHook(const uint64_t fnAddress, const uint64_t fnCallback, PLH::ADisassembler& dis) : m_disasm(dis) {
+	assert(fnAddress != 0 && fnCallback != 0);
+	m_fnAddress = fnAddress;
+	m_fnCallback = fnCallback;
+	m_hooked = false;
+}
+
+PLH::CallSiteHook::CallSiteHook(const char* fnAddress, const char* fnCallback, PLH::ADisassembler& dis) : CallSiteHook((uint64_t)fnAddress, (uint64_t)fnCallback, dis) {
+
+}
+
+PLH::CallSiteHook::~CallSiteHook() {
+	if (m_hooked)
+		unHook();
+}
+
+void PLH::CallSiteHook::addModule(const uint64_t moduleBase) {
+	assert(!m_hooked);
+	m_modules.push_back(moduleBase);
+}
+
+bool PLH::CallSiteHook::addModule(const std::wstring& moduleName) {
+	HMODULE module = GetModuleHandleW(moduleName.c_str());
+	if (module == NULL) {
+		ErrorLog::singleton().push("Module to restrict call site hook to is not loaded", ErrorLevel::SEV);
+		return false;
+	}
+
+	addModule((uint64_t)module);
+	return true;
+}
+
+bool PLH::CallSiteHook::hook() {
+	assert(!m_hooked);
+	std::vector<uint64_t> modules = m_modules;
+	if (modules.empty()) {
+		HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, 0);
+		if (snapshot == INVALID_HANDLE_VALUE) {
+			ErrorLog::singleton().push("Failed to enumerate modules", ErrorLevel::SEV);
+			return false;
+		}
+
+		MODULEENTRY32W entry;
+		entry.dwSize = sizeof(entry);
+		for (BOOL more = Module32FirstW(snapshot, &entry); more; more = Module32NextW(snapshot, &entry))
+			modules.push_back((uint64_t)entry.modBaseAddr);
+		CloseHandle(snapshot);
+	}
+
+	std::vector<uint64_t> sites;
+	for (const uint64_t module : modules) {
+		std::vector<std::pair<uint64_t, uint64_t>> sections;
+		if (!getExecutableSections(module, sections))
+			continue;
+
+		for (const auto& section : sections)
+			scanSection(section.first, section.second, sites);
+	}
+
+	if (sites.empty()) {
+		ErrorLog::singleton().push("No call sites found for function", ErrorLevel::WARN);
+		return false;
+	}
+
+	// work out every new call before touching any of them
+	std::vector<std::vector<uint8_t>> patches;
+	for (const uint64_t site : sites) {
+		const uint64_t dest = getCallDestination(site);
+		if (dest == 0) {
+			// nothing was patched yet, no thread can be in them
+			for (const uint64_t stub : m_stubs)
+				Reclaimer::singleton().freeBlock(stub);
+			m_stubs.clear();
+			return false;
+		}
+
+		const int32_t disp = Instruction::calculateRelativeDisplacement<int32_t>(site, dest, 5);
+		std::vector<uint8_t> call(5);
+		call[0] = 0xE8;
+		memcpy(&call[1], &disp, 4);
+		patches.push_back(call);
+	}
+
+	m_callSites = sites;
+	m_originalCalls.clear();
+	size_t nonAtomic = 0;
+	for (size_t i = 0; i < sites.size(); i++) {
+		const uint64_t site = sites[i];
+		m_originalCalls.emplace_back((uint8_t*)site, (uint8_t*)site + 5);
+
+		MemoryProtector prot(site, 5, ProtFlag::R | ProtFlag::W | ProtFlag::X);
+		if (!atomicPatch(site, patches[i]))
+			nonAtomic++;
+	}
+
+	if (nonAtomic > 0)
+		ErrorLog::singleton().push(std::to_string(nonAtomic) + " call sites couldn't be written atomically, unaligned start", ErrorLevel::WARN);
+
+	ErrorLog::singleton().push("Patched " + std::to_string(sites.size()) + " call sites", ErrorLevel::INFO);
+	m_hooked = true;
+	return true;
+}
+
+bool PLH::CallSiteHook::unHook() {
+	assert(m_hooked);
+	size_t nonAtomic = 0;
+	for (size_t i = 0; i < m_callSites.size(); i++) {
+		MemoryProtector prot(m_callSites[i], 5, ProtFlag::R | ProtFlag::W | ProtFlag::X);
+		if (!atomicPatch(m_callSites[i], m_originalCalls[i]))
+			nonAtomic++;
+	}
+
+	if (nonAtomic > 0)
+		ErrorLog::singleton().push(std::to_string(nonAtomic) + " call sites couldn't be restored atomically, unaligned start", ErrorLevel::WARN);
+
+	// threads may have called through a stub and not reached the callback yet
+	for (const uint64_t stub : m_stubs)
+		Reclaimer::singleton().retireBlock(stub, CallSiteStubSz);
+
+	m_originalCalls.clear();
+	m_callSites.clear();
+	m_stubs.clear();
+	m_hooked = false;
+	return true;
+}
+
+void PLH::CallSiteHook::scanSection(const uint64_t sectionStart, const uint64_t sectionEnd, std::vector<uint64_t>& sites) {
+	// cheap byte scan for candidates first, only those are disassembled
+	for (uint64_t site = sectionStart; site + 5 <= sectionEnd; site++) {
+		if (*(uint8_t*)site != 0xE8)
+			continue;
+
+		int32_t disp;
+		memcpy(&disp, (uint8_t*)site + 1, 4);
+		if (site + 5 + (int64_t)disp != m_fnAddress)
+			continue;
+
+		if (isCallInstruction(site, sectionStart))
+			sites.push_back(site);
+	}
+}
+
+bool PLH::CallSiteHook::isCallInstruction(const uint64_t site, const uint64_t sectionStart) {
+	// a false positive would rewrite 4 bytes in the middle of some other instruction
+	insts_t insts;
+	uint64_t confirmed = 0;
+	if (!disassembleFromBoundary(m_disasm, site, site + 5, sectionStart, insts, confirmed)) {
+		ErrorLog::singleton().push("Couldn't confirm the instruction boundaries around a call site, skipping it", ErrorLevel::INFO);
+		return false;
+	}
+
+	for (const auto& inst : insts) {
+		if (inst.getAddress() < site)
+			continue;
+
+		return inst.getAddress() == site && inst.size() == 5 && inst.isBranching() && inst.getDestination() == m_fnAddress;
+	}
+	return false;
+}
+
+uint64_t PLH::CallSiteHook::getCallDestination(const uint64_t site) {
+	if (IsWithinRel32(site + 5, m_fnCallback))
+		return m_fnCallback;
+
+	for (const uint64_t stub : m_stubs) {
+		if (IsWithinRel32(site + 5, stub))
+			return stub;
+	}
+
+	// only x64 gets here, allocate a jmp to the callback near the site
+	const uint64_t maxDist = 0x7FF00000 - CallSiteStubSz;
+	const uint64_t regionStart = site > maxDist ? site - maxDist : 0;
+	const uint64_t stub = Reclaimer::singleton().getBlock(CallSiteStubSz, regionStart, 2 * maxDist);
+	if (stub == 0) {
+		ErrorLog::singleton().push("Failed to allocate call site stub within +-2GB", ErrorLevel::SEV);
+		return 0;
+	}
+
+	m_disasm.writeEncoding(makex64RipIndirectJump(stub, m_fnCallback));
+	m_stubs.push_back(stub);
+	return stub;
+}
@@ -3,60 +3,147 @@
 //
 #include "headers/CapstoneDisassembler.hpp"
 
+namespace {
+struct ThreadCapHandles {
+	// indexed by PLH::Mode
+	csh handles[2] = { 0, 0 };
+	// one decode buffer per handle, reused by every call instead of allocating one each time
+	cs_insn* insns[2] = { nullptr, nullptr };
+
+	~ThreadCapHandles() {
+		for (cs_insn*& insn : insns) {
+			if (insn)
+				cs_free(insn, 1);
+		}
+
+		for (csh& handle : handles) {
+			if (handle)
+				cs_close(&handle);
+		}
+	}
+};
+
+thread_local ThreadCapHandles t_capHandles;
+}
+
+csh PLH::CapstoneDisassembler::getCapHandle() const {
+	csh& handle = t_capHandles.handles[(int)m_mode];
+	if (handle != 0)
+		return handle;
+
+	cs_mode capmode = (m_mode == PLH::Mode::x64 ? CS_MODE_64 : CS_MODE_32);
+	if (cs_open(CS_ARCH_X86, capmode, &handle) != CS_ERR_OK) {
+		handle = 0;
+		return 0;
+	}
+
+	cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+	return handle;
+}
+
+cs_insn* PLH::CapstoneDisassembler::getInsnBuffer() const {
+	cs_insn*& insn = t_capHandles.insns[(int)m_mode];
+	if (insn == nullptr)
+		insn = cs_malloc(getCapHandle());
+	return insn;
+}
+
+PLH::Instruction PLH::CapstoneDisassembler::makeInstruction(const cs_insn* capInst) const {
+	// Set later by 'SetDisplacementFields'
+	Instruction::Displacement displacement;
+	displacement.Absolute = 0;
+
+	Instruction Inst(capInst->address,
+					 displacement,
+					 0,
+					 false,
+					 capInst->bytes,
+					 capInst->size,
+					 capInst->mnemonic,
+					 capInst->op_str,
+					 m_mode);
+
+	setDisplacementFields(Inst, capInst);
+	return Inst;
+}
+
 PLH::insts_t
 PLH::CapstoneDisassembler::disassemble(uint64_t firstInstruction, uint64_t start, uint64_t End) {
-	cs_insn* InsInfo = cs_malloc(m_capHandle);
+	const csh capHandle = getCapHandle();
+	cs_insn* InsInfo = getInsnBuffer();
 	insts_t InsVec;
-	m_branchMap.clear();
 
 	uint64_t Size = End - start;
-	while (cs_disasm_iter(m_capHandle, (const uint8_t**)&firstInstruction, (size_t*)&Size, &start, InsInfo)) {
-		// Set later by 'SetDisplacementFields'
-		Instruction::Displacement displacement;
-		displacement.Absolute = 0;
-
-		Instruction Inst(InsInfo->address,
-						 displacement,
-						 0,
-						 false,
-						 InsInfo->bytes,
-						 InsInfo->size,
-						 InsInfo->mnemonic,
-						 InsInfo->op_str,
-						 m_mode);
-
-		setDisplacementFields(Inst, InsInfo);
-		InsVec.push_back(Inst);
-
-		// update jump map if the instruction is jump/call
-		if (Inst.isBranching() && Inst.hasDisplacement()) {
-			// search back, check if new instruction points to older ones (one to one)
-			auto destInst = std::find_if(InsVec.begin(), InsVec.end(), [=] (const Instruction& oldIns) {
-				return oldIns.getAddress() == Inst.getDestination();
-			});
-
-			if (destInst != InsVec.end()) {
-				updateBranchMap(destInst->getAddress(), Inst);
-			}
-		}
+	while (cs_disasm_iter(capHandle, (const uint8_t**)&firstInstruction, (size_t*)&Size, &start, InsInfo))
+		InsVec.push_back(makeInstruction(InsInfo));
 
-		// search forward, check if old instructions now point to new one (many to one possible)
-		for (const Instruction& oldInst : InsVec) {
-			if (oldInst.isBranching() && oldInst.hasDisplacement() && oldInst.getDestination() == Inst.getAddress()) {
-				updateBranchMap(Inst.getAddress(), oldInst);
-			}
-		}
+	buildBranchMap(InsVec);
+	return InsVec;
+}
+
+PLH::packed_insts_t
+PLH::CapstoneDisassembler::disassemblePacked(uint64_t firstInstruction, uint64_t start, uint64_t End) {
+	const csh capHandle = getCapHandle();
+	cs_insn* InsInfo = getInsnBuffer();
+	packed_insts_t InsVec;
+
+	uint64_t Size = End - start;
+	InsVec.reserve((size_t)(Size / 4));
+	while (cs_disasm_iter(capHandle, (const uint8_t**)&firstInstruction, (size_t*)&Size, &start, InsInfo)) {
+		InsVec.emplace_back(InsInfo->address, InsInfo->bytes, (uint8_t)InsInfo->size, classify(InsInfo));
+		setDisplacementFields(InsVec.back(), InsInfo);
 	}
-	cs_free(InsInfo, 1);
 	return InsVec;
 }
 
+std::optional<PLH::Instruction>
+PLH::CapstoneDisassembler::disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+	const csh capHandle = getCapHandle();
+	cs_insn* InsInfo = getInsnBuffer();
+
+	const uint8_t* code = (const uint8_t*)firstInstruction;
+	size_t Size = (size_t)std::min<uint64_t>(end - start, PackedInstruction::MaxSize);
+	if (!cs_disasm_iter(capHandle, &code, &Size, &start, InsInfo))
+		return std::nullopt;
+	return makeInstruction(InsInfo);
+}
+
+bool PLH::CapstoneDisassembler::decodeText(const PackedInstruction& inst, std::string& mnemonic, std::string& opStr) {
+	const csh capHandle = getCapHandle();
+	cs_insn* InsInfo = getInsnBuffer();
+
+	const uint8_t* code = inst.getBytes();
+	size_t Size = inst.size();
+	uint64_t address = inst.getAddress();
+	if (!cs_disasm_iter(capHandle, &code, &Size, &address, InsInfo))
+		return false;
+
+	mnemonic = InsInfo->mnemonic;
+	opStr = InsInfo->op_str;
+	return true;
+}
+
+PLH::InstClass PLH::CapstoneDisassembler::classify(const cs_insn* inst) const {
+	if (hasGroup(inst, x86_insn_group::X86_GRP_RET))
+		return InstClass::Ret;
+	if (hasGroup(inst, x86_insn_group::X86_GRP_CALL))
+		return InstClass::Call;
+	if (hasGroup(inst, x86_insn_group::X86_GRP_JUMP))
+		return inst->id == X86_INS_JMP || inst->id == X86_INS_LJMP ? InstClass::Jmp : InstClass::Jcc;
+	if (inst->id == X86_INS_INT3)
+		return InstClass::Int3;
+	if (inst->id == X86_INS_NOP)
+		return InstClass::Nop;
+	return InstClass::Other;
+}
+
 /**If an instruction is a jmp/call variant type this will set it's displacement fields to the
  * appropriate values. All other types of instructions are ignored as no-op. More specifically
  * this determines if an instruction is a jmp/call variant, and then further if it is is jumping via
  * memory or immediate, and then finally if that mem/imm is encoded via a displacement relative to
  * the instruction pointer, or directly to an absolute address**/
-void PLH::CapstoneDisassembler::setDisplacementFields(PLH::Instruction& inst, const cs_insn* capInst) const {
+template<typename Inst>
+void PLH::CapstoneDisassembler::setDisplacementFields(Inst& inst, const cs_insn* capInst) const {
 	cs_x86 x86 = capInst->detail->x86;
 	bool branches = hasGroup(capInst, x86_insn_group::X86_GRP_JUMP) || hasGroup(capInst, x86_insn_group::X86_GRP_CALL);
 	inst.setBranching(branches);
@@ -67,7 +154,7 @@ void PLH::CapstoneDisassembler::setDisplacementFields(PLH::Instruction& inst, co
 			// Are we relative to instruction pointer?
 			// mem are types like jmp [rip + 0x4] where location is dereference-d
 			if (op.mem.base != getIpReg()) {
-				if (hasGroup(capInst, x86_insn_group::X86_GRP_JUMP) && inst.getBytes().at(0) == 0xff && inst.getBytes().at(1) == 0x25) {
+				if (hasGroup(capInst, x86_insn_group::X86_GRP_JUMP) && inst.size() > 1 && inst.getBytes()[0] == 0xff && inst.getBytes()[1] == 0x25) {
 					// far jmp 0xff, 0x25, holder jmp [0xdeadbeef]
 					inst.setAbsoluteDisplacement(*(uint32_t*)op.mem.disp);
 				}
@@ -97,7 +184,8 @@ void PLH::CapstoneDisassembler::setDisplacementFields(PLH::Instruction& inst, co
 }
 
 /**Copies the displacement bytes from memory, and sign extends these values if necessary**/
-void PLH::CapstoneDisassembler::copyDispSX(PLH::Instruction& inst,
+template<typename Inst>
+void PLH::CapstoneDisassembler::copyDispSX(Inst& inst,
 										   const uint8_t offset,
 										   const uint8_t size,
 										   const int64_t immDestination) const {
@@ -109,12 +197,12 @@ void PLH::CapstoneDisassembler::copyDispSX(PLH::Instruction& inst,
 	 * the result will be positive if sign bit is set (negative displacement)
 	 * and 0 when sign bit not set (positive displacement)*/
 	int64_t displacement = 0;
-	if (offset + size > (uint8_t)inst.getBytes().size()) {
+	if (offset + size > (uint8_t)inst.size()) {
 		__debugbreak();
 		return;
 	}
 
-	assert(offset + size <= (uint8_t)inst.getBytes().size());
+	assert(offset + size <= (uint8_t)inst.size());
 	memcpy(&displacement, &inst.getBytes()[offset], size);
 
 	uint64_t mask = (1ULL << (size * 8 - 1));
@@ -127,6 +215,7 @@ void PLH::CapstoneDisassembler::copyDispSX(PLH::Instruction& inst,
 	}
 
 	inst.setDisplacementOffset(offset);
+	inst.setDisplacementSize(size);
 
 	/* When the retrieved displacement is < immDestination we know that the base address is included
 	 * in the destinations calculation. By definition this means it is relative. Otherwise it is absolute*/
@@ -0,0 +1,187 @@
+#include "headers/CodeCave.hpp"
+
+namespace {
+// caves handed out and not yet released, key = start, value = end
+std::map<uint64_t, uint64_t> g_claimedCaves;
+std::mutex g_claimedCavesMtx;
+
+/**Does [cave, caveEnd) overlap a claimed cave, g_claimedCavesMtx must be held**/
+bool isClaimed(const uint64_t cave, const uint64_t caveEnd) {
+	auto next = g_claimedCaves.lower_bound(cave);
+	if (next != g_claimedCaves.end() && next->first < caveEnd)
+		return true;
+	return next != g_claimedCaves.begin() && std::prev(next)->second > cave;
+}
+}
+
+bool PLH::getExecutableSection(const uint64_t address, uint64_t& sectionStart, uint64_t& sectionEnd) {
+	MEMORY_BASIC_INFORMATION mbi;
+	if (!VirtualQuery((char*)address, &mbi, sizeof(mbi)) || mbi.Type != MEM_IMAGE)
+		return false;
+
+	std::vector<std::pair<uint64_t, uint64_t>> sections;
+	if (!getExecutableSections((uint64_t)mbi.AllocationBase, sections))
+		return false;
+
+	for (const auto& section : sections) {
+		if (address >= section.first && address < section.second) {
+			sectionStart = section.first;
+			sectionEnd = section.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool PLH::getExecutableSections(const uint64_t moduleBase, std::vector<std::pair<uint64_t, uint64_t>>& sections) {
+	const IMAGE_DOS_HEADER* dos = (IMAGE_DOS_HEADER*)moduleBase;
+	if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+		return false;
+
+	IMAGE_NT_HEADERS* nt = (IMAGE_NT_HEADERS*)(moduleBase + dos->e_lfanew);
+	if (nt->Signature != IMAGE_NT_SIGNATURE)
+		return false;
+
+	IMAGE_SECTION_HEADER* section = IMAGE_FIRST_SECTION(nt);
+	for (WORD i = 0; i < nt->FileHeader.NumberOfSections; i++, section++) {
+		if (!(section->Characteristics & IMAGE_SCN_MEM_EXECUTE))
+			continue;
+
+		const uint64_t start = moduleBase + section->VirtualAddress;
+		sections.emplace_back(start, start + section->Misc.VirtualSize);
+	}
+	return true;
+}
+
+bool PLH::disassembleFromBoundary(ADisassembler& dis, const uint64_t address, const uint64_t end, const uint64_t sectionStart,
+								  insts_t& insts, uint64_t& confirmed) {
+#ifdef _WIN64
+	DWORD64 imageBase = 0;
+	if (PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(address, &imageBase, nullptr)) {
+		confirmed = imageBase + function->BeginAddress;
+		insts = dis.disassemble(confirmed, confirmed, end);
+		return true;
+	}
+#endif
+
+	/* Decoding from the middle of an instruction usually falls onto the real boundaries within a few instructions,
+	and once two decodes share a boundary they stay together. Usually isn't enough to overwrite code, so the later
+	starts must each meet the earliest one by address. The start of a section is a real boundary, nothing to check
+	if the earliest start is clamped to it.*/
+	const uint64_t earliest = address > sectionStart + 64 ? address - 64 : sectionStart;
+	std::vector<std::vector<uint64_t>> laterBoundaries;
+	if (earliest != sectionStart) {
+		for (const uint64_t back : { 48, 32, 16 }) {
+			const uint64_t start = address - back;
+			std::vector<uint64_t> boundaries;
+			for (const auto& inst : dis.disassemble(start, start, end))
+				boundaries.push_back(inst.getAddress());
+			laterBoundaries.push_back(std::move(boundaries));
+		}
+	}
+
+	// decoded last so the branch map is this one's
+	insts = dis.disassemble(earliest, earliest, end);
+	std::vector<uint64_t> earliestBoundaries;
+	for (const auto& inst : insts)
+		earliestBoundaries.push_back(inst.getAddress());
+
+	confirmed = earliest;
+	for (const auto& boundaries : laterBoundaries) {
+		auto shared = std::find_if(boundaries.begin(), boundaries.end(), [&earliestBoundaries] (const uint64_t boundary) {
+			return std::binary_search(earliestBoundaries.begin(), earliestBoundaries.end(), boundary);
+		});
+		if (shared == boundaries.end() || *shared > address)
+			return false;
+		confirmed = std::max(confirmed, *shared);
+	}
+	return true;
+}
+
+uint64_t PLH::findCodeCave(const uint64_t prolStart, const uint64_t prolEnd, const uint8_t size) {
+	assert(size > 0);
+	uint64_t sectionStart = 0;
+	uint64_t sectionEnd = 0;
+	if (!getExecutableSection(prolStart, sectionStart, sectionEnd))
+		return 0;
+
+	// EB rel8 at prolStart reaches [prolStart + 2 - 128, prolStart + 2 + 127]
+	const uint64_t jmpEnd = prolStart + 2;
+	const uint64_t reachLow = jmpEnd > sectionStart + 128 ? jmpEnd - 128 : sectionStart;
+	const uint64_t reachHigh = std::min<uint64_t>(jmpEnd + 127 + size, sectionEnd);
+
+	/* Sections are page aligned and sized in memory, so whole 16 byte chunks around the window are safe to
+	read. Classify 16 bytes at a time, a bit per byte is set if it is int3. Nops aren't taken: a run of them may
+	be alignment padding inside a function that execution falls through.*/
+	const uint64_t scanStart = (uint64_t)AlignDownwards((char*)reachLow, 16);
+	const uint64_t scanEnd = (uint64_t)AlignUpwards((char*)reachHigh, 16);
+
+	const __m128i int3s = _mm_set1_epi8((char)0xCC);
+	std::vector<uint16_t> paddingMasks;
+	paddingMasks.reserve((size_t)((scanEnd - scanStart) / 16));
+	for (uint64_t chunk = scanStart; chunk < scanEnd; chunk += 16) {
+		const __m128i bytes = _mm_load_si128((const __m128i*)chunk);
+		paddingMasks.push_back((uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, int3s)));
+	}
+
+	auto isPadding = [&] (const uint64_t address) -> bool {
+		const uint64_t idx = address - scanStart;
+		return (paddingMasks[(size_t)(idx / 16)] >> (idx % 16)) & 1;
+	};
+
+	// searched and claimed under one lock, two hooks can't both pick the same run
+	std::lock_guard<std::mutex> lock(g_claimedCavesMtx);
+
+	// every 16 byte boundary is a possible function start, the cave is the size bytes right before it
+	uint64_t bestCave = 0;
+	int64_t bestDist = std::numeric_limits<int64_t>::max();
+	for (uint64_t caveEnd = scanStart + 16; caveEnd <= scanEnd; caveEnd += 16) {
+		const uint64_t cave = caveEnd - size;
+		if (cave < reachLow || caveEnd > reachHigh)
+			continue;
+
+		const int64_t disp = (int64_t)(cave - jmpEnd);
+		if (disp < -128 || disp > 127)
+			continue;
+
+		if (cave < prolEnd && caveEnd > prolStart)
+			continue;
+
+		if (isClaimed(cave, caveEnd))
+			continue;
+
+		bool allPadding = true;
+		for (uint64_t addr = cave; addr < caveEnd && allPadding; addr++)
+			allPadding = isPadding(addr);
+
+#ifdef _WIN64
+		// int3s inside a function are an immediate or displacement, padding isn't covered by any unwind entry
+		DWORD64 imageBase = 0;
+		if (allPadding && RtlLookupFunctionEntry(cave, &imageBase, nullptr) != nullptr)
+			continue;
+#endif
+
+		if (allPadding && std::llabs(disp) < bestDist) {
+			bestDist = std::llabs(disp);
+			bestCave = cave;
+		}
+	}
+
+	if (bestCave != 0)
+		g_claimedCaves[bestCave] = bestCave + size;
+	return bestCave;
+}
+
+bool PLH::claimCodeCave(const uint64_t cave, const uint8_t size) {
+	std::lock_guard<std::mutex> lock(g_claimedCavesMtx);
+	if (isClaimed(cave, cave + size))
+		return false;
+
+	g_claimedCaves[cave] = cave + size;
+	return true;
+}
+
+void PLH::releaseCodeCave(const uint64_t cave) {
+	std::lock_guard<std::mutex> lock(g_claimedCavesMtx);
+	g_claimedCaves.erase(cave);
+}
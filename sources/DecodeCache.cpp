@@ -0,0 +1,135 @@
+#include "headers/DecodeCache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+uint64_t fnv1a(const uint8_t* data, const size_t size) {
+	uint64_t hash = 0xCBF29CE484222325;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+/**Same instruction with a UID of its own, copies would share the cached one's**/
+PLH::Instruction renew(const PLH::Instruction& inst, const PLH::Mode mode) {
+	PLH::Instruction copy(inst.getAddress(), inst.getDisplacement(), inst.getDisplacementOffset(),
+						  inst.isDisplacementRelative(), inst.getBytes(), inst.getMnemonic(), inst.getOpStr(), mode);
+	if (inst.hasDisplacement()) {
+		copy.setDisplacementSize((uint8_t)inst.getDispSize());
+		if (inst.isDisplacementRelative())
+			copy.setRelativeDisplacement(inst.getDisplacement().Relative);
+		else
+			copy.setAbsoluteDisplacement(inst.getDisplacement().Absolute);
+	}
+	copy.setBranching(inst.isBranching());
+	return copy;
+}
+}
+
+PLH::DecodeCache::DecodeCache() {
+	m_entryCount = 0;
+	m_maxSize = 0;
+	m_hits = 0;
+	m_misses = 0;
+}
+
+PLH::DecodeCache& PLH::DecodeCache::singleton() {
+	static DecodeCache cache;
+	return cache;
+}
+
+bool PLH::DecodeCache::find(const std::type_index backend, const Mode mode, const uint64_t code, const uint64_t start,
+							const uint64_t size, insts_t& insts) {
+	const uint8_t* bytes = (const uint8_t*)code;
+	const uint64_t hash = fnv1a(bytes, (size_t)size);
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto it = m_entries.find(start);
+	if (it != m_entries.end()) {
+		for (const Entry& entry : it->second) {
+			if (entry.backend != backend || entry.mode != mode || entry.hash != hash || entry.bytes.size() != size ||
+				memcmp(entry.bytes.data(), bytes, (size_t)size) != 0)
+				continue;
+
+			insts.clear();
+			insts.reserve(entry.insts.size());
+			for (const Instruction& inst : entry.insts)
+				insts.push_back(renew(inst, mode));
+			m_hits++;
+			return true;
+		}
+	}
+
+	m_misses++;
+	return false;
+}
+
+void PLH::DecodeCache::add(const std::type_index backend, const Mode mode, const uint64_t code, const uint64_t start,
+						   const uint64_t size, const insts_t& insts) {
+	if (insts.empty() || size == 0)
+		return;
+
+	const uint8_t* bytes = (const uint8_t*)code;
+	Entry entry = { backend, mode, fnv1a(bytes, (size_t)size), std::vector<uint8_t>(bytes, bytes + size), insts };
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (m_entryCount >= MaxEntries) {
+		m_entries.clear();
+		m_entryCount = 0;
+		m_maxSize = 0;
+	}
+
+	std::vector<Entry>& atStart = m_entries[start];
+	for (Entry& existing : atStart) {
+		// same window decoded again after its bytes changed, replace it
+		if (existing.backend == backend && existing.mode == mode && existing.bytes.size() == size) {
+			existing = std::move(entry);
+			return;
+		}
+	}
+
+	atStart.push_back(std::move(entry));
+	m_entryCount++;
+	m_maxSize = std::max(m_maxSize, size);
+}
+
+void PLH::DecodeCache::invalidate(const uint64_t address, const uint64_t size) {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (m_entries.empty())
+		return;
+
+	// only windows starting less than the largest window size before the write can reach it
+	const uint64_t end = address + size;
+	auto it = m_entries.lower_bound(address >= m_maxSize ? address - m_maxSize + 1 : 0);
+	while (it != m_entries.end() && it->first < end) {
+		std::vector<Entry>& atStart = it->second;
+		const uint64_t start = it->first;
+		const size_t before = atStart.size();
+		atStart.erase(std::remove_if(atStart.begin(), atStart.end(), [start, address] (const Entry& entry) {
+			return start + entry.bytes.size() > address;
+		}), atStart.end());
+		m_entryCount -= before - atStart.size();
+
+		if (atStart.empty())
+			it = m_entries.erase(it);
+		else
+			++it;
+	}
+}
+
+void PLH::DecodeCache::clear() {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_entries.clear();
+	m_entryCount = 0;
+	m_maxSize = 0;
+	m_hits = 0;
+	m_misses = 0;
+}
+
+size_t PLH::DecodeCache::getEntryCount() {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_entryCount;
+}
@@ -0,0 +1,49 @@
+#include "headers/Detour/DetourPlanner.hpp"
+
+PLH::DetourPlanner::DetourPlanner(const uint32_t threadCount) {
+	m_threadCount = threadCount != 0 ? threadCount : std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+}
+
+void PLH::DetourPlanner::add(Detour& detour) {
+	m_detours.push_back(&detour);
+}
+
+bool PLH::DetourPlanner::plan() {
+	m_failed.clear();
+	std::vector<uint8_t> failed(m_detours.size(), 0);
+
+	// workers pull the next detour off a shared index, plans take wildly different times so no static split
+	std::atomic<size_t> next = 0;
+	auto worker = [this, &next, &failed] () {
+		for (size_t i = next++; i < m_detours.size(); i = next++) {
+			Detour* detour = m_detours[i];
+			if (detour->isPlanned() || detour->isHooked())
+				continue;
+
+			if (!detour->plan())
+				failed[i] = 1;
+		}
+	};
+
+	const uint32_t threadCount = (uint32_t)std::min<size_t>(m_threadCount, m_detours.size());
+	std::vector<std::thread> workers;
+	for (uint32_t i = 1; i < threadCount; i++)
+		workers.emplace_back(worker);
+
+	// the calling thread works too
+	worker();
+	for (std::thread& thread : workers)
+		thread.join();
+
+	for (size_t i = 0; i < m_detours.size(); i++) {
+		if (failed[i])
+			m_failed.push_back(m_detours[i]);
+	}
+
+	if (!m_failed.empty()) {
+		ErrorLog::singleton().push(std::to_string(m_failed.size()) + " of " + std::to_string(m_detours.size()) +
+								   " detours failed to plan", ErrorLevel::WARN);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,268 @@
+#include "headers/Detour/ExitHook.hpp"
+#ifdef _WIN64
+#include "headers/Detour/x64Detour.hpp"
+#else
+#include "headers/Detour/x86Detour.hpp"
+#endif
+
+#include <intrin.h>
+#include <exception>
+
+namespace {
+struct ShadowFrame {
+	uintptr_t returnAddress;
+	uintptr_t* retSlot;
+	uintptr_t returnStub;
+	PLH::tExitCallback callback;
+	uint64_t entryTsc;
+};
+
+// what the return stub pushes, the real return address goes back into the same stack slot it was taken from
+struct ReturnFrame {
+#ifdef _WIN64
+	uint64_t xmm0[2];
+#endif
+	uintptr_t xdx;
+	uintptr_t xax;
+	uintptr_t returnAddress;
+};
+
+// per thread, so pushing and popping never contends with anything
+thread_local ShadowFrame t_shadowStack[PLH::ExitHook::MaxShadowDepth];
+thread_local uint32_t t_shadowDepth = 0;
+
+/* The stack grows down, so every live frame's return slot is above the one being pushed or popped. Frames at or
+below it were skipped by a longjmp or unwind and will never return through the stub.*/
+void dropUnwoundFrames(const uintptr_t* retSlot, const bool inclusive) {
+	while (t_shadowDepth > 0) {
+		const uintptr_t* top = t_shadowStack[t_shadowDepth - 1].retSlot;
+		if (top > retSlot || (!inclusive && top == retSlot))
+			break;
+		t_shadowDepth--;
+	}
+}
+
+#ifdef _WIN64
+/* x64 unwinding, for exceptions and longjmp alike, walks return addresses. The return stubs have no unwind data and
+the real return address isn't on the stack at all, so the unwinder would mis-walk from a swapped slot. Before any
+exception is dispatched the real return addresses are put back and the frames dropped, the calls then return
+straight to their callers without reporting. Registered last, a handler that resumes execution (a BreakPointHook)
+gets to the exception first and nothing is lost then.*/
+LONG CALLBACK restoreReturnAddresses(EXCEPTION_POINTERS* ExceptionInfo) {
+	const uintptr_t sp = (uintptr_t)ExceptionInfo->ContextRecord->Rsp;
+	while (t_shadowDepth > 0) {
+		const ShadowFrame& frame = t_shadowStack[--t_shadowDepth];
+
+		// below the stack pointer the frame is already gone, its slot may have been reused
+		if ((uintptr_t)frame.retSlot >= sp && *frame.retSlot == frame.returnStub)
+			*frame.retSlot = frame.returnAddress;
+	}
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif
+}
+
+PLH::ExitHook::ExitHook(const uint64_t fnAddress, const tExitCallback callback, PLH::ADisassembler& dis) : m_disasm(dis) {
+	assert(fnAddress != 0 && callback != nullptr);
+	m_fnAddress = fnAddress;
+	m_callback = callback;
+	m_stub = 0;
+	m_stubSz = 0;
+}
+
+PLH::ExitHook::ExitHook(const char* fnAddress, const tExitCallback callback, PLH::ADisassembler& dis) : ExitHook((uint64_t)fnAddress, callback, dis) {
+
+}
+
+PLH::ExitHook::~ExitHook() {
+	if (m_detour)
+		unHook();
+}
+
+bool PLH::ExitHook::hook() {
+	assert(!m_detour);
+#ifdef _WIN64
+	// never removed, return slots may be swapped for as long as the process runs
+	static PVOID restoreHandler = AddVectoredExceptionHandler(0, &restoreReturnAddresses);
+	if (restoreHandler == nullptr) {
+		ErrorLog::singleton().push("Failed to register the exit hook exception handler", ErrorLevel::SEV);
+		return false;
+	}
+#endif
+
+	uint64_t entryOffset = 0;
+	uint64_t returnStubOffset = 0;
+	uint64_t trampHolderOffset = 0;
+	m_stubSz = makeStubs(0, entryOffset, returnStubOffset, trampHolderOffset).size();
+	m_stub = Reclaimer::singleton().getBlock(m_stubSz);
+	if (m_stub == 0) {
+		ErrorLog::singleton().push("Failed to allocate exit hook stubs", ErrorLevel::SEV);
+		return false;
+	}
+
+	const std::vector<uint8_t> stubs = makeStubs(m_stub, entryOffset, returnStubOffset, trampHolderOffset);
+	memcpy((char*)m_stub, stubs.data(), stubs.size());
+
+	// the holder must survive threads still in the entry stub, the detour retires the stubs itself on unhook
+	uint64_t* trampHolder = (uint64_t*)(m_stub + trampHolderOffset);
+#ifdef _WIN64
+	m_detour.reset(new x64Detour(m_fnAddress, m_stub + entryOffset, trampHolder, m_disasm));
+#else
+	m_detour.reset(new x86Detour(m_fnAddress, m_stub + entryOffset, trampHolder, m_disasm));
+#endif
+	m_detour->setHolderStub(m_stub, m_stubSz);
+	if (!m_detour->hook()) {
+		m_detour.reset();
+		Reclaimer::singleton().freeBlock(m_stub);
+		m_stub = 0;
+		return false;
+	}
+	return true;
+}
+
+bool PLH::ExitHook::unHook() {
+	assert(m_detour);
+	if (!m_detour->unHook())
+		return false;
+
+	// return addresses into the return stub are on the stacks of calls in flight, the detour retired it
+	m_detour.reset();
+	m_stub = 0;
+	return true;
+}
+
+void PLH::ExitHook::onEnter(const StubData* data, uintptr_t* retSlot) {
+	dropUnwoundFrames(retSlot, false);
+
+	// a tail call from another exit hooked function reuses its return slot, which already leads to a return stub
+	if (t_shadowDepth > 0) {
+		const ShadowFrame& top = t_shadowStack[t_shadowDepth - 1];
+		if (top.retSlot == retSlot && *retSlot == top.returnStub)
+			return;
+	}
+	dropUnwoundFrames(retSlot, true);
+
+	if (t_shadowDepth >= MaxShadowDepth)
+		return;
+
+	ShadowFrame& frame = t_shadowStack[t_shadowDepth++];
+	frame.returnAddress = *retSlot;
+	frame.retSlot = retSlot;
+	frame.returnStub = data->returnStub;
+	frame.callback = data->callback;
+	frame.entryTsc = __rdtsc();
+
+	*retSlot = data->returnStub;
+}
+
+void PLH::ExitHook::onExit(void* frame) {
+	ReturnFrame* ret = (ReturnFrame*)frame;
+	uintptr_t* retSlot = &ret->returnAddress;
+
+	// anything below this call is gone, this call itself is the frame on top
+	dropUnwoundFrames(retSlot - 1, true);
+	if (t_shadowDepth == 0 || t_shadowStack[t_shadowDepth - 1].retSlot != retSlot) {
+		// the real return address is lost, there's nowhere sane to go
+		ErrorLog::singleton().push("Exit hook shadow stack has no frame for this return", ErrorLevel::SEV);
+		std::terminate();
+	}
+
+	const ShadowFrame shadow = t_shadowStack[--t_shadowDepth];
+	ret->returnAddress = shadow.returnAddress;
+
+	ExitHookContext ctx;
+	ctx.returnValue = ret->xax;
+	ctx.returnValueHigh = ret->xdx;
+#ifdef _WIN64
+	memcpy(ctx.xmm0.u64, ret->xmm0, sizeof(ret->xmm0));
+#endif
+	ctx.returnAddress = shadow.returnAddress;
+	ctx.entryTsc = shadow.entryTsc;
+
+	shadow.callback(&ctx);
+
+	ret->xax = (uintptr_t)ctx.returnValue;
+	ret->xdx = (uintptr_t)ctx.returnValueHigh;
+#ifdef _WIN64
+	memcpy(ret->xmm0, ctx.xmm0.u64, sizeof(ret->xmm0));
+#endif
+}
+
+std::vector<uint8_t> PLH::ExitHook::makeStubs(const uint64_t stubAddress, uint64_t& entryOffset, uint64_t& returnStubOffset, uint64_t& trampHolderOffset) const {
+	/* The block starts with what the entry stub hands to onEnter. It lives as long as the stubs do, so calls in flight
+	never read the ExitHook object, which may be unhooked or destroyed under them.
+	Entry stub: the return address is on top of the stack. Save the argument registers, let onEnter swap the
+	return address for the return stub, restore them and continue into the trampoline.
+	Return stub: the function has returned into it, so the return value is live and the stack pointer is just
+	above the slot the return address was taken from. Reserve that slot again, save the return value above it and
+	let onExit put the real return address back in it and call the callback, then ret through it.*/
+	std::vector<uint8_t> code(sizeof(StubData), 0);
+	const uint64_t dataAddress = stubAddress;
+	entryOffset = code.size();
+#ifdef _WIN64
+	const uint8_t xmmCount = 6;
+	emitBytes(code, { 0x51, 0x52, 0x41, 0x50, 0x41, 0x51 });        // push rcx, rdx, r8, r9
+	emitBytes(code, { 0x50, 0x41, 0x52, 0x41, 0x53 });              // push rax, r10, r11
+	emitBytes(code, { 0x48, 0x81, 0xEC }); emitImm<int32_t>(code, 0x80); // sub rsp, xmm area + shadow space
+	for (uint8_t i = 0; i < xmmCount; i++)
+		emitMovdquSp(code, i, 0x20 + i * 16, true);
+
+	emitBytes(code, { 0x48, 0xB9 }); emitImm<uint64_t>(code, dataAddress); // mov rcx, stub data
+	emitBytes(code, { 0x48, 0x8D, 0x94, 0x24 }); emitImm<int32_t>(code, 0x80 + 7 * 8); // lea rdx, [rsp + return slot]
+	emitBytes(code, { 0x48, 0xB8 }); emitImm<uint64_t>(code, (uint64_t)&ExitHook::onEnter); // mov rax, onEnter
+	emitBytes(code, { 0xFF, 0xD0 });                                // call rax
+
+	for (uint8_t i = 0; i < xmmCount; i++)
+		emitMovdquSp(code, i, 0x20 + i * 16, false);
+	emitBytes(code, { 0x48, 0x81, 0xC4 }); emitImm<int32_t>(code, 0x80); // add rsp, xmm area + shadow space
+	emitBytes(code, { 0x41, 0x5B, 0x41, 0x5A, 0x58 });              // pop r11, r10, rax
+	emitBytes(code, { 0x41, 0x59, 0x41, 0x58, 0x5A, 0x59 });        // pop r9, r8, rdx, rcx
+	emitBytes(code, { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 });        // jmp [rip + 0]
+	trampHolderOffset = code.size();
+	emitImm<uint64_t>(code, 0);
+
+	returnStubOffset = code.size();
+	emitBytes(code, { 0x48, 0x83, 0xEC, 0x08 });                    // sub rsp, 8 (return slot)
+	emitBytes(code, { 0x50, 0x52 });                                // push rax, rdx
+	emitBytes(code, { 0x48, 0x83, 0xEC, 0x10 });                    // sub rsp, 0x10
+	emitMovdquSp(code, 0, 0, true);                                 // movdqu [rsp], xmm0
+	emitBytes(code, { 0x48, 0x89, 0xE1 });                          // mov rcx, rsp
+	emitBytes(code, { 0x48, 0x83, 0xEC, 0x28 });                    // sub rsp, 0x28 (shadow space, realign)
+	emitBytes(code, { 0x48, 0xB8 }); emitImm<uint64_t>(code, (uint64_t)&ExitHook::onExit); // mov rax, onExit
+	emitBytes(code, { 0xFF, 0xD0 });                                // call rax
+	emitBytes(code, { 0x48, 0x83, 0xC4, 0x28 });                    // add rsp, 0x28
+	emitMovdquSp(code, 0, 0, false);                                // movdqu xmm0, [rsp]
+	emitBytes(code, { 0x48, 0x83, 0xC4, 0x10 });                    // add rsp, 0x10
+	emitBytes(code, { 0x5A, 0x58 });                                // pop rdx, rax
+	emitBytes(code, { 0xC3 });                                      // ret
+#else
+	emitBytes(code, { 0x50, 0x51, 0x52 });                          // push eax, ecx, edx
+	emitBytes(code, { 0x8D, 0x44, 0x24, 0x0C });                    // lea eax, [esp + return slot]
+	emitBytes(code, { 0x50 });                                      // push eax
+	emitBytes(code, { 0x68 }); emitImm<uint32_t>(code, (uint32_t)dataAddress); // push stub data
+	emitBytes(code, { 0xB8 }); emitImm<uint32_t>(code, (uint32_t)&ExitHook::onEnter); // mov eax, onEnter
+	emitBytes(code, { 0xFF, 0xD0 });                                // call eax
+	emitBytes(code, { 0x83, 0xC4, 0x08 });                          // add esp, 8
+	emitBytes(code, { 0x5A, 0x59, 0x58 });                          // pop edx, ecx, eax
+	emitBytes(code, { 0xFF, 0x25 });                                // jmp [holder]
+	emitImm<uint32_t>(code, (uint32_t)(stubAddress + code.size() + 4));
+	trampHolderOffset = code.size();
+	emitImm<uint64_t>(code, 0);
+
+	returnStubOffset = code.size();
+	emitBytes(code, { 0x83, 0xEC, 0x04 });                          // sub esp, 4 (return slot)
+	emitBytes(code, { 0x50, 0x52 });                                // push eax, edx
+	emitBytes(code, { 0x54 });                                      // push esp (cdecl arg)
+	emitBytes(code, { 0xB8 }); emitImm<uint32_t>(code, (uint32_t)&ExitHook::onExit); // mov eax, onExit
+	emitBytes(code, { 0xFF, 0xD0 });                                // call eax
+	emitBytes(code, { 0x83, 0xC4, 0x04 });                          // add esp, 4
+	emitBytes(code, { 0x5A, 0x58 });                                // pop edx, eax
+	emitBytes(code, { 0xC3 });                                      // ret
+#endif
+
+	StubData data;
+	data.returnStub = (uintptr_t)(stubAddress + returnStubOffset);
+	data.callback = m_callback;
+	memcpy(code.data(), &data, sizeof(data));
+	return code;
+}
@@ -0,0 +1,59 @@
+#include "headers/HookBatch.hpp"
+
+PLH::HookBatch::HookBatch() {
+	m_lastProtectCount = 0;
+	m_hooked = false;
+}
+
+void PLH::HookBatch::add(IHook& hook) {
+	assert(!m_hooked);
+	m_hooks.push_back(&hook);
+}
+
+bool PLH::HookBatch::hook() {
+	assert(!m_hooked);
+	size_t hooked = 0;
+	{
+		ProtectionBatch batch;
+		for (; hooked < m_hooks.size(); hooked++) {
+			if (!m_hooks[hooked]->hook())
+				break;
+		}
+
+		if (hooked < m_hooks.size()) {
+			ErrorLog::singleton().push("Hook " + std::to_string(hooked) + " of batch failed, removing the " +
+									   std::to_string(hooked) + " already installed", ErrorLevel::SEV);
+			while (hooked > 0)
+				m_hooks[--hooked]->unHook();
+		}
+		m_lastProtectCount = batch.getProtectCount();
+	}
+
+	// anything rolled back was retired while the batch held off collection
+	Reclaimer::singleton().collect();
+	if (hooked < m_hooks.size())
+		return false;
+
+	m_hooked = true;
+	return true;
+}
+
+bool PLH::HookBatch::unHook() {
+	assert(m_hooked);
+	bool allRemoved = true;
+	{
+		ProtectionBatch batch;
+		for (size_t i = m_hooks.size(); i > 0; i--) {
+			if (!m_hooks[i - 1]->unHook())
+				allRemoved = false;
+		}
+		m_lastProtectCount = batch.getProtectCount();
+	}
+	Reclaimer::singleton().collect();
+
+	if (!allRemoved)
+		ErrorLog::singleton().push("Some hooks of batch failed to unhook", ErrorLevel::SEV);
+
+	m_hooked = false;
+	return allRemoved;
+}
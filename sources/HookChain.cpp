@@ -0,0 +1,284 @@
+#include "headers/Detour/HookChain.hpp"
+#ifdef _WIN64
+#include "headers/Detour/x64Detour.hpp"
+#else
+#include "headers/Detour/x86Detour.hpp"
+#endif
+
+std::map<uint64_t, PLH::HookChain*> PLH::HookChain::m_chains;
+std::mutex PLH::HookChain::m_chainsMtx;
+
+namespace {
+// published while unhooking, threads still entering the old dispatcher go straight to the original
+uintptr_t g_noListeners[1] = { 0 };
+}
+
+PLH::HookChain::HookChain(const uint64_t fnAddress, const asmjit::FuncSignature& sig, PLH::ADisassembler& dis) : m_disasm(dis) {
+	assert(fnAddress != 0);
+	m_fnAddress = fnAddress;
+	m_dispatcher = 0;
+	m_dispatcherSz = 0;
+	m_activeListeners = nullptr;
+	m_activeCount = 0;
+
+	// the signature only points at its argument types, keep our own copy of them
+	m_sigArgs.assign(sig.args(), sig.args() + sig.argCount());
+	m_sig.init(sig.callConv(), sig.vaIndex(), sig.ret(), m_sigArgs.data(), (uint32_t)m_sigArgs.size());
+
+	std::lock_guard<std::mutex> lock(m_listenerMtx);
+	publishListeners();
+}
+
+PLH::HookChain::HookChain(const char* fnAddress, const asmjit::FuncSignature& sig, PLH::ADisassembler& dis) : HookChain((uint64_t)fnAddress, sig, dis) {
+
+}
+
+PLH::HookChain::~HookChain() {
+	if (m_detour)
+		unHook();
+
+	// no dispatcher reads it any more, but threads that already loaded it may still be walking it
+	retireListeners(m_activeListeners, m_activeCount);
+}
+
+bool PLH::HookChain::hook() {
+	assert(!m_detour);
+	std::lock_guard<std::mutex> lock(m_chainsMtx);
+	if (m_chains.count(m_fnAddress) > 0) {
+		ErrorLog::singleton().push("Function already has a hook chain, add a listener to that one instead", ErrorLevel::SEV);
+		return false;
+	}
+
+	// a new dispatcher per hook, the last one was retired along with its detour
+	const uint64_t dispatcher = makeDispatcher();
+	if (dispatcher == 0)
+		return false;
+
+	DispatcherState* state = (DispatcherState*)dispatcher;
+	{
+		std::lock_guard<std::mutex> listenerLock(m_listenerMtx);
+		state->listeners = m_activeListeners;
+		m_dispatcher = dispatcher;
+	}
+
+#ifdef _WIN64
+	m_detour.reset(new x64Detour(m_fnAddress, dispatcher + sizeof(DispatcherState), &state->trampoline, m_disasm));
+#else
+	m_detour.reset(new x86Detour(m_fnAddress, dispatcher + sizeof(DispatcherState), &state->trampoline, m_disasm));
+#endif
+	m_detour->setHolderStub(dispatcher, m_dispatcherSz);
+	if (!m_detour->hook()) {
+		m_detour.reset();
+		{
+			std::lock_guard<std::mutex> listenerLock(m_listenerMtx);
+			m_dispatcher = 0;
+		}
+		Reclaimer::singleton().freeBlock(dispatcher);
+		return false;
+	}
+
+	m_chains[m_fnAddress] = this;
+	return true;
+}
+
+bool PLH::HookChain::unHook() {
+	assert(m_detour);
+	std::lock_guard<std::mutex> lock(m_chainsMtx);
+
+	/* The detour may free the dispatcher as soon as it's unhooked, so nothing is published to it after this. Its
+	state stops pointing at our table first, the table is only retired once the chain replaces or drops it.*/
+	DispatcherState* state = (DispatcherState*)m_dispatcher;
+	{
+		std::lock_guard<std::mutex> listenerLock(m_listenerMtx);
+		state->listeners = g_noListeners;
+		m_dispatcher = 0;
+	}
+
+	if (!m_detour->unHook()) {
+		std::lock_guard<std::mutex> listenerLock(m_listenerMtx);
+		state->listeners = m_activeListeners;
+		m_dispatcher = (uint64_t)state;
+		return false;
+	}
+
+	m_detour.reset();
+	m_chains.erase(m_fnAddress);
+	return true;
+}
+
+void PLH::HookChain::addListener(const uint64_t listener) {
+	assert(listener != 0);
+	std::lock_guard<std::mutex> lock(m_listenerMtx);
+	m_listeners.push_back(listener);
+	publishListeners();
+}
+
+bool PLH::HookChain::removeListener(const uint64_t listener) {
+	std::lock_guard<std::mutex> lock(m_listenerMtx);
+	auto it = std::find(m_listeners.begin(), m_listeners.end(), listener);
+	if (it == m_listeners.end())
+		return false;
+
+	m_listeners.erase(it);
+	publishListeners();
+	return true;
+}
+
+size_t PLH::HookChain::getListenerCount() {
+	std::lock_guard<std::mutex> lock(m_listenerMtx);
+	return m_listeners.size();
+}
+
+PLH::HookChain* PLH::HookChain::find(const uint64_t fnAddress) {
+	std::lock_guard<std::mutex> lock(m_chainsMtx);
+	auto it = m_chains.find(fnAddress);
+	return it == m_chains.end() ? nullptr : it->second;
+}
+
+void PLH::HookChain::publishListeners() {
+	uintptr_t* table = new uintptr_t[m_listeners.size() + 1];
+	for (size_t i = 0; i < m_listeners.size(); i++)
+		table[i] = (uintptr_t)m_listeners[i];
+	table[m_listeners.size()] = 0;
+
+	// aligned pointer store, the dispatcher sees either the old table or the new one
+	if (m_dispatcher != 0)
+		((DispatcherState*)m_dispatcher)->listeners = table;
+
+	retireListeners(m_activeListeners, m_activeCount);
+	m_activeListeners = table;
+	m_activeCount = m_listeners.size();
+}
+
+void PLH::HookChain::retireListeners(uintptr_t* table, const size_t count) {
+	if (table == nullptr)
+		return;
+
+	// a thread walking it has a pointer into it in a register or on its stack
+	Reclaimer::singleton().retire((uint64_t)table, (count + 1) * sizeof(uintptr_t), [table] () {
+		delete[] table;
+	});
+}
+
+uint64_t PLH::HookChain::makeDispatcher() {
+	/* The code embeds the address of the state in front of it, which isn't known before the block is allocated.
+	Size it first with a placeholder that needs the widest encoding, the real address never takes more.*/
+	const uint64_t placeholder = 0x7FFFFFFFFFFF0000;
+	asmjit::CodeHolder sizing;
+	sizing.init(asmjit::CodeInfo(asmjit::ArchInfo::kIdHost));
+	if (!compileDispatcher(sizing, placeholder))
+		return 0;
+
+	const uint64_t maxCodeSz = sizing.codeSize();
+	const uint64_t block = Reclaimer::singleton().getBlock(sizeof(DispatcherState) + maxCodeSz);
+	if (block == 0) {
+		ErrorLog::singleton().push("Failed to allocate hook chain dispatcher", ErrorLevel::SEV);
+		return 0;
+	}
+
+	asmjit::CodeHolder code;
+	code.init(asmjit::CodeInfo(asmjit::ArchInfo::kIdHost));
+	asmjit::StringLogger log;
+	code.setLogger(&log);
+	if (!compileDispatcher(code, block) || code.codeSize() > maxCodeSz) {
+		ErrorLog::singleton().push("Hook chain dispatcher doesn't fit the size it was compiled with", ErrorLevel::SEV);
+		Reclaimer::singleton().freeBlock(block);
+		return 0;
+	}
+
+	DispatcherState* state = (DispatcherState*)block;
+	state->listeners = g_noListeners;
+	state->trampoline = 0;
+
+	const uint64_t dispatcher = block + sizeof(DispatcherState);
+	m_dispatcherSz = sizeof(DispatcherState) + maxCodeSz;
+	code.relocateToBase(dispatcher);
+	code.copyFlattenedData((unsigned char*)dispatcher, code.codeSize());
+
+	ErrorLog::singleton().push("Hook chain dispatcher:\n" + std::string(log.data()), ErrorLevel::INFO);
+	return block;
+}
+
+bool PLH::HookChain::compileDispatcher(asmjit::CodeHolder& code, const uint64_t state) {
+	/* Same approach as ILCallback, the compiler is given the signature so it can keep the arguments alive across
+	every listener call and forward them to the original with the right ABI. Only types that fit a register are
+	supported.*/
+	asmjit::x86::Compiler cc(&code);
+	cc.addFunc(m_sig);
+
+	std::vector<asmjit::x86::Reg> argRegisters;
+	for (uint8_t arg_idx = 0; arg_idx < m_sig.argCount(); arg_idx++) {
+		const uint8_t argType = m_sig.args()[arg_idx];
+
+		asmjit::x86::Reg arg;
+		if (asmjit::Type::isInt(argType)) {
+			arg = cc.newUIntPtr();
+		} else if (asmjit::Type::isFloat(argType)) {
+			arg = cc.newXmm();
+		} else {
+			ErrorLog::singleton().push("Parameters wider than 64bits not supported", ErrorLevel::SEV);
+			return false;
+		}
+
+		cc.setArg(arg_idx, arg);
+		argRegisters.push_back(arg);
+	}
+
+	// listeners take the same arguments, their return value is ignored
+	asmjit::FuncSignature listenerSig;
+	listenerSig.init(m_sig.callConv(), m_sig.vaIndex(), asmjit::Type::kIdVoid, m_sig.args(), m_sig.argCount());
+
+	// table = state->listeners, loaded once so a concurrent swap can't be seen halfway through a call
+	asmjit::x86::Gp table = cc.newUIntPtr("table");
+	cc.mov(table, (uintptr_t)(state + offsetof(DispatcherState, listeners)));
+	cc.mov(table, asmjit::x86::ptr(table));
+
+	asmjit::Label next = cc.newLabel();
+	asmjit::Label done = cc.newLabel();
+	cc.bind(next);
+
+	asmjit::x86::Gp listener = cc.newUIntPtr("listener");
+	cc.mov(listener, asmjit::x86::ptr(table));
+	cc.test(listener, listener);
+	cc.jz(done);
+
+	auto listenerCall = cc.call(listener, listenerSig);
+	for (uint8_t arg_idx = 0; arg_idx < m_sig.argCount(); arg_idx++)
+		listenerCall->setArg(arg_idx, argRegisters.at(arg_idx));
+
+	cc.add(table, sizeof(uintptr_t));
+	cc.jmp(next);
+	cc.bind(done);
+
+	// then the original function, through the trampoline the detour fills in
+	asmjit::x86::Gp orig = cc.newUIntPtr("orig");
+	cc.mov(orig, (uintptr_t)(state + offsetof(DispatcherState, trampoline)));
+	cc.mov(orig, asmjit::x86::ptr(orig));
+
+	auto origCall = cc.call(orig, m_sig);
+	for (uint8_t arg_idx = 0; arg_idx < m_sig.argCount(); arg_idx++)
+		origCall->setArg(arg_idx, argRegisters.at(arg_idx));
+
+	if (m_sig.hasRet()) {
+		if (asmjit::Type::isInt((uint8_t)m_sig.ret())) {
+			asmjit::x86::Gp ret = cc.newUIntPtr("ret");
+			origCall->setRet(0, ret);
+			cc.ret(ret);
+		} else {
+			asmjit::x86::Xmm ret = cc.newXmm("ret");
+			origCall->setRet(0, ret);
+			cc.ret(ret);
+		}
+	}
+
+	cc.endFunc();
+	if (cc.finalize() != asmjit::kErrorOk) {
+		ErrorLog::singleton().push("Failed to compile hook chain dispatcher", ErrorLevel::SEV);
+		return false;
+	}
+
+	code.flatten();
+	if (code.hasUnresolvedLinks())
+		code.resolveUnresolvedLinks();
+	return true;
+}
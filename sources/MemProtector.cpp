@@ -1,5 +1,7 @@
 #include "headers/MemProtector.hpp"
 #include "headers/Enums.hpp"
+#include "headers/ErrorLog.hpp"
+#include <cassert>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -100,4 +102,95 @@ PLH::ProtFlag PLH::TranslateProtection(const int prot) {
 		break;
 	}
 	return flags;
-}
\ No newline at end of file
+}
+thread_local PLH::ProtectionBatch* PLH::ProtectionBatch::m_active = nullptr;
+
+PLH::ProtectionBatch::ProtectionBatch() {
+	m_protectCount = 0;
+	m_needsFlush = false;
+	m_outer = m_active;
+	m_active = this;
+}
+
+PLH::ProtectionBatch::~ProtectionBatch() {
+	// restore runs of neighbouring pages that had the same protection with one call
+	const uint64_t pageSz = 0x1000;
+	auto it = m_pages.begin();
+	while (it != m_pages.end()) {
+		const uint64_t runStart = it->first;
+		const DWORD origProt = it->second.origProt;
+		uint64_t runEnd = runStart + pageSz;
+		for (++it; it != m_pages.end() && it->first == runEnd && it->second.origProt == origProt; ++it)
+			runEnd += pageSz;
+
+		DWORD prev;
+		if (VirtualProtect((char*)runStart, (SIZE_T)(runEnd - runStart), origProt, &prev))
+			continue;
+
+		// the run spans more than one allocation (two adjacent image mappings), which one call can't change
+		for (uint64_t page = runStart; page < runEnd; page += pageSz) {
+			if (!VirtualProtect((char*)page, (SIZE_T)pageSz, origProt, &prev))
+				ErrorLog::singleton().push("Failed to restore page protection", ErrorLevel::WARN);
+		}
+	}
+
+	if (m_needsFlush)
+		FlushInstructionCache(GetCurrentProcess(), NULL, 0);
+
+	assert(m_active == this);
+	m_active = m_outer;
+}
+
+PLH::ProtFlag PLH::ProtectionBatch::protect(const uint64_t address, const uint64_t length, const PLH::ProtFlag prot, bool& status) {
+	const uint64_t pageSz = 0x1000;
+	const uint64_t firstPage = address & ~(pageSz - 1);
+	PLH::ProtFlag firstOrig = PLH::ProtFlag::UNSET;
+	status = true;
+
+	for (uint64_t page = firstPage; page < address + length; page += pageSz) {
+		auto it = m_pages.find(page);
+
+		// a page changed earlier keeps what it was given, plus whatever this asks for that it lacks
+		PLH::ProtFlag wanted = prot;
+		if (it != m_pages.end()) {
+			wanted = it->second.prot | prot;
+			if (wanted == it->second.prot) {
+				if (page == firstPage)
+					firstOrig = TranslateProtection((int)it->second.origProt);
+				continue;
+			}
+		}
+
+		DWORD orig;
+		if (!VirtualProtect((char*)page, (SIZE_T)pageSz, TranslateProtection(wanted), &orig)) {
+			status = false;
+			continue;
+		}
+		m_protectCount++;
+
+		if (it == m_pages.end())
+			it = m_pages.emplace(page, Page{ orig, wanted }).first;
+		else
+			it->second.prot = wanted;
+
+		if (page == firstPage)
+			firstOrig = TranslateProtection((int)it->second.origProt);
+	}
+	return firstOrig;
+}
+
+void PLH::ProtectionBatch::deferFlush(const uint64_t address, const uint64_t length) {
+	m_needsFlush = true;
+}
+
+size_t PLH::ProtectionBatch::getPageCount() const {
+	return m_pages.size();
+}
+
+size_t PLH::ProtectionBatch::getProtectCount() const {
+	return m_protectCount;
+}
+
+PLH::ProtectionBatch* PLH::ProtectionBatch::active() {
+	return m_active;
+}
@@ -0,0 +1,189 @@
+#include "headers/Detour/MidHook.hpp"
+#ifdef _WIN64
+#include "headers/Detour/x64Detour.hpp"
+#else
+#include "headers/Detour/x86Detour.hpp"
+#endif
+
+PLH::MidHook::MidHook(const uint64_t address, const tMidHookCallback callback, PLH::ADisassembler& dis) : m_disasm(dis) {
+	assert(address != 0 && callback != nullptr);
+	m_address = address;
+	m_callback = callback;
+	m_fnStart = 0;
+	m_stub = 0;
+	m_stubSz = 0;
+}
+
+PLH::MidHook::MidHook(const char* address, const tMidHookCallback callback, PLH::ADisassembler& dis) : MidHook((uint64_t)address, callback, dis) {
+
+}
+
+PLH::MidHook::~MidHook() {
+	if (m_detour)
+		unHook();
+}
+
+bool PLH::MidHook::hook() {
+	assert(!m_detour);
+
+	// size is known before the address, it doesn't depend on where the stub lands
+	uint64_t trampHolderOffset = 0;
+	m_stubSz = makeStub(0, trampHolderOffset).size();
+	m_stub = Reclaimer::singleton().getBlock(m_stubSz);
+	if (m_stub == 0) {
+		ErrorLog::singleton().push("Failed to allocate mid hook stub", ErrorLevel::SEV);
+		return false;
+	}
+
+	const std::vector<uint8_t> stub = makeStub(m_stub, trampHolderOffset);
+	memcpy((char*)m_stub, stub.data(), stub.size());
+
+	/* The detour relocates the overwritten instructions and fills the holder the stub ends by jumping through. The
+	holder has to stay valid while threads are in the stub, the detour retires the stub itself on unhook.*/
+	uint64_t* trampHolder = (uint64_t*)(m_stub + trampHolderOffset);
+#ifdef _WIN64
+	m_detour.reset(new x64Detour(m_address, m_stub, trampHolder, m_disasm));
+#else
+	m_detour.reset(new x86Detour(m_address, m_stub, trampHolder, m_disasm));
+#endif
+	m_detour->setFollowJmps(false);
+	m_detour->setHolderStub(m_stub, m_stubSz);
+
+	// the detour only sees branches after the address, the ones before it are checked here
+	if (!m_detour->plan() || isBranchedInto(m_detour->getPlannedProlSz()) || !m_detour->commit()) {
+		m_detour.reset();
+		Reclaimer::singleton().freeBlock(m_stub);
+		m_stub = 0;
+		return false;
+	}
+	return true;
+}
+
+bool PLH::MidHook::unHook() {
+	assert(m_detour);
+	if (!m_detour->unHook())
+		return false;
+
+	// threads may still be in the stub or the callback it called, the detour handed it to the Reclaimer
+	m_detour.reset();
+	m_stub = 0;
+	return true;
+}
+
+bool PLH::MidHook::isBranchedInto(const uint64_t prolSz) {
+	uint64_t start = m_fnStart;
+	uint64_t end = m_address + prolSz;
+#ifdef _WIN64
+	DWORD64 imageBase = 0;
+	if (PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(m_address, &imageBase, nullptr)) {
+		start = imageBase + function->BeginAddress;
+		end = imageBase + function->EndAddress;
+	}
+#endif
+
+	if (start == 0 || start > m_address) {
+		ErrorLog::singleton().push("Start of the function holding the mid hook is unknown, see setFunctionStart", ErrorLevel::SEV);
+		return true;
+	}
+
+	const insts_t insts = m_disasm.disassemble(start, start, std::max(end, m_address + prolSz));
+	for (const auto& inst : insts) {
+		if (inst.getAddress() >= m_address && inst.getAddress() < m_address + prolSz)
+			continue;
+
+		if (!inst.isBranching() || !inst.hasDisplacement() || !inst.isDisplacementRelative())
+			continue;
+
+		const uint64_t dest = inst.getDestination();
+		if (dest > m_address && dest < m_address + prolSz) {
+			ErrorLog::singleton().push("Mid hook would overwrite a branch target", ErrorLevel::SEV);
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<uint8_t> PLH::MidHook::makeStub(const uint64_t stubAddress, uint64_t& trampHolderOffset) const {
+	std::vector<uint8_t> code;
+	emitSaveContext(code);
+	emitCallWithContext(code, (uint64_t)m_callback);
+	emitRestoreContext(code);
+#ifdef _WIN64
+	emitBytes(code, { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 });        // jmp [rip + 0]
+	UNREFERENCED_PARAMETER(stubAddress);
+#else
+	emitBytes(code, { 0xFF, 0x25 });                                // jmp [holder]
+	emitImm<uint32_t>(code, (uint32_t)(stubAddress + code.size() + 4));
+#endif
+	// holder for the trampoline address, filled by the detour
+	trampHolderOffset = code.size();
+	emitImm<uint64_t>(code, 0);
+	return code;
+}
+
+/* Push everything so the stack pointer ends up pointing at a MidHookContext, call the callback with it, then pop
+it all back. The stack is realigned around the call, the original pointer is kept in a callee saved register that
+was already pushed. Flags are restored last so the realignment doesn't leak into them.*/
+#ifdef _WIN64
+static const uint8_t ContextXmmCount = 16;
+#else
+static const uint8_t ContextXmmCount = 8;
+#endif
+
+void PLH::emitSaveContext(std::vector<uint8_t>& code) {
+#ifdef _WIN64
+	emitBytes(code, { 0x54 });                                      // push rsp
+	emitBytes(code, { 0x9C });                                      // pushfq
+	emitBytes(code, { 0xFC });                                      // cld, the ABI wants DF clear for the call
+	for (uint8_t r = 7; r != 0xFF; r--)
+		emitBytes(code, { 0x41, (uint8_t)(0x50 + r) });             // push r15 ... r8
+	for (uint8_t r : { 7, 6, 5, 3, 2, 1, 0 })
+		emitBytes(code, { (uint8_t)(0x50 + r) });                   // push rdi, rsi, rbp, rbx, rdx, rcx, rax
+	emitBytes(code, { 0x48, 0x81, 0xEC }); emitImm<int32_t>(code, ContextXmmCount * 16); // sub rsp, xmm area
+#else
+	emitBytes(code, { 0x60 });                                      // pushad
+	emitBytes(code, { 0x9C });                                      // pushfd
+	emitBytes(code, { 0xFC });                                      // cld, the ABI wants DF clear for the call
+	emitBytes(code, { 0x81, 0xEC }); emitImm<int32_t>(code, ContextXmmCount * 16); // sub esp, xmm area
+#endif
+	for (uint8_t i = 0; i < ContextXmmCount; i++)
+		emitMovdquSp(code, i, i * 16, true);
+}
+
+void PLH::emitCallWithContext(std::vector<uint8_t>& code, const uint64_t fn) {
+#ifdef _WIN64
+	emitBytes(code, { 0x48, 0x89, 0xE1 });                          // mov rcx, rsp
+	emitBytes(code, { 0x48, 0x89, 0xE3 });                          // mov rbx, rsp
+	emitBytes(code, { 0x48, 0x83, 0xE4, 0xF0 });                    // and rsp, -16
+	emitBytes(code, { 0x48, 0x83, 0xEC, 0x20 });                    // sub rsp, 0x20 (shadow space)
+	emitBytes(code, { 0x48, 0xB8 }); emitImm<uint64_t>(code, fn);   // mov rax, fn
+	emitBytes(code, { 0xFF, 0xD0 });                                // call rax
+	emitBytes(code, { 0x48, 0x89, 0xDC });                          // mov rsp, rbx
+#else
+	emitBytes(code, { 0x89, 0xE3 });                                // mov ebx, esp
+	emitBytes(code, { 0x83, 0xE4, 0xF0 });                          // and esp, -16
+	emitBytes(code, { 0x83, 0xEC, 0x0C });                          // sub esp, 12
+	emitBytes(code, { 0x53 });                                      // push ebx (cdecl arg)
+	emitBytes(code, { 0xB8 }); emitImm<uint32_t>(code, (uint32_t)fn); // mov eax, fn
+	emitBytes(code, { 0xFF, 0xD0 });                                // call eax
+	emitBytes(code, { 0x89, 0xDC });                                // mov esp, ebx
+#endif
+}
+
+void PLH::emitRestoreContext(std::vector<uint8_t>& code) {
+	for (uint8_t i = 0; i < ContextXmmCount; i++)
+		emitMovdquSp(code, i, i * 16, false);
+#ifdef _WIN64
+	emitBytes(code, { 0x48, 0x81, 0xC4 }); emitImm<int32_t>(code, ContextXmmCount * 16); // add rsp, xmm area
+	for (uint8_t r : { 0, 1, 2, 3, 5, 6, 7 })
+		emitBytes(code, { (uint8_t)(0x58 + r) });                   // pop rax, rcx, rdx, rbx, rbp, rsi, rdi
+	for (uint8_t r = 0; r < 8; r++)
+		emitBytes(code, { 0x41, (uint8_t)(0x58 + r) });             // pop r8 ... r15
+	emitBytes(code, { 0x9D });                                      // popfq
+	emitBytes(code, { 0x48, 0x8D, 0x64, 0x24, 0x08 });              // lea rsp, [rsp + 8] (skip saved rsp)
+#else
+	emitBytes(code, { 0x81, 0xC4 }); emitImm<int32_t>(code, ContextXmmCount * 16); // add esp, xmm area
+	emitBytes(code, { 0x9D });                                      // popfd
+	emitBytes(code, { 0x61 });                                      // popad, skips the saved esp
+#endif
+}
@@ -2,7 +2,7 @@
 
 std::vector<PLH::SplitPage> PLH::PageAllocator::m_pages;
 std::recursive_mutex PLH::PageAllocator::m_pageMtx;
-std::atomic<uint8_t> PLH::PageAllocator::m_refCount = 0;
+std::atomic<uint32_t> PLH::PageAllocator::m_refCount = 0;
 
 PLH::PageAllocator::PageAllocator(const uint64_t address, const uint64_t size) : m_regionStart(address), m_regionSize(size) {
 	m_refCount++;
@@ -20,32 +20,70 @@ PLH::PageAllocator::~PageAllocator() {
 	}
 }
 
+uint64_t PLH::PageAllocator::getBlockFromPage(SplitPage& page, const uint64_t size, const uint64_t regionStart,
+											  const uint64_t regionSize) const {
+	const uint64_t unusedPtr = (uint64_t)PLH::AlignUpwards((char*)page.getUnusedAddr(), 64);
+	const uint64_t proposedEnd = unusedPtr + size;
+	const uint64_t pageEnd = page.address + WIN_PAGE_SZ;
+	if (unusedPtr < regionStart || proposedEnd > pageEnd)
+		return 0;
+
+	if (regionSize && proposedEnd > regionStart + regionSize)
+		return 0;
+
+	// size + alignment unusable space
+	page.unusedOffset += size + (unusedPtr - page.getUnusedAddr());
+	page.blockCount++;
+	return unusedPtr;
+}
+
 uint64_t PLH::PageAllocator::getBlock(const uint64_t size) {
+	return getBlock(size, m_regionStart, m_regionSize);
+}
 
+uint64_t PLH::PageAllocator::getBlock(const uint64_t size, const uint64_t regionStart, const uint64_t regionSize) {
 	std::lock_guard<std::recursive_mutex> lock(m_pageMtx);
 
 	// Search available pages first
 	for (SplitPage& page : m_pages) {
-		const uint64_t unusedPtr = (uint64_t)PLH::AlignUpwards((char*)page.getUnusedAddr(), 64);
-		const uint64_t proposedEnd = unusedPtr + size;
-		const uint64_t pageEnd = page.address + WIN_PAGE_SZ;
-		if (m_regionStart <= unusedPtr && proposedEnd <= pageEnd) {
-			// size + alignment unusable space
-			page.unusedOffset += size + (unusedPtr - page.getUnusedAddr());
-			return unusedPtr;
-		}
+		if (uint64_t block = getBlockFromPage(page, size, regionStart, regionSize))
+			return block;
 	}
 	
-	uint64_t searchSz = m_regionSize ? m_regionSize : std::numeric_limits<int64_t>::max();
-	uint64_t Allocated = AllocateWithinRange(m_regionStart, searchSz);
+	uint64_t Allocated = 0;
+	if (regionSize) {
+		// search up then down from the middle, so blocks end up as close as possible to what the range was built around
+		const uint64_t regionMid = regionStart + regionSize / 2;
+		Allocated = AllocateWithinRange(regionMid, (int64_t)(regionStart + regionSize - regionMid));
+		if (Allocated == 0)
+			Allocated = AllocateWithinRange(regionMid, -(int64_t)(regionMid - regionStart));
+	} else {
+		Allocated = AllocateWithinRange(regionStart, std::numeric_limits<int64_t>::max());
+	}
+
 	if (Allocated == 0)
 		return 0;
 
 	SplitPage page;
 	page.address = Allocated;
 	page.unusedOffset = 0;
+	page.blockCount = 0;
 	m_pages.push_back(std::move(page));
 
-	return getBlock(size);
+	return getBlockFromPage(m_pages.back(), size, regionStart, regionSize);
+}
+
+void PLH::PageAllocator::freeBlock(const uint64_t address) {
+	std::lock_guard<std::recursive_mutex> lock(m_pageMtx);
+
+	for (SplitPage& page : m_pages) {
+		if (address < page.address || address >= page.address + WIN_PAGE_SZ)
+			continue;
+
+		assert(page.blockCount > 0);
+		if (page.blockCount > 0 && --page.blockCount == 0)
+			page.unusedOffset = 0;
+		return;
+	}
 }
 
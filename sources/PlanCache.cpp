@@ -0,0 +1,434 @@
+#include "headers/Detour/PlanCache.hpp"
+#include <algorithm>
+
+namespace {
+const uint32_t CacheMagic = 0x43484C50; // PLHC
+const uint32_t CacheVersion = 1;
+
+// bytes hashed at both ends of a resolved jmp chain
+const uint64_t ResolveHashSz = 16;
+
+enum InstFlags : uint8_t {
+	Branching = 1,
+	HasDisplacement = 2,
+	Relative = 4
+};
+
+uint64_t hashBytes(const uint8_t* bytes, const uint64_t size, uint64_t hash = 0xcbf29ce484222325) {
+	// FNV-1a
+	for (uint64_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+template<typename T>
+void put(std::vector<uint8_t>& out, const T value) {
+	const uint8_t* bytes = (const uint8_t*)&value;
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void putString(std::vector<uint8_t>& out, const std::string& str) {
+	const uint8_t len = (uint8_t)std::min<size_t>(str.size(), 0xFF);
+	put(out, len);
+	out.insert(out.end(), str.begin(), str.begin() + len);
+}
+
+// bounds checked reads from a blob, any read past the end fails every later one
+class BlobReader {
+public:
+	BlobReader(const std::vector<uint8_t>& blob) : m_blob(blob) {
+		m_pos = 0;
+		m_ok = true;
+	}
+
+	template<typename T>
+	T get() {
+		T value = T();
+		if (!take(sizeof(T)))
+			return value;
+
+		memcpy(&value, &m_blob[m_pos - sizeof(T)], sizeof(T));
+		return value;
+	}
+
+	std::vector<uint8_t> getBytes(const size_t size) {
+		if (!take(size))
+			return std::vector<uint8_t>();
+		return std::vector<uint8_t>(m_blob.begin() + (m_pos - size), m_blob.begin() + m_pos);
+	}
+
+	std::string getString() {
+		const uint8_t len = get<uint8_t>();
+		if (!take(len))
+			return std::string();
+		return std::string(m_blob.begin() + (m_pos - len), m_blob.begin() + m_pos);
+	}
+
+	bool ok() const {
+		return m_ok;
+	}
+private:
+	bool take(const size_t size) {
+		if (!m_ok || size > m_blob.size() - m_pos) {
+			m_ok = false;
+			return false;
+		}
+		m_pos += size;
+		return true;
+	}
+
+	const std::vector<uint8_t>& m_blob;
+	size_t m_pos;
+	bool m_ok;
+};
+}
+
+PLH::PlanCache::PlanCache(const std::wstring& path) {
+	m_path = path;
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = NULL;
+	m_view = nullptr;
+	m_viewSz = 0;
+	m_index = nullptr;
+	m_indexCount = 0;
+	m_hits = 0;
+	m_misses = 0;
+	map();
+}
+
+PLH::PlanCache::~PlanCache() {
+	unmap();
+}
+
+void PLH::PlanCache::map() {
+	m_file = CreateFileW(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER fileSz;
+	if (!GetFileSizeEx(m_file, &fileSz) || (uint64_t)fileSz.QuadPart < sizeof(FileHeader)) {
+		unmap();
+		return;
+	}
+
+	m_mapping = CreateFileMappingW(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == NULL) {
+		unmap();
+		return;
+	}
+
+	m_view = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m_view == nullptr) {
+		unmap();
+		return;
+	}
+	m_viewSz = (uint64_t)fileSz.QuadPart;
+
+	// a file from another version or cut short is ignored and overwritten on save
+	const FileHeader* header = (const FileHeader*)m_view;
+	if (header->magic != CacheMagic || header->version != CacheVersion ||
+		header->entryCount > (m_viewSz - sizeof(FileHeader)) / sizeof(IndexEntry)) {
+		ErrorLog::singleton().push("Plan cache file is invalid, starting empty", ErrorLevel::WARN);
+		unmap();
+		return;
+	}
+
+	m_index = (const IndexEntry*)(m_view + sizeof(FileHeader));
+	m_indexCount = header->entryCount;
+}
+
+void PLH::PlanCache::unmap() {
+	if (m_view != nullptr)
+		UnmapViewOfFile(m_view);
+	if (m_mapping != NULL)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = NULL;
+	m_view = nullptr;
+	m_viewSz = 0;
+	m_index = nullptr;
+	m_indexCount = 0;
+}
+
+bool PLH::PlanCache::save() {
+	std::lock_guard<std::mutex> lock(m_mtx);
+
+	// added entries replace loaded ones with the same key
+	std::map<std::string, std::vector<uint8_t>> entries;
+	for (uint32_t i = 0; i < m_indexCount; i++) {
+		const IndexEntry& entry = m_index[i];
+		if (entry.blobOffset > m_viewSz || entry.blobSize > m_viewSz - entry.blobOffset)
+			continue;
+
+		const uint8_t* blob = m_view + entry.blobOffset;
+		entries[std::string((const char*)&entry.key, sizeof(Key))] = std::vector<uint8_t>(blob, blob + entry.blobSize);
+	}
+	for (const auto& added : m_added)
+		entries[added.first] = added.second;
+
+	std::vector<uint8_t> file;
+	put(file, FileHeader{ CacheMagic, CacheVersion, (uint32_t)entries.size() });
+	uint32_t blobOffset = (uint32_t)(sizeof(FileHeader) + entries.size() * sizeof(IndexEntry));
+	for (const auto& entry : entries) {
+		IndexEntry index;
+		memcpy(&index.key, entry.first.data(), sizeof(Key));
+		index.blobOffset = blobOffset;
+		index.blobSize = (uint32_t)entry.second.size();
+		put(file, index);
+		blobOffset += index.blobSize;
+	}
+	for (const auto& entry : entries)
+		file.insert(file.end(), entry.second.begin(), entry.second.end());
+
+	// readers of the old file never see a partly written one
+	const std::wstring tmpPath = m_path + L".tmp";
+	HANDLE tmp = CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (tmp == INVALID_HANDLE_VALUE) {
+		ErrorLog::singleton().push("Failed to create plan cache file", ErrorLevel::WARN);
+		return false;
+	}
+
+	DWORD written = 0;
+	const bool wrote = WriteFile(tmp, file.data(), (DWORD)file.size(), &written, NULL) && written == file.size();
+	CloseHandle(tmp);
+	if (!wrote) {
+		DeleteFileW(tmpPath.c_str());
+		ErrorLog::singleton().push("Failed to write plan cache file", ErrorLevel::WARN);
+		return false;
+	}
+
+	unmap();
+	if (!MoveFileExW(tmpPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileW(tmpPath.c_str());
+		map();
+		ErrorLog::singleton().push("Failed to replace plan cache file", ErrorLevel::WARN);
+		return false;
+	}
+
+	map();
+	m_added.clear();
+	return true;
+}
+
+size_t PLH::PlanCache::getEntryCount() {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	size_t count = m_indexCount;
+	for (const auto& added : m_added) {
+		const IndexEntry* end = m_index + m_indexCount;
+		const IndexEntry* found = std::lower_bound(m_index, end, added.first, [] (const IndexEntry& entry, const std::string& key) {
+			return memcmp(&entry.key, key.data(), sizeof(Key)) < 0;
+		});
+		if (found == end || memcmp(&found->key, added.first.data(), sizeof(Key)) != 0)
+			count++;
+	}
+	return count;
+}
+
+bool PLH::PlanCache::makeKey(const uint64_t address, const KeyKind kind, const uint8_t jmpSz, Key& key, uint64_t& moduleBase) {
+	MEMORY_BASIC_INFORMATION mbi;
+	if (!VirtualQuery((char*)address, &mbi, sizeof(mbi)) || mbi.Type != MEM_IMAGE)
+		return false;
+
+	moduleBase = (uint64_t)mbi.AllocationBase;
+	const IMAGE_DOS_HEADER* dos = (IMAGE_DOS_HEADER*)moduleBase;
+	if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+		return false;
+
+	const IMAGE_NT_HEADERS* nt = (IMAGE_NT_HEADERS*)(moduleBase + dos->e_lfanew);
+	if (nt->Signature != IMAGE_NT_SIGNATURE || address - moduleBase >= nt->OptionalHeader.SizeOfImage)
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.rva = (uint32_t)(address - moduleBase);
+	key.kind = kind;
+	key.jmpSz = jmpSz;
+
+	/* The pdb GUID and age in the CodeView record are unique per build, like a GNU build id. Modules linked
+	without debug info fall back to the link timestamp and image size.*/
+	const IMAGE_DATA_DIRECTORY& debugDir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+	const IMAGE_DEBUG_DIRECTORY* debug = (IMAGE_DEBUG_DIRECTORY*)(moduleBase + debugDir.VirtualAddress);
+	const size_t debugCount = nt->OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_DEBUG && debugDir.VirtualAddress != 0 ?
+		debugDir.Size / sizeof(IMAGE_DEBUG_DIRECTORY) : 0;
+	for (size_t i = 0; i < debugCount; i++, debug++) {
+		if (debug->Type != IMAGE_DEBUG_TYPE_CODEVIEW || debug->AddressOfRawData == 0 || debug->SizeOfData < 24)
+			continue;
+
+		// RSDS signature, GUID, age
+		const uint8_t* codeView = (const uint8_t*)(moduleBase + debug->AddressOfRawData);
+		if (memcmp(codeView, "RSDS", 4) != 0)
+			continue;
+
+		memcpy(key.buildId, codeView + 4, sizeof(key.buildId));
+		return true;
+	}
+
+	memcpy(key.buildId, &nt->FileHeader.TimeDateStamp, 4);
+	memcpy(key.buildId + 4, &nt->OptionalHeader.SizeOfImage, 4);
+	return true;
+}
+
+bool PLH::PlanCache::findBlob(const Key& key, std::vector<uint8_t>& blob) const {
+	auto added = m_added.find(std::string((const char*)&key, sizeof(Key)));
+	if (added != m_added.end()) {
+		blob = added->second;
+		return true;
+	}
+
+	const IndexEntry* end = m_index + m_indexCount;
+	const IndexEntry* found = std::lower_bound(m_index, end, key, [] (const IndexEntry& entry, const Key& k) {
+		return memcmp(&entry.key, &k, sizeof(Key)) < 0;
+	});
+	if (found == end || memcmp(&found->key, &key, sizeof(Key)) != 0)
+		return false;
+
+	if (found->blobOffset > m_viewSz || found->blobSize > m_viewSz - found->blobOffset)
+		return false;
+
+	blob.assign(m_view + found->blobOffset, m_view + found->blobOffset + found->blobSize);
+	return true;
+}
+
+bool PLH::PlanCache::findResolved(const uint64_t address, uint64_t& resolved) {
+	Key key;
+	uint64_t moduleBase = 0;
+	std::vector<uint8_t> blob;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (!makeKey(address, KeyKind::Resolved, 0, key, moduleBase) || !findBlob(key, blob)) {
+			m_misses++;
+			return false;
+		}
+	}
+
+	BlobReader reader(blob);
+	const uint64_t hash = reader.get<uint64_t>();
+	const uint64_t target = moduleBase + reader.get<uint32_t>();
+	if (!reader.ok() || hash != hashBytes((uint8_t*)target, ResolveHashSz, hashBytes((uint8_t*)address, ResolveHashSz))) {
+		m_misses++;
+		return false;
+	}
+
+	resolved = target;
+	m_hits++;
+	return true;
+}
+
+void PLH::PlanCache::addResolved(const uint64_t address, const uint64_t resolved) {
+	Key key;
+	uint64_t moduleBase = 0;
+	if (!makeKey(address, KeyKind::Resolved, 0, key, moduleBase))
+		return;
+
+	// stored as an offset, only chains ending in the same module can be
+	Key resolvedKey;
+	uint64_t resolvedBase = 0;
+	if (!makeKey(resolved, KeyKind::Resolved, 0, resolvedKey, resolvedBase) || resolvedBase != moduleBase)
+		return;
+
+	std::vector<uint8_t> blob;
+	put(blob, hashBytes((uint8_t*)resolved, ResolveHashSz, hashBytes((uint8_t*)address, ResolveHashSz)));
+	put(blob, (uint32_t)(resolved - moduleBase));
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_added[std::string((const char*)&key, sizeof(Key))] = std::move(blob);
+}
+
+bool PLH::PlanCache::findPrologue(const uint64_t fnAddress, const uint8_t jmpSz, const Mode mode, insts_t& prologue,
+								  uint64_t& minProlSz, uint64_t& roundProlSz) {
+	Key key;
+	uint64_t moduleBase = 0;
+	std::vector<uint8_t> blob;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (!makeKey(fnAddress, KeyKind::Prologue, jmpSz, key, moduleBase) || !findBlob(key, blob)) {
+			m_misses++;
+			return false;
+		}
+	}
+
+	BlobReader reader(blob);
+	const uint64_t hash = reader.get<uint64_t>();
+	if (!reader.ok() || hash != hashBytes((uint8_t*)fnAddress, WindowSz)) {
+		m_misses++;
+		return false;
+	}
+
+	const uint32_t minSz = reader.get<uint32_t>();
+	const uint32_t roundSz = reader.get<uint32_t>();
+	const uint32_t count = reader.get<uint32_t>();
+	insts_t insts;
+	for (uint32_t i = 0; i < count && reader.ok(); i++) {
+		const uint32_t offset = reader.get<uint32_t>();
+		const uint8_t size = reader.get<uint8_t>();
+		const std::vector<uint8_t> bytes = reader.getBytes(size);
+		const uint8_t flags = reader.get<uint8_t>();
+		const uint8_t dispOffset = reader.get<uint8_t>();
+		const uint8_t dispSize = reader.get<uint8_t>();
+		Instruction::Displacement disp;
+		disp.Relative = reader.get<int64_t>();
+		const std::string mnemonic = reader.getString();
+		const std::string opStr = reader.getString();
+		if (!reader.ok() || dispOffset + dispSize > size)
+			break;
+
+		Instruction inst(fnAddress + offset, disp, dispOffset, (flags & InstFlags::Relative) != 0, bytes, mnemonic, opStr, mode);
+		if (flags & InstFlags::HasDisplacement) {
+			inst.setDisplacementSize(dispSize);
+			if (flags & InstFlags::Relative)
+				inst.setRelativeDisplacement(disp.Relative);
+			else
+				inst.setAbsoluteDisplacement(disp.Absolute);
+		}
+		inst.setBranching((flags & InstFlags::Branching) != 0);
+		insts.push_back(inst);
+	}
+
+	if (!reader.ok() || insts.size() != count || insts.empty()) {
+		ErrorLog::singleton().push("Plan cache entry is corrupt, ignoring it", ErrorLevel::WARN);
+		m_misses++;
+		return false;
+	}
+
+	prologue = std::move(insts);
+	minProlSz = minSz;
+	roundProlSz = roundSz;
+	m_hits++;
+	return true;
+}
+
+void PLH::PlanCache::addPrologue(const uint64_t fnAddress, const uint8_t jmpSz, const insts_t& prologue,
+								 const uint64_t minProlSz, const uint64_t roundProlSz) {
+	assert(!prologue.empty());
+	Key key;
+	uint64_t moduleBase = 0;
+	if (!makeKey(fnAddress, KeyKind::Prologue, jmpSz, key, moduleBase))
+		return;
+
+	std::vector<uint8_t> blob;
+	put(blob, hashBytes((uint8_t*)fnAddress, WindowSz));
+	put(blob, (uint32_t)minProlSz);
+	put(blob, (uint32_t)roundProlSz);
+	put(blob, (uint32_t)prologue.size());
+	for (const auto& inst : prologue) {
+		const bool hasDisp = inst.hasDisplacement();
+		put(blob, (uint32_t)(inst.getAddress() - fnAddress));
+		put(blob, (uint8_t)inst.size());
+		blob.insert(blob.end(), inst.getBytes().begin(), inst.getBytes().end());
+		put(blob, (uint8_t)((inst.isBranching() ? InstFlags::Branching : 0) |
+							(hasDisp ? InstFlags::HasDisplacement : 0) |
+							(inst.isDisplacementRelative() ? InstFlags::Relative : 0)));
+		put(blob, inst.getDisplacementOffset());
+		put(blob, (uint8_t)(hasDisp ? inst.getDispSize() : 0));
+		put(blob, inst.getDisplacement().Relative);
+		putString(blob, inst.getMnemonic());
+		putString(blob, inst.getOpStr());
+	}
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_added[std::string((const char*)&key, sizeof(Key))] = std::move(blob);
+}
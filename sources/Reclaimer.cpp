@@ -0,0 +1,128 @@
+#include "headers/Reclaimer.hpp"
+
+PLH::Reclaimer::Reclaimer() : m_mem(0, 0) {
+	m_pendingBytes = 0;
+}
+
+PLH::Reclaimer& PLH::Reclaimer::singleton() {
+	// leaked on purpose, hooks still installed at exit keep running code from its pages
+	static Reclaimer* reclaimer = new Reclaimer();
+	return *reclaimer;
+}
+
+uint64_t PLH::Reclaimer::getBlock(const uint64_t size, const uint64_t regionStart, const uint64_t regionSize) {
+	return m_mem.getBlock(size, regionStart, regionSize);
+}
+
+void PLH::Reclaimer::freeBlock(const uint64_t address) {
+	m_mem.freeBlock(address);
+}
+
+void PLH::Reclaimer::retireBlock(const uint64_t address, const uint64_t size) {
+	retire(address, size, [this, address] () {
+		m_mem.freeBlock(address);
+	});
+}
+
+void PLH::Reclaimer::retire(const uint64_t address, const uint64_t size, const std::function<void()>& release) {
+	assert(address != 0 && size > 0);
+	uint64_t pendingBytes = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		Retired retired;
+		retired.address = address;
+		retired.size = size;
+		retired.release = release;
+		m_retired.push_back(std::move(retired));
+		m_pendingBytes += size;
+		pendingBytes = m_pendingBytes;
+	}
+
+	// a collect stops every thread, so only once enough has piled up and never in the middle of a batch
+	if (pendingBytes >= CollectThreshold && ProtectionBatch::active() == nullptr)
+		collect();
+}
+
+size_t PLH::Reclaimer::collect() {
+	std::vector<Retired> released;
+	size_t pending = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (m_retired.empty())
+			return 0;
+
+		// sized before any thread is stopped, nothing may allocate while they are
+		std::vector<uint8_t> referenced(m_retired.size(), 0);
+		{
+			ThreadQuiescer quiescer;
+			quiescer.forEachThreadContext([this, &referenced] (const CONTEXT& ctx) {
+				markReferenced(ctx, referenced);
+			});
+		}
+
+		std::vector<Retired> kept;
+		for (size_t i = 0; i < m_retired.size(); i++) {
+			if (referenced[i])
+				kept.push_back(std::move(m_retired[i]));
+			else
+				released.push_back(std::move(m_retired[i]));
+		}
+		m_retired = std::move(kept);
+		pending = m_retired.size();
+
+		m_pendingBytes = 0;
+		for (const Retired& retired : m_retired)
+			m_pendingBytes += retired.size;
+	}
+
+	for (const Retired& retired : released)
+		retired.release();
+	return pending;
+}
+
+bool PLH::Reclaimer::drain(const std::chrono::milliseconds timeout) {
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	while (collect() > 0) {
+		if (std::chrono::steady_clock::now() >= deadline) {
+			ErrorLog::singleton().push("Hook memory still in use, left pending", ErrorLevel::WARN);
+			return false;
+		}
+		Sleep(1);
+	}
+	return true;
+}
+
+size_t PLH::Reclaimer::getPendingCount() {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_retired.size();
+}
+
+void PLH::Reclaimer::markReferenced(const CONTEXT& ctx, std::vector<uint8_t>& referenced) const {
+	auto mark = [this, &referenced] (const uint64_t value) {
+		for (size_t i = 0; i < m_retired.size(); i++) {
+			if (value >= m_retired[i].address && value < m_retired[i].address + m_retired[i].size)
+				referenced[i] = 1;
+		}
+	};
+
+#ifdef _WIN64
+	const uint64_t sp = ctx.Rsp;
+	for (const uint64_t reg : { ctx.Rip, ctx.Rax, ctx.Rcx, ctx.Rdx, ctx.Rbx, ctx.Rbp, ctx.Rsi, ctx.Rdi,
+								ctx.R8, ctx.R9, ctx.R10, ctx.R11, ctx.R12, ctx.R13, ctx.R14, ctx.R15 })
+		mark(reg);
+#else
+	const uint64_t sp = ctx.Esp;
+	for (const uint64_t reg : { ctx.Eip, ctx.Eax, ctx.Ecx, ctx.Edx, ctx.Ebx, ctx.Ebp, ctx.Esi, ctx.Edi })
+		mark(reg);
+#endif
+
+	/* The committed region holding the stack pointer runs up to the stack base, everything live on the stack is
+	in it. The guard page below is a separate region and never read.*/
+	MEMORY_BASIC_INFORMATION mbi;
+	if (!VirtualQuery((char*)sp, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT || (mbi.Protect & PAGE_GUARD))
+		return;
+
+	const uint64_t stackEnd = (uint64_t)mbi.BaseAddress + mbi.RegionSize;
+	for (uint64_t word = sp & ~(uint64_t)(sizeof(uintptr_t) - 1); word + sizeof(uintptr_t) <= stackEnd; word += sizeof(uintptr_t))
+		mark(*(uintptr_t*)word);
+}
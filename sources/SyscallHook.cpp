@@ -0,0 +1,323 @@
+#include "headers/Detour/SyscallHook.hpp"
+#include <algorithm>
+#include <intrin.h>
+
+namespace {
+// set while this thread runs a handler, its own syscalls go straight through instead of recursing into it
+thread_local bool t_inHandler = false;
+
+/* Called by every stub with the context and the hook's handler. A thread's TLS isn't set up yet during the first
+syscalls the loader makes for it, those go straight through too rather than faulting on the flag.*/
+bool dispatchSyscall(PLH::SyscallContext* ctx, const PLH::tSyscallHandler handler) {
+#ifdef _WIN64
+	if (__readgsqword(0x58) == 0) // TEB ThreadLocalStoragePointer
+		return true;
+#endif
+	if (t_inHandler)
+		return true;
+
+	t_inHandler = true;
+	const bool makeSyscall = handler(ctx);
+	t_inHandler = false;
+	return makeSyscall;
+}
+}
+
+PLH::SyscallHook::SyscallHook(const tSyscallHandler handler, PLH::ADisassembler& dis) : m_disasm(dis) {
+	assert(handler != nullptr);
+	m_handler = handler;
+	m_hooked = false;
+}
+
+PLH::SyscallHook::~SyscallHook() {
+	if (m_hooked)
+		unHook();
+}
+
+void PLH::SyscallHook::addModule(const uint64_t moduleBase) {
+	assert(!m_hooked);
+	m_modules.push_back(moduleBase);
+}
+
+bool PLH::SyscallHook::addModule(const std::wstring& moduleName) {
+	HMODULE module = GetModuleHandleW(moduleName.c_str());
+	if (module == NULL) {
+		ErrorLog::singleton().push("Module to restrict syscall hook to is not loaded", ErrorLevel::SEV);
+		return false;
+	}
+
+	addModule((uint64_t)module);
+	return true;
+}
+
+bool PLH::SyscallHook::hook() {
+	assert(!m_hooked);
+#ifndef _WIN64
+	ErrorLog::singleton().push("Syscall hooks are only supported on x64", ErrorLevel::SEV);
+	return false;
+#else
+	std::vector<uint64_t> modules = m_modules;
+	if (modules.empty()) {
+		for (const wchar_t* name : { L"ntdll.dll", L"win32u.dll" }) {
+			if (HMODULE module = GetModuleHandleW(name))
+				modules.push_back((uint64_t)module);
+		}
+	}
+
+	std::vector<Site> sites;
+	for (const uint64_t module : modules) {
+		std::vector<std::pair<uint64_t, uint64_t>> sections;
+		if (!getExecutableSections(module, sections))
+			continue;
+
+		for (const auto& section : sections)
+			scanSection(section.first, section.second, sites);
+	}
+
+	if (sites.empty()) {
+		ErrorLog::singleton().push("No hookable syscall sites found", ErrorLevel::WARN);
+		return false;
+	}
+
+	// every stub is built before any site is touched, no thread can be in them if one fails
+	auto freeStubs = [&sites] () {
+		for (const Site& site : sites) {
+			if (site.stub != 0)
+				Reclaimer::singleton().freeBlock(site.stub);
+		}
+	};
+
+	const uint64_t maxDist = 0x7FF00000;
+	for (Site& site : sites) {
+		// the size doesn't depend on where the stub lands, size it as if at the site
+		std::vector<uint8_t> code;
+		if (!makeStub(site, site.address, code)) {
+			freeStubs();
+			return false;
+		}
+		site.stubSz = code.size();
+
+		const uint64_t regionStart = site.address > maxDist ? site.address - maxDist : 0;
+		const uint64_t block = Reclaimer::singleton().getBlock(site.stubSz, regionStart, 2 * maxDist);
+		if (block == 0 || !makeStub(site, block, code)) {
+			if (block != 0)
+				Reclaimer::singleton().freeBlock(block);
+			ErrorLog::singleton().push("Failed to allocate syscall stub within +-2GB", ErrorLevel::SEV);
+			freeStubs();
+			return false;
+		}
+		site.stub = block;
+		memcpy((char*)site.stub, code.data(), code.size());
+	}
+
+	/* Threads stopped in the leading instructions, or at the syscall itself, would slide through the nops into
+	whatever follows without making the call. They continue at the same place in the stub, at the syscall that's
+	its dispatch code. Threads in the kernel have their user mode instruction pointer after the syscall, which
+	isn't overwritten.*/
+	std::map<uint64_t, uint64_t> ipFixups;
+	std::vector<std::vector<uint8_t>> patches;
+	for (Site& site : sites) {
+		const uint64_t start = site.leading.front().getAddress();
+		const uint64_t end = site.address + 2;
+		site.original.assign((uint8_t*)start, (uint8_t*)end);
+
+		for (size_t i = 1; i < site.leading.size(); i++)
+			ipFixups[site.leading[i].getAddress()] = site.stub + site.stubOffsets[i];
+		ipFixups[site.address] = site.stub + site.stubOffsets.back();
+
+		std::vector<uint8_t> patch(end - start, 0x90);
+		patch[0] = 0xE9;
+		const int32_t disp = Instruction::calculateRelativeDisplacement<int32_t>(start, site.stub, 5);
+		memcpy(&patch[1], &disp, 4);
+		patches.push_back(std::move(patch));
+	}
+
+	const size_t nonAtomic = patchSites(sites, patches, ipFixups);
+	if (nonAtomic > 0)
+		ErrorLog::singleton().push(std::to_string(nonAtomic) + " syscall sites couldn't be written atomically, unaligned start", ErrorLevel::WARN);
+
+	m_sites.clear();
+	for (const Site& site : sites)
+		m_sites.push_back(site.address);
+
+	ErrorLog::singleton().push("Hooked " + std::to_string(sites.size()) + " syscall sites", ErrorLevel::INFO);
+	m_hookedSites = std::move(sites);
+	m_hooked = true;
+	return true;
+#endif
+}
+
+bool PLH::SyscallHook::unHook() {
+	assert(m_hooked);
+
+	// threads stopped in the stub's copy of the leading instructions go back to the original ones
+	std::map<uint64_t, uint64_t> ipFixups;
+	std::vector<std::vector<uint8_t>> patches;
+	for (const Site& site : m_hookedSites) {
+		for (size_t i = 1; i < site.leading.size(); i++)
+			ipFixups[site.stub + site.stubOffsets[i]] = site.leading[i].getAddress();
+		ipFixups[site.stub + site.stubOffsets.back()] = site.address;
+		patches.push_back(site.original);
+	}
+
+	const size_t nonAtomic = patchSites(m_hookedSites, patches, ipFixups);
+	if (nonAtomic > 0)
+		ErrorLog::singleton().push(std::to_string(nonAtomic) + " syscall sites couldn't be restored atomically, unaligned start", ErrorLevel::WARN);
+
+	{
+		// threads blocked in a syscall made from a stub return into it, it's freed once they're out
+		ProtectionBatch batch;
+		for (const Site& site : m_hookedSites)
+			Reclaimer::singleton().retireBlock(site.stub, site.stubSz);
+	}
+	Reclaimer::singleton().collect();
+
+	m_hookedSites.clear();
+	m_sites.clear();
+	m_hooked = false;
+	return true;
+}
+
+size_t PLH::SyscallHook::patchSites(const std::vector<Site>& sites, const std::vector<std::vector<uint8_t>>& patches,
+									const std::map<uint64_t, uint64_t>& ipFixups) {
+	assert(sites.size() == patches.size());
+
+	/* Every page is made writable before any thread is stopped, VirtualProtect is a syscall the handler may see and
+	the batch allocates. Its protections are restored once the threads run again.*/
+	ProtectionBatch batch;
+	for (const Site& site : sites) {
+		const uint64_t start = site.leading.front().getAddress();
+		MemoryProtector prot(start, site.address + 2 - start, ProtFlag::R | ProtFlag::W | ProtFlag::X);
+	}
+
+	size_t nonAtomic = 0;
+	ThreadQuiescer quiescer;
+	quiescer.fixupInstructionPointers(ipFixups);
+	for (size_t i = 0; i < sites.size(); i++) {
+		if (!atomicPatch(sites[i].leading.front().getAddress(), patches[i]))
+			nonAtomic++;
+	}
+	return nonAtomic;
+}
+
+void PLH::SyscallHook::scanSection(const uint64_t sectionStart, const uint64_t sectionEnd, std::vector<Site>& sites) {
+	// cheap byte scan for candidates first, only those are disassembled
+	for (uint64_t candidate = sectionStart; candidate + 2 <= sectionEnd; candidate++) {
+		if (*(uint8_t*)candidate != 0x0F || *(uint8_t*)(candidate + 1) != 0x05)
+			continue;
+
+		Site site;
+		if (!planSite(candidate, sectionStart, site))
+			continue;
+
+		// back to back syscalls can't both be overwritten
+		if (!sites.empty() && site.leading.front().getAddress() < sites.back().address + 2)
+			continue;
+
+		sites.push_back(std::move(site));
+	}
+}
+
+bool PLH::SyscallHook::planSite(const uint64_t candidate, const uint64_t sectionStart, Site& site) {
+	// the leading instructions are overwritten too, decodes must agree from before them
+	insts_t insts;
+	uint64_t confirmed = 0;
+	if (!disassembleFromBoundary(m_disasm, candidate, candidate + 2, sectionStart, insts, confirmed)) {
+		ErrorLog::singleton().push("Couldn't confirm the instruction boundaries around a syscall, skipping it", ErrorLevel::INFO);
+		return false;
+	}
+
+	auto syscall = std::find_if(insts.begin(), insts.end(), [candidate] (const Instruction& inst) {
+		return inst.getAddress() == candidate;
+	});
+	if (syscall == insts.end() || syscall->getMnemonic() != "syscall")
+		return false;
+
+	/* The 5 byte jmp covers the syscall and the straight line code right before it, usually the mov eax, number
+	and the check for the int 2e path. Walk back until it fits, but not past anything that doesn't fall through.*/
+	auto first = syscall;
+	uint64_t len = syscall->size();
+	while (len < 5 && first != insts.begin()) {
+		const Instruction& prev = *(first - 1);
+		if (m_disasm.isFuncEnd(prev) || (prev.isBranching() && !m_disasm.isConditionalJump(prev)))
+			break;
+
+		first--;
+		len += first->size();
+	}
+
+	if (len < 5) {
+		ErrorLog::singleton().push("Too little code before syscall to hook it", ErrorLevel::INFO);
+		return false;
+	}
+
+	if (first->getAddress() < confirmed) {
+		ErrorLog::singleton().push("Couldn't confirm the instruction boundaries before a syscall, skipping it", ErrorLevel::INFO);
+		return false;
+	}
+
+	// the jmp's own start is the only place in it that may be branched to
+	const branch_map_t& branchMap = m_disasm.getBranchMap();
+	for (auto inst = first + 1; inst != syscall + 1; inst++) {
+		if (branchMap.find(inst->getAddress()) != branchMap.end()) {
+			ErrorLog::singleton().push("Branch into code before syscall, not hooking it", ErrorLevel::INFO);
+			return false;
+		}
+	}
+
+	site.address = candidate;
+	site.leading.assign(first, syscall);
+	site.stub = 0;
+	site.stubSz = 0;
+	return true;
+}
+
+bool PLH::SyscallHook::makeStub(Site& site, const uint64_t stubAddress, std::vector<uint8_t>& code) const {
+	/* The leading instructions are relocated like a Detour's prologue: short branches are widened and anything
+	relative is pointed back at its original destination. Nothing branches into the overwritten range, so none
+	of those destinations move.*/
+	code.clear();
+	site.stubOffsets.clear();
+	for (Instruction inst : site.leading) {
+		const uint64_t newAddr = stubAddress + code.size();
+		site.stubOffsets.push_back(code.size());
+		if (inst.hasDisplacement() && inst.isDisplacementRelative()) {
+			const uint64_t dest = inst.getDestination();
+			inst.widenShortBranch();
+			inst.setAddress(newAddr);
+			if (inst.getDispSize() < 4 || !IsWithinRel32(newAddr + inst.size(), dest))
+				return false;
+			inst.setDestination(dest);
+		}
+		code.insert(code.end(), inst.getBytes().begin(), inst.getBytes().end());
+	}
+
+	const uint64_t resume = site.address + 2;
+	auto emitJmpBack = [&code, stubAddress, resume] () -> bool {
+		const uint64_t jmpAddr = stubAddress + code.size();
+		if (!IsWithinRel32(jmpAddr + 5, resume))
+			return false;
+
+		emitBytes(code, { 0xE9 });                                  // jmp resume
+		emitImm<int32_t>(code, Instruction::calculateRelativeDisplacement<int32_t>(jmpAddr, resume, 5));
+		return true;
+	};
+
+	// the handler decides, both paths restore the registers it may have changed
+	site.stubOffsets.push_back(code.size());
+	std::vector<uint8_t> restore;
+	emitRestoreContext(restore);
+	emitSaveContext(code);
+	emitBytes(code, { 0x48, 0xBA }); emitImm<uint64_t>(code, (uint64_t)m_handler); // mov rdx, handler
+	emitCallWithContext(code, (uint64_t)&dispatchSyscall);
+	emitBytes(code, { 0x84, 0xC0 });                                // test al, al
+	emitBytes(code, { 0x0F, 0x84 });                                // jz skip
+	emitImm<int32_t>(code, (int32_t)(restore.size() + 2 + 5));
+	code.insert(code.end(), restore.begin(), restore.end());
+	emitBytes(code, { 0x0F, 0x05 });                                // syscall
+	if (!emitJmpBack())
+		return false;
+
+	code.insert(code.end(), restore.begin(), restore.end());        // skip:
+	return emitJmpBack();
+}
@@ -0,0 +1,387 @@
+#include "headers/TableDisassembler.hpp"
+
+#include <algorithm>
+
+namespace {
+enum OpFlag : uint8_t {
+	ModRM = 1,
+	Imm8 = 2,
+	Imm16 = 4,
+	ImmZ = 8,	// 16 bits with an operand size prefix, else 32
+	ImmV = 16,	// as ImmZ, but 64 bits with REX.W
+	MOffs = 32,	// address sized
+	NoX64 = 64,	// invalid in 64 bit mode
+	Bad = 128	// not covered, left to the fallback
+};
+
+struct OpTable {
+	uint8_t flags[256];
+};
+
+constexpr void setRange(OpTable& table, const int first, const int last, const uint8_t flags) {
+	for (int op = first; op <= last; op++)
+		table.flags[op] = flags;
+}
+
+constexpr OpTable makeOneByteTable() {
+	OpTable t = {};
+
+	// add, or, adc, sbb, and, sub, xor, cmp: r/m forms, then al/eax, imm
+	for (int op = 0x00; op < 0x40; op += 8) {
+		setRange(t, op, op + 3, ModRM);
+		t.flags[op + 4] = Imm8;
+		t.flags[op + 5] = ImmZ;
+	}
+	for (const int op : { 0x06, 0x07, 0x0E, 0x16, 0x17, 0x1E, 0x1F, 0x27, 0x2F, 0x37, 0x3F })
+		t.flags[op] = NoX64;
+
+	setRange(t, 0x60, 0x61, NoX64);
+	t.flags[0x62] = ModRM | NoX64;
+	t.flags[0x63] = ModRM;
+	t.flags[0x68] = ImmZ;
+	t.flags[0x69] = ModRM | ImmZ;
+	t.flags[0x6A] = Imm8;
+	t.flags[0x6B] = ModRM | Imm8;
+	setRange(t, 0x70, 0x7F, Imm8);
+	t.flags[0x80] = ModRM | Imm8;
+	t.flags[0x81] = ModRM | ImmZ;
+	t.flags[0x82] = ModRM | Imm8 | NoX64;
+	t.flags[0x83] = ModRM | Imm8;
+	setRange(t, 0x84, 0x8F, ModRM);
+	t.flags[0x9A] = ImmZ | Imm16 | NoX64;
+	setRange(t, 0xA0, 0xA3, MOffs);
+	t.flags[0xA8] = Imm8;
+	t.flags[0xA9] = ImmZ;
+	setRange(t, 0xB0, 0xB7, Imm8);
+	setRange(t, 0xB8, 0xBF, ImmV);
+	setRange(t, 0xC0, 0xC1, ModRM | Imm8);
+	t.flags[0xC2] = Imm16;
+	setRange(t, 0xC4, 0xC5, ModRM | NoX64);
+	t.flags[0xC6] = ModRM | Imm8;
+	t.flags[0xC7] = ModRM | ImmZ;
+	t.flags[0xC8] = Imm16 | Imm8;
+	t.flags[0xCA] = Imm16;
+	t.flags[0xCD] = Imm8;
+	t.flags[0xCE] = NoX64;
+	setRange(t, 0xD0, 0xD3, ModRM);
+	setRange(t, 0xD4, 0xD5, Imm8 | NoX64);
+	t.flags[0xD6] = Bad;
+	setRange(t, 0xD8, 0xDF, ModRM);
+	setRange(t, 0xE0, 0xE7, Imm8);
+	setRange(t, 0xE8, 0xE9, ImmZ);
+	t.flags[0xEA] = ImmZ | Imm16 | NoX64;
+	t.flags[0xEB] = Imm8;
+	setRange(t, 0xF6, 0xF7, ModRM);
+	setRange(t, 0xFE, 0xFF, ModRM);
+	return t;
+}
+
+constexpr OpTable makeTwoByteTable() {
+	OpTable t = {};
+	setRange(t, 0x00, 0xFF, ModRM);
+
+	for (const int op : { 0x04, 0x0A, 0x0C, 0x24, 0x25, 0x26, 0x27, 0x36, 0x39, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+						  0x7A, 0x7B, 0xA6, 0xA7 })
+		t.flags[op] = Bad;
+
+	// syscall, clts, sysret, invd, wbinvd, ud2, femms, wrmsr .. getsec, emms, push/pop fs/gs, cpuid, rsm, bswap
+	for (const int op : { 0x05, 0x06, 0x07, 0x08, 0x09, 0x0B, 0x0E, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x37,
+						  0x77, 0xA0, 0xA1, 0xA2, 0xA8, 0xA9, 0xAA })
+		t.flags[op] = 0;
+	setRange(t, 0xC8, 0xCF, 0);
+
+	t.flags[0x0F] = ModRM | Imm8; // 3dnow, the imm8 is the opcode
+	setRange(t, 0x70, 0x73, ModRM | Imm8);
+	for (const int op : { 0xA4, 0xAC, 0xBA, 0xC2, 0xC4, 0xC5, 0xC6 })
+		t.flags[op] = ModRM | Imm8;
+	setRange(t, 0x80, 0x8F, ImmZ);
+	return t;
+}
+
+constexpr OpTable OneByte = makeOneByteTable();
+constexpr OpTable TwoByte = makeTwoByteTable();
+
+bool isLegacyPrefix(const uint8_t b) {
+	return b == 0x66 || b == 0x67 || b == 0xF0 || b == 0xF2 || b == 0xF3 || b == 0x2E || b == 0x36 || b == 0x3E ||
+		b == 0x26 || b == 0x64 || b == 0x65;
+}
+}
+
+PLH::TableDisassembler::TableDisassembler(PLH::Mode mode, PLH::ADisassembler& fallback) : ADisassembler(mode),
+	m_fallback(fallback) {
+}
+
+bool PLH::TableDisassembler::decode(const uint8_t* code, const size_t avail, const Mode mode, Decoded& out) {
+	const bool x64 = mode == Mode::x64;
+	const size_t limit = std::min<size_t>(avail, PackedInstruction::MaxSize);
+
+	// legacy prefixes, then REX, which only counts if it's right before the opcode
+	size_t i = 0;
+	bool opSz = false, addrSz = false, rep = false, repne = false;
+	uint8_t rex = 0;
+	for (; i < limit; i++) {
+		const uint8_t b = code[i];
+		if (isLegacyPrefix(b)) {
+			opSz |= b == 0x66;
+			addrSz |= b == 0x67;
+			rep |= b == 0xF3;
+			repne |= b == 0xF2;
+			rex = 0;
+		} else if (x64 && (b & 0xF0) == 0x40) {
+			rex = b;
+		} else {
+			break;
+		}
+	}
+	if (i >= limit)
+		return false;
+
+	/* map is 1 for the one byte opcodes, else the escape bytes that select the table: 0x0F, 0x38 (0F 38) or
+	0x3A (0F 3A). Vex and evex prefixes select a map the same way and carry no other length information.*/
+	uint8_t map = 1;
+	uint8_t op = code[i++];
+	uint8_t flags = 0;
+	auto vexMap = [&] (const uint8_t mmmmm) -> bool {
+		if (i >= limit)
+			return false;
+
+		op = code[i++];
+		map = mmmmm == 1 ? 0x0F : mmmmm == 2 ? 0x38 : mmmmm == 3 ? 0x3A : 0;
+		if (map == 0x0F) {
+			if (TwoByte.flags[op] & (Bad | ImmZ))
+				return false;
+			flags = (uint8_t)(op == 0x77 ? 0 : (TwoByte.flags[op] | ModRM));  // vzeroupper/vzeroall have no ModRM
+		} else if (map == 0x38) {
+			flags = ModRM;
+		} else if (map == 0x3A) {
+			flags = ModRM | Imm8;
+		}
+		return map != 0;
+	};
+
+	const bool nextIs11 = i < limit && (code[i] & 0xC0) == 0xC0;
+	if (op == 0x0F) {
+		if (i >= limit)
+			return false;
+
+		op = code[i++];
+		map = 0x0F;
+		flags = TwoByte.flags[op];
+		if (op == 0x38 || op == 0x3A) {
+			if (i >= limit)
+				return false;
+
+			map = op;
+			flags = (uint8_t)(op == 0x3A ? ModRM | Imm8 : ModRM);
+			op = code[i++];
+		}
+	} else if (op == 0xC5 && (x64 || nextIs11)) {
+		// C5 [R vvvv L pp], always map 0F
+		i += 1;
+		if (!vexMap(1))
+			return false;
+	} else if (op == 0xC4 && (x64 || nextIs11)) {
+		// C4 [R X B mmmmm] [W vvvv L pp]
+		if (i + 2 > limit)
+			return false;
+
+		const uint8_t mmmmm = code[i] & 0x1F;
+		i += 2;
+		if (!vexMap(mmmmm))
+			return false;
+	} else if (op == 0x62 && (x64 || nextIs11)) {
+		// 62 [R X B R' 0 0 m m] [W vvvv 1 pp] [z L'L b V' aaa]
+		if (i + 3 > limit)
+			return false;
+
+		const uint8_t mm = code[i] & 0x03;
+		i += 3;
+		if (!vexMap(mm))
+			return false;
+	} else if (op == 0x8F && i < limit && (code[i] & 0x1F) >= 8) {
+		return false; // xop
+	} else {
+		flags = OneByte.flags[op];
+		if (x64 && (flags & NoX64))
+			return false;
+	}
+
+	if (flags & Bad)
+		return false;
+
+	// sse4a extrq/insertq share 0F 78 with vmread and take immediates
+	if (map == 0x0F && op == 0x78 && (opSz || repne))
+		return false;
+
+	uint8_t modRm = 0;
+	bool ripRelative = false, absDisp32 = false;
+	if (flags & ModRM) {
+		if (i >= limit)
+			return false;
+
+		modRm = code[i++];
+		const uint8_t mod = modRm >> 6, rm = modRm & 7;
+
+		// mov to and from control and debug registers always take a register, whatever mod says
+		const bool regOnly = map == 0x0F && op >= 0x20 && op <= 0x23;
+		size_t dispSz = 0;
+		if (mod != 3 && !regOnly) {
+			if (!x64 && addrSz) {
+				dispSz = mod == 1 ? 1 : (mod == 2 || (mod == 0 && rm == 6)) ? 2 : 0;
+			} else {
+				if (rm == 4) {
+					if (i >= limit)
+						return false;
+					if (mod == 0 && (code[i] & 7) == 5)
+						dispSz = 4;
+					i++;
+				}
+
+				if (mod == 0 && rm == 5) {
+					dispSz = 4;
+					ripRelative = x64;
+					absDisp32 = !x64;
+				} else if (mod == 1) {
+					dispSz = 1;
+				} else if (mod == 2) {
+					dispSz = 4;
+				}
+			}
+		}
+		i += dispSz;
+	}
+
+	const uint8_t reg = (modRm >> 3) & 7;
+	if (map == 1 && ((op == 0xFF && reg == 7) || (op == 0xFE && reg >= 2)))
+		return false; // undefined group members
+	const bool relBranch = (map == 1 && ((op >= 0x70 && op <= 0x7F) || (op >= 0xE0 && op <= 0xE3) || op == 0xE8 ||
+										 op == 0xE9 || op == 0xEB)) || (map == 0x0F && op >= 0x80 && op <= 0x8F);
+
+	size_t immSz = 0;
+	if (flags & Imm8)
+		immSz += 1;
+	if (flags & Imm16)
+		immSz += 2;
+	if (flags & ImmZ)
+		immSz += (opSz && !(x64 && relBranch)) ? 2 : 4;  // near branches ignore the prefix in 64 bit mode
+	if (flags & ImmV)
+		immSz += (rex & 0x08) ? 8 : opSz ? 2 : 4;
+	if (flags & MOffs)
+		immSz += x64 ? (addrSz ? 4 : 8) : (addrSz ? 2 : 4);
+	if (map == 1 && op == 0xF6 && reg < 2)
+		immSz += 1;
+	if (map == 1 && op == 0xF7 && reg < 2)
+		immSz += opSz ? 2 : 4;
+
+	i += immSz;
+	if (i > limit)
+		return false;
+
+	out.size = (uint8_t)i;
+	out.instClass = InstClass::Other;
+	out.branching = false;
+	out.needsFull = ripRelative;
+	out.mnemonic = "";
+
+	if (relBranch) {
+		out.branching = true;
+		out.needsFull = true;
+		out.instClass = op == 0xE8 && map == 1 ? InstClass::Call :
+			(op == 0xE9 || op == 0xEB) && map == 1 ? InstClass::Jmp : InstClass::Jcc;
+	} else if (map == 1) {
+		if (op == 0xEA || op == 0x9A) {
+			out.branching = true;
+			out.needsFull = true;
+			out.instClass = op == 0x9A ? InstClass::Call : InstClass::Jmp;
+		} else if (op == 0xFF && reg >= 2 && reg <= 5) {
+			static const char* names[] = { "call", "lcall", "jmp", "ljmp" };
+			out.branching = true;
+			out.instClass = reg <= 3 ? InstClass::Call : InstClass::Jmp;
+			out.mnemonic = names[reg - 2];
+			out.needsFull |= reg == 4 && absDisp32; // jmp [abs32] is relocated as an absolute displacement
+		} else if (op == 0xC3 || op == 0xC2 || op == 0xCB || op == 0xCA) {
+			out.instClass = InstClass::Ret;
+			out.mnemonic = op <= 0xC3 ? "ret" : "retf";
+		} else if (op == 0xCC) {
+			out.instClass = InstClass::Int3;
+			out.mnemonic = "int3";
+		} else if (op == 0x90 && !rep && !opSz && !(rex & 0x01)) {
+			out.instClass = InstClass::Nop;
+			out.mnemonic = "nop";
+		} else if (op == 0xC7 && modRm == 0xF8) {
+			out.needsFull = true; // xbegin rel32
+		}
+	} else if (map == 0x0F) {
+		if (op == 0x1F) {
+			out.instClass = InstClass::Nop;
+			out.mnemonic = "nop";
+		} else if (op == 0x05) {
+			out.mnemonic = "syscall";
+		}
+	}
+	return true;
+}
+
+PLH::insts_t PLH::TableDisassembler::disassemble(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+	insts_t insts;
+	uint64_t offset = 0;
+	while (std::optional<Instruction> inst = disassembleOne(firstInstruction + offset, start + offset, end)) {
+		offset += inst->size();
+		insts.push_back(std::move(*inst));
+	}
+
+	buildBranchMap(insts);
+	return insts;
+}
+
+std::optional<PLH::Instruction> PLH::TableDisassembler::disassembleOne(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+	if (start >= end)
+		return std::nullopt;
+
+	const uint8_t* code = (const uint8_t*)firstInstruction;
+	Decoded decoded = {};
+	if (!decode(code, (size_t)(end - start), m_mode, decoded) || decoded.needsFull) {
+		// only this one instruction, its length is known unless the tables failed
+		const uint64_t window = decoded.needsFull ? decoded.size : std::min<uint64_t>(end - start, PackedInstruction::MaxSize);
+		return m_fallback.disassembleOne(firstInstruction, start, start + window);
+	}
+
+	Instruction::Displacement displacement;
+	displacement.Absolute = 0;
+	Instruction inst(start, displacement, 0, false, (uint8_t*)code, decoded.size, decoded.mnemonic, "", m_mode);
+	inst.setBranching(decoded.branching);
+	return inst;
+}
+
+PLH::packed_insts_t PLH::TableDisassembler::disassemblePacked(uint64_t firstInstruction, uint64_t start, uint64_t end) {
+	packed_insts_t insts;
+	const uint64_t size = end - start;
+	insts.reserve((size_t)(size / 4));
+
+	uint64_t offset = 0;
+	while (offset < size) {
+		const uint8_t* code = (const uint8_t*)(firstInstruction + offset);
+		const uint64_t address = start + offset;
+
+		Decoded decoded = {};
+		if (!decode(code, (size_t)(size - offset), m_mode, decoded) || decoded.needsFull) {
+			const uint64_t window = decoded.needsFull ? decoded.size : std::min<uint64_t>(size - offset, PackedInstruction::MaxSize);
+			packed_insts_t full = m_fallback.disassemblePacked((uint64_t)code, address, address + window);
+			if (full.empty())
+				break;
+
+			insts.push_back(full.front());
+			offset += full.front().size();
+			continue;
+		}
+
+		insts.emplace_back(address, code, decoded.size, decoded.instClass);
+		insts.back().setBranching(decoded.branching);
+		offset += decoded.size;
+	}
+	return insts;
+}
+
+bool PLH::TableDisassembler::decodeText(const PackedInstruction& inst, std::string& mnemonic, std::string& opStr) {
+	return m_fallback.decodeText(inst, mnemonic, opStr);
+}
@@ -0,0 +1,88 @@
+#include "headers/ThreadQuiescer.hpp"
+
+std::atomic<int64_t> PLH::ThreadQuiescer::m_lastPauseNs = 0;
+
+PLH::ThreadQuiescer::ThreadQuiescer() {
+	const DWORD pid = GetCurrentProcessId();
+	const DWORD tid = GetCurrentThreadId();
+
+	// everything that allocates happens before the first thread is stopped
+	std::vector<DWORD> threadIds;
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	if (snapshot == INVALID_HANDLE_VALUE) {
+		ErrorLog::singleton().push("Failed to snapshot threads, nothing suspended", ErrorLevel::WARN);
+		m_pauseStart = std::chrono::steady_clock::now();
+		return;
+	}
+
+	THREADENTRY32 entry;
+	entry.dwSize = sizeof(entry);
+	for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry)) {
+		if (entry.th32OwnerProcessID == pid && entry.th32ThreadID != tid)
+			threadIds.push_back(entry.th32ThreadID);
+	}
+	CloseHandle(snapshot);
+	m_threads.reserve(threadIds.size());
+
+	m_pauseStart = std::chrono::steady_clock::now();
+	for (const DWORD id : threadIds) {
+		HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_SET_CONTEXT, FALSE, id);
+		if (thread == NULL)
+			continue; // exited since the snapshot
+
+		if (SuspendThread(thread) == (DWORD)-1) {
+			CloseHandle(thread);
+			continue;
+		}
+
+		// suspension is asynchronous, reading the context waits until the thread really is stopped
+		CONTEXT ctx;
+		ctx.ContextFlags = CONTEXT_CONTROL;
+		GetThreadContext(thread, &ctx);
+		m_threads.push_back(thread);
+	}
+}
+
+PLH::ThreadQuiescer::~ThreadQuiescer() {
+	for (HANDLE thread : m_threads)
+		ResumeThread(thread);
+
+	const auto pause = std::chrono::steady_clock::now() - m_pauseStart;
+	m_lastPauseNs = std::chrono::duration_cast<std::chrono::nanoseconds>(pause).count();
+
+	for (HANDLE thread : m_threads)
+		CloseHandle(thread);
+}
+
+void PLH::ThreadQuiescer::fixupInstructionPointers(const std::map<uint64_t, uint64_t>& relocations) {
+	if (relocations.empty())
+		return;
+
+	for (HANDLE thread : m_threads) {
+		CONTEXT ctx;
+		ctx.ContextFlags = CONTEXT_CONTROL;
+		if (!GetThreadContext(thread, &ctx))
+			continue;
+
+#ifdef _WIN64
+		auto reloc = relocations.find(ctx.Rip);
+		if (reloc == relocations.end())
+			continue;
+		ctx.Rip = reloc->second;
+#else
+		auto reloc = relocations.find(ctx.Eip);
+		if (reloc == relocations.end())
+			continue;
+		ctx.Eip = (DWORD)reloc->second;
+#endif
+		SetThreadContext(thread, &ctx);
+	}
+}
+
+size_t PLH::ThreadQuiescer::getThreadCount() const {
+	return m_threads.size();
+}
+
+std::chrono::nanoseconds PLH::ThreadQuiescer::getLastPauseDuration() {
+	return std::chrono::nanoseconds(m_lastPauseNs.load());
+}
@@ -4,11 +4,11 @@
 #include "headers/Detour/x64Detour.hpp"
 
 PLH::x64Detour::x64Detour(const uint64_t fnAddress, const uint64_t fnCallback, uint64_t* userTrampVar, PLH::ADisassembler& dis) : PLH::Detour(fnAddress, fnCallback, userTrampVar, dis) {
-
+	m_prefJmpEncoding = JmpEncoding::Rel32;
 }
 
 PLH::x64Detour::x64Detour(const char* fnAddress, const char* fnCallback, uint64_t* userTrampVar, PLH::ADisassembler& dis) : PLH::Detour(fnAddress, fnCallback, userTrampVar, dis) {
-
+	m_prefJmpEncoding = JmpEncoding::Rel32;
 }
 
 PLH::Mode PLH::x64Detour::getArchType() const {
@@ -20,135 +20,146 @@ uint8_t PLH::x64Detour::getMinJmpSize() const {
 }
 
 uint8_t PLH::x64Detour::getPrefJmpSize() const {
-	return 16;
+	// size of the absolute jmp used when rel32 can't be
+	return m_prefJmpEncoding == JmpEncoding::PushRet ? 16 : 14;
 }
 
-bool PLH::x64Detour::hook() {
-	// ------- Must resolve callback first, so that m_disasm branchmap is filled for prologue stuff
-	insts_t callbackInsts = m_disasm.disassemble(m_fnCallback, m_fnCallback, m_fnCallback + 100);
-	if (callbackInsts.size() <= 0) {
-		ErrorLog::singleton().push("Disassembler unable to decode any valid callback instructions", ErrorLevel::SEV);
-		return false;
-	}
-
-	if (!followJmp(callbackInsts)) {
-		ErrorLog::singleton().push("Callback jmp resolution failed", ErrorLevel::SEV);
-		return false;
-	}
-
-	// update given fn callback address to resolved one
-	m_fnCallback = callbackInsts.front().getAddress();
+uint8_t PLH::x64Detour::getNearJmpSize() const {
+	return 5;
+}
 
-	insts_t insts = m_disasm.disassemble(m_fnAddress, m_fnAddress, m_fnAddress + 100);
-	if (insts.size() <= 0) {
-		ErrorLog::singleton().push("Disassembler unable to decode any valid instructions", ErrorLevel::SEV);
-		return false;
-	}
+void PLH::x64Detour::setJmpEncoding(const JmpEncoding encoding) {
+	assert(!m_hooked);
+	m_prefJmpEncoding = encoding;
+}
 
-	if (!followJmp(insts)) {
-		ErrorLog::singleton().push("Prologue jmp resolution failed", ErrorLevel::SEV);
+bool PLH::x64Detour::plan() {
+	assert(!m_hooked && !m_planned);
+	insts_t insts;
+	if (!resolveTargets(insts))
 		return false;
-	}
-
-	// update given fn address to resolved one
-	m_fnAddress = insts.front().getAddress();
 
 	// --------------- END RECURSIVE JMP RESOLUTION ---------------------
-	ErrorLog::singleton().push("Original function:\n" + instsToStr(insts) + "\n", ErrorLevel::INFO);
-
-	uint64_t minProlSz = getPrefJmpSize(); // min size of patches that may split instructions
-	uint64_t roundProlSz = minProlSz; // nearest size to min that doesn't split any instructions
-
+	if (insts.size() > 0)
+		ErrorLog::singleton().push("Original function:\n" + instsToStr(insts) + "\n", ErrorLevel::INFO);
+
+	/* Prefer the 5 byte rel32 jmp, it overwrites the least and costs the least per call. It needs the trampoline
+	within +-2GB of the function so the jmp can reach the callback, or a stub in the trampoline leading to it. If
+	no memory is free that close fall back to an absolute jmp, which needs a larger prologue.*/
+	uint64_t minProlSz = 0;
+	uint64_t roundProlSz = 0;
 	insts_t prologue;
-	{
-		// find the prologue section we will overwrite with jmp + zero or more nops
-		auto prologueOpt = calcNearestSz(insts, minProlSz, roundProlSz);
-		if (!prologueOpt) {
-			ErrorLog::singleton().push("Function too small to hook safely!", ErrorLevel::SEV);
+	insts_t jmpTblOpt;
+
+	m_jmpEncoding = m_prefJmpEncoding;
+	if (m_jmpEncoding == JmpEncoding::Rel32) {
+		if (!calcProlForJmpSz(insts, getNearJmpSize(), prologue, minProlSz, roundProlSz))
 			return false;
-		}
 
-		assert(roundProlSz >= minProlSz);
-		prologue = *prologueOpt;
+		m_originalInsts = prologue;
+		bool allocFailed = false;
+		if (!makeTrampoline(prologue, jmpTblOpt, allocFailed)) {
+			// a prologue that can't be relocated was already logged, only a lack of nearby memory is worked around
+			if (!allocFailed)
+				return false;
 
-		if (!expandProlSelfJmps(prologue, insts, minProlSz, roundProlSz)) {
-			ErrorLog::singleton().push("Function needs a prologue jmp table but it's too small to insert one", ErrorLevel::SEV);
-			return false;
+			ErrorLog::singleton().push("Trampoline within +-2GB failed, falling back to absolute jmp", ErrorLevel::WARN);
+			m_jmpEncoding = JmpEncoding::RipIndirect;
 		}
 	}
 
-	m_originalInsts = prologue;
-	ErrorLog::singleton().push("Prologue to overwrite:\n" + instsToStr(prologue) + "\n", ErrorLevel::INFO);
-	
-	{   // copy all the prologue stuff to trampoline
-		insts_t jmpTblOpt;
-		if (!makeTrampoline(prologue, jmpTblOpt))
+	if (m_jmpEncoding != JmpEncoding::Rel32) {
+		if (!calcProlForJmpSz(insts, getPrefJmpSize(), prologue, minProlSz, roundProlSz))
 			return false;
 
-		ErrorLog::singleton().push("Trampoline:\n" + instsToStr(m_disasm.disassemble(m_trampoline, m_trampoline, m_trampoline + m_trampolineSz)) + "\n", ErrorLevel::INFO);
-		if (jmpTblOpt.size() > 0)
-			ErrorLog::singleton().push("Trampoline Jmp Tbl:\n" + instsToStr(jmpTblOpt) + "\n", ErrorLevel::INFO);
+		m_originalInsts = prologue;
+		jmpTblOpt.clear();
+		bool allocFailed = false;
+		if (!makeTrampoline(prologue, jmpTblOpt, allocFailed))
+			return false;
 	}
 
-	*m_userTrampVar = m_trampoline;
-
-	MemoryProtector prot(m_fnAddress, roundProlSz, ProtFlag::R | ProtFlag::W | ProtFlag::X);
-	auto prolJmp = makex64PreferredJump(m_fnAddress, m_fnCallback);
-	m_disasm.writeEncoding(prolJmp);
-
-	// Nop the space between jmp and end of prologue
-	const uint8_t nopSz = (uint8_t)(roundProlSz - minProlSz);
-	std::memset((char*)(m_fnAddress + minProlSz), 0x90, (size_t)nopSz);
+	ErrorLog::singleton().push("Prologue to overwrite:\n" + instsToStr(m_originalInsts) + "\n", ErrorLevel::INFO);
+	// a cached plan doesn't touch the disassembler at all
+	if (m_planCache == nullptr)
+		ErrorLog::singleton().push("Trampoline:\n" + instsToStr(m_disasm.disassemble(m_trampoline, m_trampoline, m_trampoline + m_trampolineSz)) + "\n", ErrorLevel::INFO);
+	if (jmpTblOpt.size() > 0)
+		ErrorLog::singleton().push("Trampoline Jmp Tbl:\n" + instsToStr(jmpTblOpt) + "\n", ErrorLevel::INFO);
+
+	const uint64_t jmpAddr = m_codeCave ? m_codeCave : m_fnAddress;
+	const uint64_t jmpDest = m_callbackStub ? m_callbackStub : m_fnCallback;
+	insts_t prolJmp;
+	switch (m_jmpEncoding) {
+	case JmpEncoding::Rel32:
+		prolJmp = makex64NearJump(jmpAddr, jmpDest);
+		break;
+	case JmpEncoding::RipIndirect:
+		prolJmp = makex64RipIndirectJump(jmpAddr, jmpDest);
+		break;
+	case JmpEncoding::PushRet:
+		prolJmp = makex64PreferredJump(jmpAddr, jmpDest);
+		break;
+	}
+	ErrorLog::singleton().push("Prologue jmp:\n" + instsToStr(prolJmp) + "\n", ErrorLevel::INFO);
 
-	m_hooked = true;
+	m_prolJmp = prolJmp;
+	m_roundProlSz = roundProlSz;
+	m_planned = true;
 	return true;
 }
 
-bool PLH::x64Detour::makeTrampoline(insts_t& prologue, insts_t& trampolineOut) {
+bool PLH::x64Detour::makeTrampoline(insts_t& prologue, insts_t& trampolineOut, bool& allocFailed) {
 	assert(prologue.size() > 0);
+	assert(m_trampoline == NULL);
+	allocFailed = false;
 	const uint64_t prolStart = prologue.front().getAddress();
 	const uint16_t prolSz = calcInstsSz(prologue);
+	// instructions may grow when relocated, leave room as if all of them do
+	const uint16_t relocProlSz = calcMaxRelocatedSz(prologue);
 	const uint8_t destHldrSz = 8;
 
-	/** Make a guess for the number entries we need so we can try to allocate a trampoline. The allocation
-	address will change each attempt, which changes delta, which changes the number of needed entries. So
-	we just try until we hit that lucky number that works
-	
-	The relocation could also because of data operations too. But that's specific to the function and can't
-	work again on a retry (same function, duh). Return immediately in that case.**/
-	uint8_t neededEntryCount = 5;
+	/* A rel32 prologue jmp must land within the trampoline block. If the callback itself is out of its reach
+	the block also holds a stub that forwards to the callback. In slot mode every prologue jmp goes to the stub,
+	its destination holder is the slot.*/
+	const bool nearTramp = m_jmpEncoding == JmpEncoding::Rel32;
+	const uint64_t jmpAddr = m_codeCave ? m_codeCave : prolStart;
+	const bool needsCallbackStub = m_slotMode || (nearTramp && !IsWithinRel32(jmpAddr + getNearJmpSize(), m_fnCallback));
+	m_callbackStub = NULL;
+	m_slot = NULL;
+
+	/* Size for the worst case, every branch leaving the prologue needing a jmp table entry. The actual
+	count depends on where the trampoline lands, but over-allocating a few bytes beats re-allocating.*/
+	const uint16_t maxEntryCount = calcMaxEntryCount(prologue, prolSz);
 	PLH::insts_t instsNeedingEntry;
 	PLH::insts_t instsNeedingReloc;
 
-	uint8_t retries = 0;
-	do {
-		if (retries++ > 4) {
-			ErrorLog::singleton().push("Failed to calculate trampoline information", ErrorLevel::SEV);
-			return false;
-		}
-
-		if (m_trampoline != NULL) {
-			delete[](unsigned char*)m_trampoline;
-			neededEntryCount = (uint8_t)instsNeedingEntry.size();
-		}
-
-		// prol + jmp back to prol + N * jmpEntries
-		m_trampolineSz = (uint16_t)(prolSz + (getMinJmpSize() + destHldrSz) +
-			(getMinJmpSize() + destHldrSz)* neededEntryCount);
-		m_trampoline = (uint64_t) new unsigned char[m_trampolineSz];
-
-		int64_t delta = m_trampoline - prolStart;
-
-		if (!buildRelocationList(prologue, prolSz, delta, instsNeedingEntry, instsNeedingReloc))
-			return false;
-	} while (instsNeedingEntry.size() > neededEntryCount);
+	// prol + jmp back to prol + N * jmpEntries + optional stub to callback
+	m_trampolineSz = (uint16_t)(relocProlSz + (getMinJmpSize() + destHldrSz) +
+		(getMinJmpSize() + destHldrSz) * (maxEntryCount + (needsCallbackStub ? 1 : 0)));
+	// holders are counted down from the end of the 64 byte aligned block, keep them 8 byte aligned so the slot is
+	m_trampolineSz = (uint16_t)((m_trampolineSz + destHldrSz - 1) & ~(destHldrSz - 1));
+	if (!allocateTrampoline(nearTramp ? prolStart : 0)) {
+		ErrorLog::singleton().push(nearTramp ? "Failed to allocate trampoline within +-2GB of function" : "Failed to allocate trampoline", ErrorLevel::WARN);
+		allocFailed = true;
+		return false;
+	}
 
 	const int64_t delta = m_trampoline - prolStart;
-	MemoryProtector prot(m_trampoline, m_trampolineSz, ProtFlag::R | ProtFlag::W | ProtFlag::X, false);
+	if (!buildRelocationList(prologue, prolSz, delta, instsNeedingEntry, instsNeedingReloc)) {
+		freeTrampoline();
+		return false;
+	}
+	assert(instsNeedingEntry.size() <= maxEntryCount);
 
 	// Insert jmp from trampoline -> prologue after overwritten section
-	const uint64_t jmpToProlAddr = m_trampoline + prolSz;
-	const uint64_t jmpHolderCurAddr = m_trampoline + m_trampolineSz - destHldrSz;
+	const uint64_t jmpToProlAddr = m_relocAddrs.at(prolStart + prolSz);
+	const uint64_t jmpTblStart = jmpToProlAddr + getMinJmpSize();
+	if (!areEntriesInRange(instsNeedingEntry, jmpTblStart, getMinJmpSize())) {
+		freeTrampoline();
+		return false;
+	}
+
+	uint64_t jmpHolderCurAddr = m_trampoline + m_trampolineSz - destHldrSz;
 	{
 		auto jmpToProl = makex64MinimumJump(jmpToProlAddr, prologue.front().getAddress() + prolSz, jmpHolderCurAddr);
 
@@ -157,17 +168,26 @@ bool PLH::x64Detour::makeTrampoline(insts_t& prologue, insts_t& trampolineOut) {
 	}
 
 	// each jmp tbl entries holder is one slot down from the previous
-	auto calcJmpHolder = [=] () -> uint64_t {
-		static uint64_t captureAddr = jmpHolderCurAddr;
-		captureAddr -= destHldrSz;
-		return captureAddr;
+	auto calcJmpHolder = [&jmpHolderCurAddr, destHldrSz] () -> uint64_t {
+		jmpHolderCurAddr -= destHldrSz;
+		return jmpHolderCurAddr;
 	};
 
 	auto makeJmpFn = std::bind(makex64MinimumJump, _1, _2, std::bind(calcJmpHolder));
 
-	uint64_t jmpTblStart = jmpToProlAddr + getMinJmpSize();
-	trampolineOut = relocateTrampoline(prologue, jmpTblStart, delta, getMinJmpSize(),
+	trampolineOut = relocateTrampoline(prologue, jmpTblStart, getMinJmpSize(),
 													makeJmpFn, instsNeedingReloc, instsNeedingEntry);
 
+	// stub goes after the last jmp tbl entry
+	if (needsCallbackStub) {
+		m_callbackStub = jmpTblStart + getMinJmpSize() * instsNeedingEntry.size();
+		const uint64_t stubHolder = calcJmpHolder();
+		auto callbackStub = makex64MinimumJump(m_callbackStub, m_fnCallback, stubHolder);
+		if (m_slotMode)
+			m_slot = stubHolder;
+
+		ErrorLog::singleton().push("Callback Stub:\n" + instsToStr(callbackStub) + "\n", ErrorLevel::INFO);
+		m_disasm.writeEncoding(callbackStub);
+	}
 	return true;
-}
\ No newline at end of file
+}
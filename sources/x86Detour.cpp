@@ -19,60 +19,25 @@ uint8_t PLH::x86Detour::getJmpSize() const {
 	return 5;
 }
 
-bool PLH::x86Detour::hook() {
-	// ------- Must resolve callback first, so that m_disasm branchmap is filled for prologue stuff
-	insts_t callbackInsts = m_disasm.disassemble(m_fnCallback, m_fnCallback, m_fnCallback + 100);
-	if (callbackInsts.size() <= 0) {
-		ErrorLog::singleton().push("Disassembler unable to decode any valid callback instructions", ErrorLevel::SEV);
-		return false;
-	}
-
-	if (!followJmp(callbackInsts)) {
-		ErrorLog::singleton().push("Callback jmp resolution failed", ErrorLevel::SEV);
-		return false;
-	}
-
-	// update given fn callback address to resolved one
-	m_fnCallback = callbackInsts.front().getAddress();
-
-	insts_t insts = m_disasm.disassemble(m_fnAddress, m_fnAddress, m_fnAddress + 100);
-	if (insts.size() <= 0) {
-		ErrorLog::singleton().push("Disassembler unable to decode any valid instructions", ErrorLevel::SEV);
-		return false;
-	}
+uint8_t PLH::x86Detour::getSlotJmpSize() const {
+	return 6;
+}
 
-	if (!followJmp(insts)) {
-		ErrorLog::singleton().push("Prologue jmp resolution failed", ErrorLevel::SEV);
+bool PLH::x86Detour::plan() {
+	assert(!m_hooked && !m_planned);
+	insts_t insts;
+	if (!resolveTargets(insts))
 		return false;
-	}
-
-	// update given fn address to resolved one
-	m_fnAddress = insts.front().getAddress();
 
 	// --------------- END RECURSIVE JMP RESOLUTION ---------------------
+	if (insts.size() > 0)
+		ErrorLog::singleton().push("Original function:\n" + instsToStr(insts) + "\n", ErrorLevel::INFO);
 
-	ErrorLog::singleton().push("Original function:\n" + instsToStr(insts) + "\n", ErrorLevel::INFO);
-
-	uint64_t minProlSz = getJmpSize(); // min size of patches that may split instructions
-	uint64_t roundProlSz = minProlSz; // nearest size to min that doesn't split any instructions
-
+	uint64_t minProlSz = 0;
+	uint64_t roundProlSz = 0;
 	insts_t prologue;
-	{
-		// find the prologue section we will overwrite with jmp + zero or more nops
-		auto prologueOpt = calcNearestSz(insts, minProlSz, roundProlSz);
-		if (!prologueOpt) {
-			ErrorLog::singleton().push("Function too small to hook safely!", ErrorLevel::SEV);
-			return false;
-		}
-
-		assert(roundProlSz >= minProlSz);
-		prologue = *prologueOpt;
-
-		if (!expandProlSelfJmps(prologue, insts, minProlSz, roundProlSz)) {
-			ErrorLog::singleton().push("Function needs a prologue jmp table but it's too small to insert one", ErrorLevel::SEV);
-			return false;
-		}
-	}
+	if (!calcProlForJmpSz(insts, getJmpSize(), prologue, minProlSz, roundProlSz))
+		return false;
 
 	m_originalInsts = prologue;
 	ErrorLog::singleton().push("Prologue to overwrite:\n" + instsToStr(prologue) + "\n", ErrorLevel::INFO);
@@ -82,22 +47,16 @@ bool PLH::x86Detour::hook() {
 		if (!makeTrampoline(prologue, jmpTblOpt))
 			return false;
 
-		ErrorLog::singleton().push("Trampoline:\n" + instsToStr(m_disasm.disassemble(m_trampoline, m_trampoline, m_trampoline + m_trampolineSz)) + "\n", ErrorLevel::INFO);
+		// a cached plan doesn't touch the disassembler at all
+		if (m_planCache == nullptr)
+			ErrorLog::singleton().push("Trampoline:\n" + instsToStr(m_disasm.disassemble(m_trampoline, m_trampoline, m_trampoline + m_trampolineSz)) + "\n", ErrorLevel::INFO);
 		if (jmpTblOpt.size() > 0)
 			ErrorLog::singleton().push("Trampoline Jmp Tbl:\n" + instsToStr(jmpTblOpt) + "\n", ErrorLevel::INFO);
 	}
 
-	*m_userTrampVar = m_trampoline;
-
-	MemoryProtector prot(m_fnAddress, roundProlSz, ProtFlag::R | ProtFlag::W | ProtFlag::X);
-	auto prolJmp = makex86Jmp(m_fnAddress, m_fnCallback);
-	m_disasm.writeEncoding(prolJmp);
-
-	// Nop the space between jmp and end of prologue
-	const uint8_t nopSz = (uint8_t)(roundProlSz - minProlSz);
-	std::memset((char*)(m_fnAddress + minProlSz), 0x90, (size_t)nopSz);
-
-	m_hooked = true;
+	m_prolJmp = makex86Jmp(m_codeCave ? m_codeCave : m_fnAddress, m_callbackStub ? m_callbackStub : m_fnCallback);
+	m_roundProlSz = roundProlSz;
+	m_planned = true;
 	return true;
 }
 
@@ -105,51 +64,58 @@ bool PLH::x86Detour::makeTrampoline(insts_t& prologue, insts_t& trampolineOut) {
 	assert(prologue.size() > 0);
 	const uint64_t prolStart = prologue.front().getAddress();
 	const uint16_t prolSz = calcInstsSz(prologue);
+	// instructions may grow when relocated, leave room as if all of them do
+	const uint16_t relocProlSz = calcMaxRelocatedSz(prologue);
 
-	/** Make a guess for the number entries we need so we can try to allocate a trampoline. The allocation
-	address will change each attempt, which changes delta, which changes the number of needed entries. So
-	we just try until we hit that lucky number that works.
-	
-	The relocation could also because of data operations too. But that's specific to the function and can't
-	work again on a retry (same function, duh). Return immediately in that case.
-	**/
-	uint8_t neededEntryCount = 5;
+	/* Size for the worst case, every branch leaving the prologue needing a jmp table entry. The actual
+	count depends on where the trampoline lands, but over-allocating a few bytes beats re-allocating.*/
+	const uint16_t maxEntryCount = calcMaxEntryCount(prologue, prolSz);
 	PLH::insts_t instsNeedingEntry;
 	PLH::insts_t instsNeedingReloc;
 
-	uint8_t retries = 0;
-	do {
-		if (retries++ > 4) {
-			ErrorLog::singleton().push("Failed to calculate trampoline information", ErrorLevel::SEV);
-			return false;
-		}
-
-		if (m_trampoline != NULL) {
-			delete[](unsigned char*)m_trampoline;
-			neededEntryCount = (uint8_t)instsNeedingEntry.size();
-		}
-
-		// prol + jmp back to prol + N * jmpEntries
-		m_trampolineSz = (uint16_t)(prolSz + getJmpSize() + getJmpSize() * neededEntryCount);
-		m_trampoline = (uint64_t) new unsigned char[m_trampolineSz];
-
-		int64_t delta = m_trampoline - prolStart;
-
-		if (!buildRelocationList(prologue, prolSz, delta, instsNeedingEntry, instsNeedingReloc))
-			return false;
-	} while (instsNeedingEntry.size() > neededEntryCount);
+	// prol + jmp back to prol + N * jmpEntries
+	m_trampolineSz = (uint16_t)(relocProlSz + getJmpSize() + getJmpSize() * maxEntryCount);
+
+	/* In slot mode the prologue jmps to a jmp [slot] stub after the jmp table, the slot is the last 8 byte
+	aligned pointer of the block. Only 4 bytes of it are used.*/
+	m_callbackStub = NULL;
+	m_slot = NULL;
+	if (m_slotMode)
+		m_trampolineSz = (uint16_t)(((m_trampolineSz + getSlotJmpSize() + 7) & ~7) + 8);
+	if (!allocateTrampoline()) {
+		ErrorLog::singleton().push("Failed to allocate trampoline", ErrorLevel::SEV);
+		return false;
+	}
 
 	const int64_t delta = m_trampoline - prolStart;
-	MemoryProtector prot(m_trampoline, m_trampolineSz, ProtFlag::R | ProtFlag::W | ProtFlag::X, false);
+	if (!buildRelocationList(prologue, prolSz, delta, instsNeedingEntry, instsNeedingReloc)) {
+		freeTrampoline();
+		return false;
+	}
+	assert(instsNeedingEntry.size() <= maxEntryCount);
 
 	// Insert jmp from trampoline -> prologue after overwritten section
-	const uint64_t jmpToProlAddr = m_trampoline + prolSz;
+	const uint64_t jmpToProlAddr = m_relocAddrs.at(prolStart + prolSz);
+	const uint64_t jmpTblStart = jmpToProlAddr + getJmpSize();
+	if (!areEntriesInRange(instsNeedingEntry, jmpTblStart, getJmpSize())) {
+		freeTrampoline();
+		return false;
+	}
+
 	{
 		auto jmpToProl = makex86Jmp(jmpToProlAddr, prologue.front().getAddress() + prolSz);
 		m_disasm.writeEncoding(jmpToProl);
 	}
 
-	uint64_t jmpTblStart = jmpToProlAddr + getJmpSize();
-	trampolineOut = relocateTrampoline(prologue, jmpTblStart, delta, getJmpSize(), makex86Jmp, instsNeedingReloc, instsNeedingEntry);
+	trampolineOut = relocateTrampoline(prologue, jmpTblStart, getJmpSize(), makex86Jmp, instsNeedingReloc, instsNeedingEntry);
+
+	if (m_slotMode) {
+		m_callbackStub = jmpTblStart + getJmpSize() * instsNeedingEntry.size();
+		m_slot = m_trampoline + m_trampolineSz - 8;
+		auto callbackStub = makex86IndirectJmp(m_callbackStub, m_fnCallback, m_slot);
+
+		ErrorLog::singleton().push("Callback Stub:\n" + instsToStr(callbackStub) + "\n", ErrorLevel::INFO);
+		m_disasm.writeEncoding(callbackStub);
+	}
 	return true;
 }
\ No newline at end of file